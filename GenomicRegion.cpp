@@ -34,30 +34,25 @@ using std::ostringstream;
 using std::unordered_map;
 using std::runtime_error;
 
-unordered_map<string, chrom_id_type> SimpleGenomicRegion::fw_table_in;
-unordered_map<chrom_id_type, string> SimpleGenomicRegion::fw_table_out;
-
 chrom_id_type
-SimpleGenomicRegion::assign_chrom(const std::string &c) {
-  unordered_map<string, chrom_id_type>::const_iterator
-    chr_id(fw_table_in.find(c));
-  if (chr_id == fw_table_in.end()) {
-    const chrom_id_type r = fw_table_in.size();
-    fw_table_in[c] = r;
-    fw_table_out[r] = c;
-    // return r;
-  }
-  // else return chr_id->second;
-  return fw_table_in[c];
+ChromNameTable::insert(const string &c) {
+  std::lock_guard<std::mutex> lock(insert_mutex);
+  unordered_map<string, chrom_id_type>::const_iterator chr_id(ids.find(c));
+  if (chr_id != ids.end())
+    return chr_id->second;
+  const size_t i = n_names.load(std::memory_order_relaxed);
+  if (i >= std::numeric_limits<chrom_id_type>::max())
+    throw runtime_error("too many chrom names");
+  const size_t seg = seg_index(i + 1);
+  if (segs[seg] == nullptr)
+    segs[seg] = new string[size_t(1) << seg];
+  segs[seg][i + 1 - (size_t(1) << seg)] = c;
+  ids.insert(std::make_pair(c, static_cast<chrom_id_type>(i)));
+  n_names.store(i + 1, std::memory_order_release);
+  return i;
 }
 
-
-string
-SimpleGenomicRegion::retrieve_chrom(chrom_id_type i) {
-  unordered_map<chrom_id_type, string>::const_iterator chr_name(fw_table_out.find(i));
-  assert(chr_name != fw_table_out.end());
-  return chr_name->second;
-}
+ChromNameTable SimpleGenomicRegion::chrom_table;
 
 
 SimpleGenomicRegion::SimpleGenomicRegion(const GenomicRegion &r) :
@@ -144,7 +139,7 @@ SimpleGenomicRegion::distance(const SimpleGenomicRegion& other) const {
 
 bool
 SimpleGenomicRegion::operator<(const SimpleGenomicRegion& rhs) const {
-  return (get_chrom() < rhs.get_chrom() ||
+  return (chrom_table.name(chrom) < chrom_table.name(rhs.chrom) ||
           (chrom == rhs.chrom &&
            (start < rhs.start ||
             (start == rhs.start && (end < rhs.end)))));
@@ -152,7 +147,7 @@ SimpleGenomicRegion::operator<(const SimpleGenomicRegion& rhs) const {
 
 bool
 SimpleGenomicRegion::less1(const SimpleGenomicRegion& rhs) const {
-  return (get_chrom() < rhs.get_chrom() ||
+  return (chrom_table.name(chrom) < chrom_table.name(rhs.chrom) ||
           (chrom == rhs.chrom &&
            (end < rhs.end ||
             (end == rhs.end && start < rhs.start))));
@@ -177,28 +172,26 @@ SimpleGenomicRegion::operator!=(const SimpleGenomicRegion& rhs) const {
 
 #include <iostream>
 
-unordered_map<string, chrom_id_type> GenomicRegion::fw_table_in;
-unordered_map<chrom_id_type, string> GenomicRegion::fw_table_out;
+ChromNameTable GenomicRegion::chrom_table;
 
-chrom_id_type
-GenomicRegion::assign_chrom(const std::string &c) {
-  unordered_map<string, chrom_id_type>::const_iterator chr_id(fw_table_in.find(c));
-  if (chr_id == fw_table_in.end()) {
-    const chrom_id_type r = fw_table_in.size();
-    fw_table_in[c] = r;
-    fw_table_out[r] = c;
-    return r;
-  }
-  else return chr_id->second;
-}
 using std::cerr;
 using std::endl;
 
-string
-GenomicRegion::retrieve_chrom(chrom_id_type i) {
-  unordered_map<chrom_id_type, string>::const_iterator chr_name(fw_table_out.find(i));
-  assert(chr_name != fw_table_out.end());
-  return chr_name->second;
+void
+GenomicRegion::set_chrom(const char *new_chrom, const size_t len) {
+  // sorted input rarely changes chrom, so try the current chrom and
+  // the one last interned on this thread before taking the table lock
+  if (chrom_table.name(chrom).compare(0, string::npos, new_chrom, len) == 0)
+    return;
+  static thread_local chrom_id_type last_chrom =
+    std::numeric_limits<chrom_id_type>::max();
+  if (last_chrom < chrom_table.size() &&
+      chrom_table.name(last_chrom).compare(0, string::npos,
+                                           new_chrom, len) == 0) {
+    chrom = last_chrom;
+    return;
+  }
+  chrom = last_chrom = assign_chrom(string(new_chrom, len));
 }
 
 
@@ -234,14 +227,24 @@ GenomicRegion::retrieve_chrom(chrom_id_type i) {
 //     strand = parts[5][0];
 // }
 
-GenomicRegion::GenomicRegion(const char *s, const size_t len) {
+/* Locates the six BED fields in a line without copying any of them;
+ * the chrom and name are returned as offsets into the line. Shared by
+ * the GenomicRegion and ArenaGenomicRegion parsers.
+ */
+static void
+scan_bed_fields(const char *s, const size_t len,
+                size_t &chrom_beg, size_t &chrom_len,
+                size_t &start, size_t &end,
+                size_t &name_beg, size_t &name_len,
+                float &score, char &strand) {
   size_t i = 0;
 
   // the chrom
   while (isspace(s[i]) && i < len) ++i;
   size_t j = i;
   while (!isspace(s[i]) && i < len) ++i;
-  chrom = assign_chrom(string(s + j, i - j));
+  chrom_beg = j;
+  chrom_len = i - j;
 
   // start of the region (a positive integer)
   while (isspace(s[i]) && i < len) ++i;
@@ -259,7 +262,8 @@ GenomicRegion::GenomicRegion(const char *s, const size_t len) {
   while (isspace(s[i]) && i < len) ++i;
   j = i;
   while (!isspace(s[i]) && i < len) ++i;
-  name = string(s + j, i - j);
+  name_beg = j;
+  name_len = i - j;
 
   // score of the region (floating point)
   while (isspace(s[i]) && i < len) ++i;
@@ -277,6 +281,14 @@ GenomicRegion::GenomicRegion(const char *s, const size_t len) {
   if (strand != '-') strand = '+';
 }
 
+GenomicRegion::GenomicRegion(const char *s, const size_t len) {
+  size_t chrom_beg = 0, chrom_len = 0, name_beg = 0, name_len = 0;
+  scan_bed_fields(s, len, chrom_beg, chrom_len, start, end,
+                  name_beg, name_len, score, strand);
+  chrom = assign_chrom(string(s + chrom_beg, chrom_len));
+  name = string(s + name_beg, name_len);
+}
+
 string
 GenomicRegion::tostring() const {
   std::ostringstream s;
@@ -350,7 +362,7 @@ GenomicRegion::operator<(const GenomicRegion& rhs) const {
                (strand < rhs.strand
                 // || (strand == rhs.strand && name < rhs.name)
                 )))))) ||
-          get_chrom() < rhs.get_chrom());
+          chrom_table.name(chrom) < chrom_table.name(rhs.chrom));
 }
 
 
@@ -364,7 +376,7 @@ GenomicRegion::less1(const GenomicRegion& rhs) const {
                (strand < rhs.strand
                 // || (strand == rhs.strand && name < rhs.name)
                 )))))) ||
-          get_chrom() < rhs.get_chrom());
+          chrom_table.name(chrom) < chrom_table.name(rhs.chrom));
 }
 
 
@@ -474,3 +486,99 @@ ReadBEDFile(const string &filename, vector<SimpleGenomicRegion> &the_regions) {
     if (!is_header_line(line) && !is_track_line(line))
       the_regions.push_back(SimpleGenomicRegion(line));
 }
+
+
+void
+ReadBEDFile(const string &filename, vector<ArenaGenomicRegion> &the_regions,
+            RegionNameArena &arena) {
+
+  std::ifstream in(filename);
+  if (!in)
+    throw runtime_error("cannot open input file " + filename);
+
+  string line;
+  while (getline(in, line))
+    if (!is_header_line(line) && !is_track_line(line))
+      the_regions.push_back(ArenaGenomicRegion(line, arena));
+}
+
+
+RegionNameArena::handle
+RegionNameArena::insert(const char *s, const size_t len) {
+  const size_t offset = buf.size();
+  if (len > length_mask || offset + len > max_offset)
+    throw runtime_error("region name arena capacity exceeded");
+  buf.insert(buf.end(), s, s + len);
+  return (static_cast<handle>(offset) << length_bits) | len;
+}
+
+
+ArenaGenomicRegion::ArenaGenomicRegion(const char *s, const size_t len,
+                                       RegionNameArena &arena) {
+  size_t chrom_beg = 0, chrom_len = 0, name_beg = 0, name_len = 0;
+  scan_bed_fields(s, len, chrom_beg, chrom_len, start, end,
+                  name_beg, name_len, score, strand);
+  chrom = GenomicRegion::assign_chrom(string(s + chrom_beg, chrom_len));
+  name = arena.insert(s + name_beg, name_len);
+}
+
+
+GenomicRegion
+ArenaGenomicRegion::to_genomic_region(const RegionNameArena &arena) const {
+  GenomicRegion r;
+  r.chrom = chrom;
+  r.name = arena.get(name);
+  r.start = start;
+  r.end = end;
+  r.score = score;
+  r.strand = strand;
+  return r;
+}
+
+
+string
+ArenaGenomicRegion::tostring(const RegionNameArena &arena) const {
+  std::ostringstream s;
+  s << get_chrom() << "\t" << start << "\t" << end;
+  if (arena.size(name) > 0) {
+    s << "\t";
+    s.write(arena.data(name), arena.size(name));
+    s << "\t" << score << "\t" << strand;
+  }
+  return s.str();
+}
+
+
+size_t
+ArenaGenomicRegion::distance(const ArenaGenomicRegion &other) const {
+  if (chrom != other.chrom)
+    return std::numeric_limits<size_t>::max();
+  else if (overlaps(other) || other.overlaps(*this))
+    return 0;
+  else return (end < other.start) ?
+         other.start - end + 1 : start - other.end + 1;
+}
+
+
+bool
+ArenaGenomicRegion::operator<(const ArenaGenomicRegion &rhs) const {
+  return ((chrom == rhs.chrom &&
+           (start < rhs.start ||
+            (start == rhs.start &&
+             (end < rhs.end ||
+              (end == rhs.end && strand < rhs.strand))))) ||
+          GenomicRegion::chrom_table.name(chrom) <
+            GenomicRegion::chrom_table.name(rhs.chrom));
+}
+
+
+bool
+ArenaGenomicRegion::less1(const ArenaGenomicRegion &rhs) const {
+  return ((chrom == rhs.chrom &&
+           (end < rhs.end ||
+            (end == rhs.end &&
+             (start < rhs.start ||
+              (start == rhs.start && strand < rhs.strand))))) ||
+          GenomicRegion::chrom_table.name(chrom) <
+            GenomicRegion::chrom_table.name(rhs.chrom));
+}
@@ -32,9 +32,62 @@
 #include <fstream>
 #include <unordered_map>
 #include <limits>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <cassert>
 
 typedef unsigned chrom_id_type;
 
+/* ChromNameTable: interns chrom names as ids 0, 1, 2, ... Names are
+ * stored in segments of doubling size that never move once allocated,
+ * and the number of names is published after each one is stored, so
+ * name() takes no lock and may run while another thread inserts. Only
+ * insert() locks, to find or add the name.
+ */
+class ChromNameTable {
+public:
+  ChromNameTable() : n_names(0) {
+    for (size_t i = 0; i < n_segs; ++i) segs[i] = nullptr;
+  }
+  ~ChromNameTable() {
+    for (size_t i = 0; i < n_segs; ++i) delete[] segs[i];
+  }
+
+  chrom_id_type insert(const std::string &c);
+
+  const std::string &name(const chrom_id_type i) const {
+    const size_t n = n_names.load(std::memory_order_acquire);
+    assert(i < n);
+    (void)n;
+    const size_t j = static_cast<size_t>(i) + 1;
+    const size_t seg = seg_index(j);
+    return segs[seg][j - (size_t(1) << seg)];
+  }
+  size_t size() const {return n_names.load(std::memory_order_acquire);}
+
+private:
+  ChromNameTable(const ChromNameTable &);
+  ChromNameTable &operator=(const ChromNameTable &);
+
+  // segment s holds ids 2^s - 1 through 2^(s+1) - 2
+  static const size_t n_segs = 33;
+  static size_t seg_index(unsigned long long j) {
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(j);
+#else
+    size_t s = 0;
+    while (j >>= 1) ++s;
+    return s;
+#endif
+  }
+
+  std::unordered_map<std::string, chrom_id_type> ids;
+  std::string *segs[n_segs];
+  std::atomic<size_t> n_names;
+  std::mutex insert_mutex;
+};
+
 class GenomicRegion;
 
 class SimpleGenomicRegion {
@@ -97,11 +150,14 @@ public:
                        &separated_by_chrom);
 private:
 
-  static chrom_id_type assign_chrom(const std::string &c);
-  static std::string retrieve_chrom(chrom_id_type i);
+  static chrom_id_type assign_chrom(const std::string &c) {
+    return chrom_table.insert(c);
+  }
+  static std::string retrieve_chrom(chrom_id_type i) {
+    return chrom_table.name(i);
+  }
 
-  static std::unordered_map<std::string, chrom_id_type> fw_table_in;
-  static std::unordered_map<chrom_id_type, std::string> fw_table_out;
+  static ChromNameTable chrom_table;
 
   // std::string chrom;
   chrom_id_type chrom;
@@ -173,9 +229,12 @@ public:
 
   // mutators
   void set_chrom(const std::string &new_chrom) {chrom = assign_chrom(new_chrom);}
+  // no temporary string unless the chrom differs from the current one
+  void set_chrom(const char *new_chrom, const size_t len);
   void set_start(size_t new_start) {start = new_start;}
   void set_end(size_t new_end) {end = new_end;}
   void set_name(const std::string &n) {name = n;}
+  void set_name(const char *n, const size_t len) {name.assign(n, len);}
   void set_score(float s) {score = s;}
   void set_strand(char s) {strand = s;}
 
@@ -198,13 +257,21 @@ public:
                        std::vector<std::vector<GenomicRegion> >
                        &separated_by_chrom);
 
+  // shares the chrom table so conversions do not re-intern names
+  friend class ArenaGenomicRegion;
+  // interns reference names once when a header is parsed
+  friend class sam_header;
+
 private:
 
-  static chrom_id_type assign_chrom(const std::string &c);
-  static std::string retrieve_chrom(chrom_id_type i);
+  static chrom_id_type assign_chrom(const std::string &c) {
+    return chrom_table.insert(c);
+  }
+  static std::string retrieve_chrom(chrom_id_type i) {
+    return chrom_table.name(i);
+  }
 
-  static std::unordered_map<std::string, chrom_id_type> fw_table_in;
-  static std::unordered_map<chrom_id_type, std::string> fw_table_out;
+  static ChromNameTable chrom_table;
 
   // std::string chrom;
   chrom_id_type chrom;
@@ -244,6 +311,127 @@ operator<<(T &the_stream, const GenomicRegion &r) {
 }
 
 
+/* RegionNameArena: a bump allocator for region names. Each name is
+ * appended to one buffer and referred to by a 64-bit handle holding
+ * its offset and length, so handles remain valid as the buffer
+ * grows. There is no per-name release: clear() frees every name at
+ * once, after which all handles are invalid.
+ */
+class RegionNameArena {
+public:
+  typedef uint64_t handle;
+
+  RegionNameArena() {}
+  explicit RegionNameArena(const size_t n_bytes) {buf.reserve(n_bytes);}
+
+  handle insert(const char *s, const size_t len);
+  handle insert(const std::string &s) {return insert(s.data(), s.size());}
+
+  const char *data(const handle h) const {return buf.data() + get_offset(h);}
+  size_t size(const handle h) const {return h & length_mask;}
+  std::string get(const handle h) const {return std::string(data(h), size(h));}
+
+  void reserve(const size_t n_bytes) {buf.reserve(n_bytes);}
+  size_t bytes_used() const {return buf.size();}
+  void clear() {std::vector<char>().swap(buf);}
+
+private:
+  static const size_t length_bits = 24;
+  static const uint64_t length_mask = (1ull << length_bits) - 1;
+  static const uint64_t max_offset = (1ull << (64 - length_bits)) - 1;
+
+  static size_t get_offset(const handle h) {return h >> length_bits;}
+
+  std::vector<char> buf;
+};
+
+
+/* ArenaGenomicRegion: same fields and ordering as GenomicRegion, but
+ * the name lives in a RegionNameArena owned by the caller (the
+ * container or reader), and the region only holds its handle. This
+ * avoids one heap allocation per region when names are longer than
+ * the small-string buffer. Accessors that need the name take the
+ * arena as an argument.
+ */
+class ArenaGenomicRegion {
+public:
+  ArenaGenomicRegion() : chrom(GenomicRegion::assign_chrom("(NULL)")),
+                         name(0), start(0), end(0), score(0), strand('+') {}
+  ArenaGenomicRegion(std::string c, size_t sta, size_t e) :
+    chrom(GenomicRegion::assign_chrom(c)), name(0),
+    start(sta), end(e), score(0.0), strand('+') {}
+  ArenaGenomicRegion(std::string c, size_t sta, size_t e,
+                     const std::string &n, float sc, char str,
+                     RegionNameArena &arena) :
+    chrom(GenomicRegion::assign_chrom(c)), name(arena.insert(n)),
+    start(sta), end(e), score(sc), strand(str) {}
+  ArenaGenomicRegion(const GenomicRegion &r, RegionNameArena &arena) :
+    chrom(r.chrom), name(arena.insert(r.name)), start(r.start), end(r.end),
+    score(r.score), strand(r.strand) {}
+  ArenaGenomicRegion(const char *s, const size_t len, RegionNameArena &arena);
+  ArenaGenomicRegion(const std::string &line, RegionNameArena &arena) :
+    ArenaGenomicRegion(line.c_str(), line.length(), arena) {}
+
+  GenomicRegion to_genomic_region(const RegionNameArena &arena) const;
+  std::string tostring(const RegionNameArena &arena) const;
+
+  // accessors
+  std::string get_chrom() const {return GenomicRegion::retrieve_chrom(chrom);}
+  size_t get_start() const {return start;}
+  size_t get_end() const {return end;}
+  size_t get_width() const {return (end > start) ? end - start : 0;}
+  std::string get_name(const RegionNameArena &arena) const {
+    return arena.get(name);
+  }
+  RegionNameArena::handle get_name_handle() const {return name;}
+  float get_score() const {return score;}
+  char get_strand() const {return strand;}
+  bool pos_strand() const {return (strand == '+');}
+  bool neg_strand() const {return (strand == '-');}
+
+  // mutators
+  void set_chrom(const std::string &new_chrom) {
+    chrom = GenomicRegion::assign_chrom(new_chrom);
+  }
+  void set_start(size_t new_start) {start = new_start;}
+  void set_end(size_t new_end) {end = new_end;}
+  // the previous name stays in the arena until it is cleared
+  void set_name(const std::string &n, RegionNameArena &arena) {
+    name = arena.insert(n);
+  }
+  void set_name_handle(const RegionNameArena::handle h) {name = h;}
+  void set_score(float s) {score = s;}
+  void set_strand(char s) {strand = s;}
+
+  // comparison functions
+  bool contains(const ArenaGenomicRegion &other) const {
+    return chrom == other.chrom && start <= other.start && other.end <= end;
+  }
+  bool overlaps(const ArenaGenomicRegion &other) const {
+    return chrom == other.chrom &&
+      ((start < other.end && other.end <= end) ||
+       (start <= other.start && other.start < end) ||
+       other.contains(*this));
+  }
+  size_t distance(const ArenaGenomicRegion &other) const;
+  bool operator<(const ArenaGenomicRegion &rhs) const;
+  bool less1(const ArenaGenomicRegion &rhs) const;
+  bool operator<=(const ArenaGenomicRegion &rhs) const {return !(rhs < *this);}
+
+  bool same_chrom(const ArenaGenomicRegion &other) const {
+    return chrom == other.chrom;
+  }
+
+private:
+  chrom_id_type chrom;
+  RegionNameArena::handle name;
+  size_t start;
+  size_t end;
+  float score;
+  char strand;
+};
+
+
 template <class T, class U>
 void
 sync_chroms(const std::vector<std::vector<T> > &stable,
@@ -394,6 +582,12 @@ void
 ReadBEDFile(const std::string &filename,
             std::vector<SimpleGenomicRegion> &regions);
 
+// names are appended to the arena, which must outlive the regions
+void
+ReadBEDFile(const std::string &filename,
+            std::vector<ArenaGenomicRegion> &regions,
+            RegionNameArena &arena);
+
 template <class T> void
 WriteBEDFile(const std::string filename,
              const std::vector<std::vector<T> > &regions,
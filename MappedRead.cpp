@@ -27,35 +27,96 @@
 #include <algorithm>
 #include <sstream>
 #include <string>
+#include <cstdlib>
+#include <cctype>
+#include <limits>
 
 using std::string;
 using std::runtime_error;
 
 MappedRead::MappedRead(const string &line) {
-  std::istringstream is;
-  is.rdbuf()->pubsetbuf(const_cast<char*>(line.c_str()), line.size());
-
-  string chrom, name, tmp;
-  size_t start = 0ul, end = 0ul;
-  char strand = '\0';
-  double score;
-  if (is >> chrom >> start >> tmp) {
-    if (find_if(tmp.begin(), tmp.end(),
-                [](char c) {return !std::isdigit(c);}) == tmp.end()) {
-      end = std::stol(tmp);
-      if (!(is >> name >> score >> strand >> seq))
-        throw runtime_error("bad line in MappedRead file: " + line);
-    }
-    else {
-      name = tmp;
-      if (!(is >> score >> strand >> seq))
-        throw runtime_error("bad line in MappedRead file: " + line);
-      end = start + seq.length();
-    }
-    r = GenomicRegion(chrom, start, end, name, score, strand);
-    is >> scr;
+  assign(line.data(), line.size());
+}
+
+static void
+throw_bad_line(const char *line, const size_t len) {
+  throw runtime_error("bad line in MappedRead file: " + string(line, len));
+}
+
+static bool
+is_field_sep(const char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+    c == '\v' || c == '\f';
+}
+
+static bool
+all_digits(const char *s, const size_t len) {
+  for (size_t i = 0; i < len; ++i)
+    if (!std::isdigit(static_cast<unsigned char>(s[i]))) return false;
+  return true;
+}
+
+// false if the value does not fit, as stol would throw
+static bool
+digits_to_size_t(const char *s, const size_t len, size_t &x) {
+  static const size_t max_val = std::numeric_limits<size_t>::max();
+  x = 0;
+  for (size_t i = 0; i < len; ++i) {
+    const size_t d = s[i] - '0';
+    if (x > (max_val - d)/10) return false;
+    x = x*10 + d;
   }
-  else throw runtime_error("bad line in MappedRead file: " + line);
+  return true;
+}
+
+void
+MappedRead::assign(const char *line, const size_t len) {
+  // columns: chrom, start, [end], name, score, strand, seq, [scr]
+  static const size_t max_fields = 8;
+  const char *field[max_fields];
+  size_t field_len[max_fields];
+
+  size_t n_fields = 0, i = 0;
+  while (n_fields < max_fields) {
+    while (i < len && is_field_sep(line[i])) ++i;
+    if (i == len) break;
+    const size_t j = i;
+    while (i < len && !is_field_sep(line[i])) ++i;
+    field[n_fields] = line + j;
+    field_len[n_fields++] = i - j;
+  }
+
+  size_t start = 0;
+  if (n_fields < 3 || !all_digits(field[1], field_len[1]) ||
+      !digits_to_size_t(field[1], field_len[1], start))
+    throw_bad_line(line, len);
+
+  // the third column is either the end or, if missing, the name
+  const bool has_end = all_digits(field[2], field_len[2]);
+  const size_t name_idx = has_end ? 3 : 2;
+  const size_t seq_idx = name_idx + 3;
+  size_t end = 0;
+  if (n_fields <= seq_idx ||
+      (has_end && !digits_to_size_t(field[2], field_len[2], end)))
+    throw_bad_line(line, len);
+
+  double score = 0.0;
+  if (!smithlab::token_to_double(field[name_idx + 1],
+                                 field[name_idx + 1] + field_len[name_idx + 1],
+                                 score))
+    throw_bad_line(line, len);
+
+  seq.assign(field[seq_idx], field_len[seq_idx]);
+  if (n_fields > seq_idx + 1)
+    scr.assign(field[seq_idx + 1], field_len[seq_idx + 1]);
+  else scr.clear();
+
+  r.set_chrom(field[0], field_len[0]);
+  r.set_start(start);
+  r.set_end(has_end ? end : start + seq.length());
+  r.set_name(field[name_idx], field_len[name_idx]);
+  r.set_score(score);
+  r.set_strand(*field[name_idx + 2]);
 }
 
 string
@@ -28,6 +28,11 @@
 struct MappedRead {
   MappedRead() {}
   explicit MappedRead(const std::string &line);
+  // refill this read from a line, tokenized in place; the capacity of
+  // seq, scr and the region name is reused, so refilling the same
+  // object does not allocate once it has grown to the read length
+  void assign(const char *line, const size_t len);
+  void assign(const std::string &line) {assign(line.data(), line.size());}
   GenomicRegion r;
   std::string seq;
   std::string scr;
@@ -38,7 +43,7 @@ template <class T> T&
 operator>>(T &the_stream, MappedRead &mr) {
   std::string buffer;
   if (getline(the_stream, buffer)) {
-    mr = MappedRead(buffer);
+    mr.assign(buffer);
   }
   return the_stream;
 }
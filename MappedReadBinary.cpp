@@ -0,0 +1,547 @@
+/*
+ *    Part of SMITHLAB_CPP software
+ *
+ *    Copyright (C) 2021 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MappedReadBinary.hpp"
+#include "dna_four_bit.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <zlib.h>
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+using std::unordered_map;
+
+/* File layout (all integers little-endian):
+ *   header:  "SMRB", u32 version, u32 qual_mode
+ *   blocks:  u32 n_reads, u32 raw_size, u32 compressed_size, data
+ *   trailer: u8 sorted, u32 n_chroms, {u32 len, name}*,
+ *            u64 n_blocks, {u64 offset, u32 n_reads, u32 first_chrom,
+ *            u64 first_start, u32 last_chrom, u64 last_start}*
+ *   footer:  u64 trailer offset, "SMRB"
+ *
+ * Each read in a block starts with a flag byte, followed by varints;
+ * the start is a zigzag delta from the previous read on the same
+ * chrom in the block.
+ */
+
+static const char mr_binary_magic[] = "SMRB";
+static const size_t mr_binary_magic_len = 4;
+static const uint32_t mr_binary_version = 1;
+static const size_t mr_binary_header_size = mr_binary_magic_len + 8;
+static const size_t mr_binary_block_header_size = 12;
+static const size_t mr_binary_index_entry_size = 36;
+static const size_t mr_binary_footer_size = 8 + mr_binary_magic_len;
+// deflate expands data by at most about 1032:1
+static const uint64_t mr_binary_max_ratio = 1032;
+
+namespace mr_flag {
+  static const uint8_t neg_strand = 0x1;
+  static const uint8_t new_chrom = 0x2;
+  static const uint8_t float_score = 0x4;
+  static const uint8_t has_quals = 0x8;
+  static const uint8_t has_width = 0x10;
+}
+
+static void
+put_u32(string &buf, const uint32_t x) {
+  for (size_t i = 0; i < 4; ++i)
+    buf.push_back(static_cast<char>((x >> (8*i)) & 0xff));
+}
+
+static void
+put_u64(string &buf, const uint64_t x) {
+  for (size_t i = 0; i < 8; ++i)
+    buf.push_back(static_cast<char>((x >> (8*i)) & 0xff));
+}
+
+static uint64_t
+get_le(const unsigned char *p, const size_t n_bytes) {
+  uint64_t x = 0;
+  for (size_t i = 0; i < n_bytes; ++i)
+    x |= static_cast<uint64_t>(p[i]) << (8*i);
+  return x;
+}
+
+static void
+put_varint(string &buf, uint64_t x) {
+  while (x >= 0x80) {
+    buf.push_back(static_cast<char>((x & 0x7f) | 0x80));
+    x >>= 7;
+  }
+  buf.push_back(static_cast<char>(x));
+}
+
+static uint64_t
+zigzag(const int64_t x) {
+  return (static_cast<uint64_t>(x) << 1) ^ static_cast<uint64_t>(x >> 63);
+}
+
+static int64_t
+unzigzag(const uint64_t x) {
+  return static_cast<int64_t>(x >> 1) ^ -static_cast<int64_t>(x & 1);
+}
+
+// Illumina 8-level binning of phred+33 quality characters
+static char
+bin_quality_char(const char c) {
+  const int q = c - 33;
+  const int b = (q < 2) ? q : (q < 10) ? 6 : (q < 20) ? 15 : (q < 25) ? 22 :
+    (q < 30) ? 27 : (q < 35) ? 33 : (q < 40) ? 37 : 40;
+  return static_cast<char>(b + 33);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// Writer
+
+MappedReadBinaryWriter::MappedReadBinaryWriter(const string &fn,
+                                               const mr_binary::qual_mode qm,
+                                               const size_t rpb,
+                                               const int cl) :
+  filename(fn), good(true), sorted(true), quals(qm),
+  reads_per_block(std::max(rpb, static_cast<size_t>(1))),
+  compression_level(cl), prev_chrom(0), prev_start(0) {
+
+  out.open(filename.c_str(), std::ios::binary);
+  if (!out)
+    throw runtime_error("cannot open output file: " + filename);
+
+  string header(mr_binary_magic, mr_binary_magic_len);
+  put_u32(header, mr_binary_version);
+  put_u32(header, static_cast<uint32_t>(quals));
+  out.write(header.data(), header.size());
+
+  curr.n_reads = 0;
+}
+
+MappedReadBinaryWriter::~MappedReadBinaryWriter() {
+  // errors are only reported by an explicit call to close()
+  try {
+    close();
+  }
+  catch (...) {}
+}
+
+void
+MappedReadBinaryWriter::write(const MappedRead &mr) {
+  const bool first_in_block = (curr.n_reads == 0);
+  const bool first_in_file = index.empty() && first_in_block;
+
+  // comparing chrom ids avoids a string per read
+  uint32_t chrom_id = prev_chrom;
+  if (first_in_file || !mr.r.same_chrom(prev_region)) {
+    const string chrom(mr.r.get_chrom());
+    auto the_id = chrom_ids.find(chrom);
+    if (the_id == end(chrom_ids)) {
+      chrom_id = chroms.size();
+      chrom_ids[chrom] = chrom_id;
+      chroms.push_back(chrom);
+    }
+    else chrom_id = the_id->second;
+    prev_region.set_chrom(chrom);
+  }
+
+  const uint64_t start = mr.r.get_start();
+  if (!first_in_file && (chrom_id < prev_chrom ||
+                         (chrom_id == prev_chrom && start < prev_start)))
+    sorted = false;
+
+  const bool new_chrom = first_in_block || chrom_id != prev_chrom;
+  const uint64_t base_start = new_chrom ? 0 : prev_start;
+
+  const float score = mr.r.get_score();
+  const bool float_score = !(score == std::floor(score) &&
+                             std::fabs(score) < 2147483648.0f);
+  const bool has_width = (mr.r.get_end() != start + mr.seq.length());
+  const bool has_quals = (quals != mr_binary::no_quals && !mr.scr.empty());
+
+  uint8_t flags = 0;
+  if (mr.r.neg_strand()) flags |= mr_flag::neg_strand;
+  if (new_chrom) flags |= mr_flag::new_chrom;
+  if (float_score) flags |= mr_flag::float_score;
+  if (has_quals) flags |= mr_flag::has_quals;
+  if (has_width) flags |= mr_flag::has_width;
+  block.push_back(static_cast<char>(flags));
+
+  if (new_chrom)
+    put_varint(block, chrom_id);
+  put_varint(block, zigzag(static_cast<int64_t>(start - base_start)));
+  if (has_width)
+    put_varint(block, zigzag(static_cast<int64_t>(mr.r.get_end() - start)));
+
+  if (float_score) {
+    uint32_t score_bits = 0;
+    std::memcpy(&score_bits, &score, sizeof(score_bits));
+    put_u32(block, score_bits);
+  }
+  else put_varint(block, zigzag(static_cast<int64_t>(score)));
+
+  const string name(mr.r.get_name());
+  put_varint(block, name.size());
+  block.append(name);
+
+  put_varint(block, mr.seq.size());
+  const size_t seq_offset = block.size();
+  block.resize(seq_offset + (mr.seq.size() + 1)/2);
+  encode_dna_four_bit(begin(mr.seq), end(mr.seq), begin(block) + seq_offset);
+
+  if (has_quals) {
+    put_varint(block, mr.scr.size());
+    if (quals == mr_binary::binned_quals)
+      std::transform(begin(mr.scr), end(mr.scr), std::back_inserter(block),
+                     bin_quality_char);
+    else block.append(mr.scr);
+  }
+
+  if (first_in_block) {
+    curr.first_chrom = chrom_id;
+    curr.first_start = start;
+  }
+  curr.last_chrom = chrom_id;
+  curr.last_start = start;
+  ++curr.n_reads;
+
+  prev_chrom = chrom_id;
+  prev_start = start;
+
+  if (curr.n_reads >= reads_per_block)
+    flush_block();
+}
+
+void
+MappedReadBinaryWriter::flush_block() {
+  if (curr.n_reads == 0) return;
+
+  uLongf comp_size = compressBound(block.size());
+  compressed.resize(comp_size);
+  if (compress2(&compressed[0], &comp_size,
+                reinterpret_cast<const Bytef *>(block.data()), block.size(),
+                compression_level) != Z_OK)
+    throw runtime_error("failed to compress block for: " + filename);
+
+  curr.offset = out.tellp();
+  string block_header;
+  put_u32(block_header, curr.n_reads);
+  put_u32(block_header, block.size());
+  put_u32(block_header, comp_size);
+  out.write(block_header.data(), block_header.size());
+  out.write(reinterpret_cast<const char *>(&compressed[0]), comp_size);
+  if (!out)
+    throw runtime_error("failed writing to: " + filename);
+
+  index.push_back(curr);
+  block.clear();
+  curr.n_reads = 0;
+}
+
+void
+MappedReadBinaryWriter::close() {
+  if (!out.is_open()) return;
+  try {
+    flush_block();
+    write_trailer();
+  }
+  catch (...) {
+    // the file is unusable, so do not try to finish it again
+    out.close();
+    good = false;
+    throw;
+  }
+  out.close();
+  good = false;
+}
+
+void
+MappedReadBinaryWriter::write_trailer() {
+  const uint64_t trailer_offset = out.tellp();
+  string trailer;
+  trailer.push_back(sorted ? 1 : 0);
+  put_u32(trailer, chroms.size());
+  for (auto &c : chroms) {
+    put_u32(trailer, c.size());
+    trailer.append(c);
+  }
+  put_u64(trailer, index.size());
+  for (auto &b : index) {
+    put_u64(trailer, b.offset);
+    put_u32(trailer, b.n_reads);
+    put_u32(trailer, b.first_chrom);
+    put_u64(trailer, b.first_start);
+    put_u32(trailer, b.last_chrom);
+    put_u64(trailer, b.last_start);
+  }
+  put_u64(trailer, trailer_offset);
+  trailer.append(mr_binary_magic, mr_binary_magic_len);
+  out.write(trailer.data(), trailer.size());
+  out.flush(); // so errors show before the file is closed
+  if (!out)
+    throw runtime_error("failed writing to: " + filename);
+}
+
+MappedReadBinaryWriter &
+operator<<(MappedReadBinaryWriter &out, const MappedRead &mr) {
+  out.write(mr);
+  return out;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// Reader
+
+static void
+read_bytes(std::ifstream &in, const string &filename,
+           unsigned char *buf, const size_t n_bytes) {
+  if (!in.read(reinterpret_cast<char *>(buf), n_bytes))
+    throw runtime_error("truncated file: " + filename);
+}
+
+static uint64_t
+read_le(std::ifstream &in, const string &filename, const size_t n_bytes) {
+  unsigned char buf[8];
+  read_bytes(in, filename, buf, n_bytes);
+  return get_le(buf, n_bytes);
+}
+
+MappedReadBinaryReader::MappedReadBinaryReader(const string &fn) :
+  filename(fn), good(true), sorted(false), quals(mr_binary::no_quals),
+  trailer_offset(0), block_id(0), block_pos(0), reads_left(0), prev_chrom(0), prev_start(0) {
+
+  in.open(filename.c_str(), std::ios::binary);
+  if (!in)
+    throw runtime_error("cannot open input file: " + filename);
+
+  char magic[mr_binary_magic_len];
+  if (!in.read(magic, mr_binary_magic_len) ||
+      !std::equal(magic, magic + mr_binary_magic_len, mr_binary_magic))
+    throw runtime_error("not a binary mapped reads file: " + filename);
+  if (read_le(in, filename, 4) != mr_binary_version)
+    throw runtime_error("unsupported binary mapped reads version: " +
+                        filename);
+  const uint64_t qual_mode = read_le(in, filename, 4);
+  if (qual_mode > mr_binary::binned_quals)
+    throw runtime_error("unknown quality mode in: " + filename);
+  quals = static_cast<mr_binary::qual_mode>(qual_mode);
+
+  in.seekg(0, std::ios::end);
+  const std::streamoff file_size = in.tellg();
+  if (file_size < static_cast<std::streamoff>(mr_binary_header_size +
+                                              mr_binary_footer_size))
+    throw runtime_error("truncated file: " + filename);
+  in.seekg(file_size - mr_binary_footer_size);
+  trailer_offset = read_le(in, filename, 8);
+  if (!in.read(magic, mr_binary_magic_len) ||
+      !std::equal(magic, magic + mr_binary_magic_len, mr_binary_magic))
+    throw runtime_error("missing index in: " + filename +
+                        " (writer not closed?)");
+
+  // every length read below is checked against the bytes left in the
+  // trailer, so a corrupt file cannot cause a huge allocation
+  const uint64_t trailer_end = file_size - mr_binary_footer_size;
+  if (trailer_offset < mr_binary_header_size || trailer_offset > trailer_end)
+    throw runtime_error("corrupt index in: " + filename);
+  in.seekg(trailer_offset);
+  uint64_t trailer_left = trailer_end - trailer_offset;
+  auto take = [&](const uint64_t n_bytes) {
+    if (n_bytes > trailer_left)
+      throw runtime_error("corrupt index in: " + filename);
+    trailer_left -= n_bytes;
+  };
+
+  take(1 + 4);
+  sorted = (read_le(in, filename, 1) != 0);
+  const uint32_t n_chroms = read_le(in, filename, 4);
+  take(4*static_cast<uint64_t>(n_chroms));
+  chroms.resize(n_chroms);
+  for (uint32_t i = 0; i < n_chroms; ++i) {
+    const uint32_t len = read_le(in, filename, 4);
+    take(len);
+    chroms[i].resize(len);
+    if (!in.read(&chroms[i][0], len))
+      throw runtime_error("truncated file: " + filename);
+    chrom_ids[chroms[i]] = i;
+  }
+  take(8);
+  const uint64_t n_blocks = read_le(in, filename, 8);
+  if (n_blocks > trailer_left/mr_binary_index_entry_size)
+    throw runtime_error("corrupt index in: " + filename);
+  take(n_blocks*mr_binary_index_entry_size);
+  index.resize(n_blocks);
+  for (auto &b : index) {
+    b.offset = read_le(in, filename, 8);
+    b.n_reads = read_le(in, filename, 4);
+    b.first_chrom = read_le(in, filename, 4);
+    b.first_start = read_le(in, filename, 8);
+    b.last_chrom = read_le(in, filename, 4);
+    b.last_start = read_le(in, filename, 8);
+    if (b.offset < mr_binary_header_size ||
+        b.offset + mr_binary_block_header_size > trailer_offset ||
+        b.first_chrom >= n_chroms || b.last_chrom >= n_chroms)
+      throw runtime_error("corrupt index in: " + filename);
+  }
+  seek_block(0);
+}
+
+void
+MappedReadBinaryReader::seek_block(const size_t i) {
+  block_id = i;
+  reads_left = 0;
+  good = (block_id < index.size());
+}
+
+bool
+MappedReadBinaryReader::seek(const string &chrom, const size_t pos) {
+  if (!sorted)
+    throw runtime_error("random access requires sorted input: " + filename);
+  auto the_id = chrom_ids.find(chrom);
+  if (the_id == end(chrom_ids))
+    return false;
+  const uint32_t id = the_id->second;
+  const auto b = std::lower_bound(begin(index), end(index), id,
+                                  [&](const mr_binary_block_info &x,
+                                      const uint32_t c) {
+    return x.last_chrom < c || (x.last_chrom == c && x.last_start < pos);
+  });
+  if (b == end(index))
+    return false;
+  seek_block(std::distance(begin(index), b));
+  return true;
+}
+
+bool
+MappedReadBinaryReader::load_block(const size_t i) {
+  const mr_binary_block_info &info = index[i];
+  in.clear();
+  in.seekg(info.offset);
+  unsigned char block_header[mr_binary_block_header_size];
+  read_bytes(in, filename, block_header, sizeof(block_header));
+  const uint32_t n_reads = get_le(block_header, 4);
+  uLongf raw_size = get_le(block_header + 4, 4);
+  const uint32_t comp_size = get_le(block_header + 8, 4);
+  if (info.offset + mr_binary_block_header_size + comp_size > trailer_offset ||
+      raw_size > mr_binary_max_ratio*comp_size + 64)
+    throw runtime_error("corrupt block in: " + filename);
+
+  compressed.resize(comp_size);
+  read_bytes(in, filename, &compressed[0], comp_size);
+  block.resize(raw_size);
+  if (uncompress(reinterpret_cast<Bytef *>(&block[0]), &raw_size,
+                 &compressed[0], comp_size) != Z_OK ||
+      raw_size != block.size())
+    throw runtime_error("corrupt block in: " + filename);
+
+  block_pos = 0;
+  reads_left = n_reads;
+  return reads_left > 0;
+}
+
+bool
+MappedReadBinaryReader::read(MappedRead &mr) {
+  while (reads_left == 0) {
+    if (block_id >= index.size())
+      return (good = false);
+    load_block(block_id++);
+  }
+
+  const unsigned char *buf =
+    reinterpret_cast<const unsigned char *>(block.data());
+  const size_t buf_size = block.size();
+  auto need = [&](const size_t n) {
+    if (block_pos + n > buf_size)
+      throw runtime_error("corrupt block in: " + filename);
+  };
+  auto get_varint = [&]() {
+    uint64_t x = 0;
+    for (size_t shift = 0; ; shift += 7) {
+      need(1);
+      const unsigned char c = buf[block_pos++];
+      x |= static_cast<uint64_t>(c & 0x7f) << shift;
+      if (!(c & 0x80)) break;
+    }
+    return x;
+  };
+
+  need(1);
+  const uint8_t flags = buf[block_pos++];
+  if (flags & mr_flag::new_chrom) {
+    prev_chrom = get_varint();
+    prev_start = 0;
+    if (prev_chrom >= chroms.size())
+      throw runtime_error("corrupt block in: " + filename);
+  }
+  const uint64_t start = prev_start + unzigzag(get_varint());
+  const int64_t width = (flags & mr_flag::has_width) ?
+    unzigzag(get_varint()) : 0;
+
+  float score = 0.0;
+  if (flags & mr_flag::float_score) {
+    need(4);
+    const uint32_t score_bits = get_le(buf + block_pos, 4);
+    std::memcpy(&score, &score_bits, sizeof(score));
+    block_pos += 4;
+  }
+  else score = unzigzag(get_varint());
+
+  const size_t name_len = get_varint();
+  need(name_len);
+  mr.r.set_name(block.data() + block_pos, name_len);
+  block_pos += name_len;
+
+  const size_t seq_len = get_varint();
+  const size_t packed_len = (seq_len + 1)/2;
+  need(packed_len);
+  mr.seq.resize(2*packed_len);
+  decode_dna_four_bit(buf + block_pos, buf + block_pos + packed_len,
+                      begin(mr.seq));
+  mr.seq.resize(seq_len);
+  block_pos += packed_len;
+
+  if (flags & mr_flag::has_quals) {
+    const size_t scr_len = get_varint();
+    need(scr_len);
+    mr.scr.assign(block.data() + block_pos, scr_len);
+    block_pos += scr_len;
+  }
+  else mr.scr.clear();
+
+  const string &chrom = chroms[prev_chrom];
+  mr.r.set_chrom(chrom.data(), chrom.size());
+  mr.r.set_start(start);
+  mr.r.set_end((flags & mr_flag::has_width) ? start + width :
+               start + seq_len);
+  mr.r.set_score(score);
+  mr.r.set_strand((flags & mr_flag::neg_strand) ? '-' : '+');
+
+  prev_start = start;
+  --reads_left;
+  return good;
+}
+
+MappedReadBinaryReader &
+operator>>(MappedReadBinaryReader &in, MappedRead &mr) {
+  in.read(mr);
+  return in;
+}
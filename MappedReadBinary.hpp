@@ -0,0 +1,156 @@
+/*
+ *    Part of SMITHLAB_CPP software
+ *
+ *    Copyright (C) 2021 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPED_READ_BINARY_HPP
+#define MAPPED_READ_BINARY_HPP
+
+/* A compact binary container for MappedRead. Reads are grouped into
+ * blocks that are compressed independently with zlib. Within a block,
+ * starts are delta-encoded, strand and score are packed into a flag
+ * byte and a varint, sequences use the 4-bit encoding from
+ * dna_four_bit.hpp, and qualities are optional, either verbatim or
+ * binned. The chromosome dictionary and a block index are written at
+ * the end of the file, so the writer needs a single pass and the
+ * reader can jump to any block.
+ *
+ * Note: the 4-bit encoding keeps IUPAC codes but not case, so
+ * sequences are read back in upper case, with any other symbol as N.
+ */
+
+#include "MappedRead.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_map>
+#include <cstdint>
+
+namespace mr_binary {
+  enum qual_mode { no_quals = 0, full_quals = 1, binned_quals = 2 };
+  static const size_t default_reads_per_block = 65536;
+  static const int default_compression_level = 6;
+}
+
+struct mr_binary_block_info {
+  uint64_t offset;
+  uint32_t n_reads;
+  uint32_t first_chrom;
+  uint64_t first_start;
+  uint32_t last_chrom;
+  uint64_t last_start;
+};
+
+class MappedReadBinaryWriter {
+public:
+  MappedReadBinaryWriter(const std::string &filename,
+                         const mr_binary::qual_mode qm = mr_binary::full_quals,
+                         const size_t reads_per_block =
+                         mr_binary::default_reads_per_block,
+                         const int compression_level =
+                         mr_binary::default_compression_level);
+  ~MappedReadBinaryWriter();
+
+  operator bool() const {return good;}
+
+  void write(const MappedRead &mr);
+  // Flushes the final block and writes the dictionary and index. The
+  // destructor closes too but ignores errors, so call this to see them.
+  void close();
+
+private:
+  void flush_block();
+  void write_trailer();
+
+  std::string filename;
+  std::ofstream out;
+  bool good;
+  bool sorted;
+
+  mr_binary::qual_mode quals;
+  size_t reads_per_block;
+  int compression_level;
+
+  std::vector<std::string> chroms;
+  std::unordered_map<std::string, uint32_t> chrom_ids;
+  std::vector<mr_binary_block_info> index;
+
+  // state of the current block
+  std::string block;
+  std::vector<unsigned char> compressed;
+  mr_binary_block_info curr;
+  GenomicRegion prev_region;
+  uint32_t prev_chrom;
+  uint64_t prev_start;
+};
+
+MappedReadBinaryWriter &
+operator<<(MappedReadBinaryWriter &out, const MappedRead &mr);
+
+class MappedReadBinaryReader {
+public:
+  explicit MappedReadBinaryReader(const std::string &filename);
+
+  operator bool() const {return good;}
+
+  bool read(MappedRead &mr);
+
+  const std::vector<std::string> &get_chroms() const {return chroms;}
+  const std::vector<mr_binary_block_info> &get_index() const {return index;}
+  size_t get_n_blocks() const {return index.size();}
+  mr_binary::qual_mode get_qual_mode() const {return quals;}
+
+  // next read returned will be the first of block i
+  void seek_block(const size_t i);
+  // positions at the first block that can hold reads on chrom starting
+  // at or after pos; earlier reads in that block must be skipped by the
+  // caller. Requires input that was sorted when written. Returns false
+  // if no such block exists.
+  bool seek(const std::string &chrom, const size_t pos);
+
+private:
+  bool load_block(const size_t i);
+
+  std::string filename;
+  std::ifstream in;
+  bool good;
+  bool sorted;
+  mr_binary::qual_mode quals;
+  uint64_t trailer_offset; // blocks all end before this
+
+  std::vector<std::string> chroms;
+  std::unordered_map<std::string, uint32_t> chrom_ids;
+  std::vector<mr_binary_block_info> index;
+
+  // state of the current block
+  size_t block_id;
+  std::vector<unsigned char> compressed;
+  std::string block;
+  size_t block_pos;
+  size_t reads_left;
+  uint32_t prev_chrom;
+  uint64_t prev_start;
+};
+
+MappedReadBinaryReader &
+operator>>(MappedReadBinaryReader &in, MappedRead &mr);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ *    Part of SMITHLAB_CPP software
+ *
+ *    Copyright (C) 2021 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MappedReadPipeline.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+static const size_t mr_raw_block_size = 1 << 20;
+static const size_t mr_n_raw_blocks = 4;
+
+MappedReadPipeline::MappedReadPipeline(const string &fn,
+                                       const size_t n_parse_threads,
+                                       const size_t rpb,
+                                       const size_t max_batches_in_flight) :
+  filename(fn), good(true),
+  reads_per_batch(std::max(rpb, static_cast<size_t>(1))),
+  raw_free(mr_n_raw_blocks), raw_full(mr_n_raw_blocks),
+  batch_free(max_batches_in_flight), batch_work(max_batches_in_flight),
+  next_id(0),
+  parsers_running(std::max(n_parse_threads, static_cast<size_t>(1))) {
+
+  // gzread passes uncompressed input through unchanged; stdin is
+  // duplicated so closing the input leaves fd 0 open
+  if (filename == "-") {
+    const int in_fd = dup(fileno(stdin));
+    if (in_fd < 0 || !(in = gzdopen(in_fd, "rb"))) {
+      if (in_fd >= 0) close(in_fd);
+      throw runtime_error("cannot open input file: " + filename);
+    }
+  }
+  else if (!(in = gzopen(filename.c_str(), "rb")))
+    throw runtime_error("cannot open input file: " + filename);
+  gzbuffer(in, 128*1024);
+
+  for (size_t i = 0; i < mr_n_raw_blocks; ++i)
+    raw_free.push(string());
+  for (size_t i = 0; i < std::max(max_batches_in_flight,
+                                  static_cast<size_t>(1)); ++i)
+    batch_free.push(line_batch());
+
+  threads.push_back(std::thread(&MappedReadPipeline::read_blocks, this));
+  threads.push_back(std::thread(&MappedReadPipeline::split_lines, this));
+  for (size_t i = 0; i < parsers_running; ++i)
+    threads.push_back(std::thread(&MappedReadPipeline::parse_batches, this));
+}
+
+MappedReadPipeline::~MappedReadPipeline() {
+  stop_all();
+  for (auto &t : threads)
+    t.join();
+  gzclose(in);
+  good = false;
+}
+
+void
+MappedReadPipeline::stop_all() {
+  raw_free.abort();
+  raw_full.abort();
+  batch_free.abort();
+  batch_work.abort();
+}
+
+void
+MappedReadPipeline::set_error(std::exception_ptr e) {
+  {
+    std::lock_guard<std::mutex> lock(done_mutex);
+    if (!error) error = e;
+  }
+  stop_all();
+  done_cv.notify_all();
+}
+
+void
+MappedReadPipeline::read_blocks() {
+  try {
+    string buf;
+    while (raw_free.pop(buf)) {
+      buf.resize(mr_raw_block_size);
+      const int n_read = gzread(in, &buf[0], mr_raw_block_size);
+      if (n_read < 0)
+        throw runtime_error("failed reading input file: " + filename);
+      if (n_read == 0)
+        break;
+      buf.resize(n_read);
+      if (!raw_full.push(std::move(buf)))
+        break;
+    }
+  }
+  catch (...) {
+    set_error(std::current_exception());
+  }
+  raw_full.close();
+}
+
+void
+MappedReadPipeline::split_lines() {
+  try {
+    size_t id = 0;
+    line_batch b;
+    auto start_batch = [&]() {
+      if (!batch_free.pop(b)) return false;
+      b.id = id++;
+      b.text.clear();
+      b.line_ends.clear();
+      return true;
+    };
+
+    bool running = start_batch();
+    size_t line_start = 0; // of the line currently being copied
+    string raw;
+    while (running && raw_full.pop(raw)) {
+      const char *p = raw.data();
+      const char *const lim = p + raw.size();
+      while (running && p != lim) {
+        const char *eol =
+          static_cast<const char *>(std::memchr(p, '\n', lim - p));
+        b.text.append(p, eol ? eol : lim);
+        if (!eol) break; // line continues in the next block
+        p = eol + 1;
+        if (b.text.size() > line_start) // skip empty lines
+          b.line_ends.push_back(b.text.size());
+        line_start = b.text.size();
+        if (b.line_ends.size() == reads_per_batch) {
+          running = batch_work.push(std::move(b)) && start_batch();
+          line_start = 0;
+        }
+      }
+      raw_free.push(std::move(raw));
+    }
+    if (running) {
+      if (b.text.size() > line_start) // no newline at the end
+        b.line_ends.push_back(b.text.size());
+      if (!b.line_ends.empty())
+        batch_work.push(std::move(b));
+    }
+  }
+  catch (...) {
+    set_error(std::current_exception());
+  }
+  batch_work.close();
+}
+
+void
+MappedReadPipeline::parse_batches() {
+  try {
+    line_batch b;
+    while (batch_work.pop(b)) {
+      const size_t n_lines = b.line_ends.size();
+      b.reads.resize(n_lines);
+      size_t line_start = 0;
+      for (size_t i = 0; i < n_lines; ++i) {
+        b.reads[i].assign(b.text.data() + line_start,
+                          b.line_ends[i] - line_start);
+        line_start = b.line_ends[i];
+      }
+      const size_t batch_id = b.id;
+      std::lock_guard<std::mutex> lock(done_mutex);
+      done.insert(std::make_pair(batch_id, std::move(b)));
+      done_cv.notify_all();
+    }
+  }
+  catch (...) {
+    set_error(std::current_exception());
+  }
+  std::lock_guard<std::mutex> lock(done_mutex);
+  --parsers_running;
+  done_cv.notify_all();
+}
+
+bool
+MappedReadPipeline::get_batch(vector<MappedRead> &reads) {
+  std::unique_lock<std::mutex> lock(done_mutex);
+  done_cv.wait(lock, [this] {
+    return error || parsers_running == 0 || done.count(next_id) > 0;
+  });
+  if (error) {
+    good = false;
+    std::rethrow_exception(error);
+  }
+  auto the_batch = done.find(next_id);
+  if (the_batch == end(done))
+    return (good = false);
+
+  line_batch b(std::move(the_batch->second));
+  done.erase(the_batch);
+  ++next_id;
+  lock.unlock();
+
+  reads.swap(b.reads);
+  batch_free.push(std::move(b));
+  return good;
+}
@@ -0,0 +1,98 @@
+/*
+ *    Part of SMITHLAB_CPP software
+ *
+ *    Copyright (C) 2021 University of Southern California and
+ *                       Andrew D. Smith
+ *
+ *    Authors: Andrew D. Smith
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPED_READ_PIPELINE_HPP
+#define MAPPED_READ_PIPELINE_HPP
+
+/* MappedReadPipeline: reads a .mr or .mr.gz file (or "-" for stdin)
+ * on several threads. One thread decompresses fixed-size blocks, one
+ * splits them into batches of lines, and a pool of threads parses
+ * each batch into a vector of MappedRead. Batches are handed back in
+ * file order, one at a time, so consumers may process them in
+ * parallel themselves. Memory is bounded by the number of batches in
+ * flight, and an exception on any thread is rethrown by get_batch.
+ */
+
+#include "MappedRead.hpp"
+#include "thread_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include <zlib.h>
+
+class MappedReadPipeline {
+public:
+  MappedReadPipeline(const std::string &filename,
+                     const size_t n_parse_threads = 2,
+                     const size_t reads_per_batch = 16384,
+                     const size_t max_batches_in_flight = 8);
+  ~MappedReadPipeline();
+
+  operator bool() const {return good;}
+
+  // Swaps the next batch into reads, in file order; the old contents
+  // of reads are recycled to hold a later batch, so passing the same
+  // vector each time avoids reallocation. Returns false at the end.
+  bool get_batch(std::vector<MappedRead> &reads);
+
+private:
+  struct line_batch {
+    size_t id;
+    std::string text;
+    std::vector<size_t> line_ends;
+    std::vector<MappedRead> reads;
+  };
+
+  void read_blocks();
+  void split_lines();
+  void parse_batches();
+  void set_error(std::exception_ptr e);
+  void stop_all();
+
+  std::string filename;
+  gzFile in;
+  bool good;
+  size_t reads_per_batch;
+
+  BoundedQueue<std::string> raw_free;
+  BoundedQueue<std::string> raw_full;
+  BoundedQueue<line_batch> batch_free;
+  BoundedQueue<line_batch> batch_work;
+
+  // parsed batches waiting to be taken in order
+  std::mutex done_mutex;
+  std::condition_variable done_cv;
+  std::map<size_t, line_batch> done;
+  size_t next_id;
+  size_t parsers_running;
+  std::exception_ptr error;
+
+  std::vector<std::thread> threads;
+};
+
+#endif
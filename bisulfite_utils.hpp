@@ -42,6 +42,16 @@ is_a_rich(const sam_rec &sr) {
   return samflags::check(sr.flags, bsflags::read_is_a_rich);
 }
 
+inline bool
+is_t_rich(const sam_rec_view &sv) {
+  return !samflags::check(sv.get_flags(), bsflags::read_is_a_rich);
+}
+
+inline bool
+is_a_rich(const sam_rec_view &sv) {
+  return samflags::check(sv.get_flags(), bsflags::read_is_a_rich);
+}
+
 inline void
 set_t_rich(sam_rec &sr) {
   samflags::unset(sr.flags, bsflags::read_is_a_rich);
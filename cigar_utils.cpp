@@ -14,10 +14,13 @@
  */
 
 #include "cigar_utils.hpp"
+#include "smithlab_utils.hpp"
 
 #include <exception>
 #include <sstream>
 #include <string>
+#include <cstring>
+#include <algorithm>
 
 using std::string;
 using std::to_string;
@@ -57,3 +60,174 @@ apply_cigar(const string &cigar, string &to_inflate,
                         to_string(orig_len));
   to_inflate.swap(inflated_seq);
 }
+
+/////////////////////////////////////////////
+//// packed cigar
+/////////////////////////////////////////////
+
+static const uint8_t cigar_S_code = 4;
+static const uint8_t cigar_M_code = 0;
+
+static bool
+is_S(const uint32_t w) {return (w & 0xf) == cigar_S_code;}
+
+static uint32_t
+to_M(const uint32_t w) {return cigar_word(cigar_word_len(w), cigar_M_code);}
+
+void
+pack_cigar(const string &cigar, packed_cigar &packed) {
+  static const char *ops = "MIDNSHP=XB";
+  packed.clear();
+  if (cigar == "*") return;
+  auto itr(std::begin(cigar));
+  const auto last(std::end(cigar));
+  while (itr != last) {
+    const size_t len = extract_op_count(itr, last);
+    const char *op = (itr == last) ? nullptr : std::strchr(ops, *itr++);
+    if (!op || !*op)
+      throw runtime_error("bad cigar: " + cigar);
+    packed.push_back(cigar_word(len, op - ops));
+  }
+}
+
+void
+append_unpacked_cigar(const packed_cigar &packed, string &cigar) {
+  if (packed.empty()) {
+    cigar.push_back('*');
+    return;
+  }
+  for (auto w : packed) {
+    smithlab::append_uint(cigar, cigar_word_len(w));
+    cigar.push_back(cigar_word_op(w));
+  }
+}
+
+size_t
+cigar_total_ops(const packed_cigar &cigar) {
+  size_t op_count = 0;
+  for (auto w : cigar)
+    op_count += cigar_word_len(w);
+  return op_count;
+}
+
+size_t
+cigar_qseq_ops(const packed_cigar &cigar) {
+  size_t op_count = 0;
+  for (auto w : cigar)
+    if (consumes_query(cigar_word_op(w)))
+      op_count += cigar_word_len(w);
+  return op_count;
+}
+
+size_t
+cigar_rseq_ops(const packed_cigar &cigar) {
+  size_t op_count = 0;
+  for (auto w : cigar)
+    if (consumes_reference(cigar_word_op(w)))
+      op_count += cigar_word_len(w);
+  return op_count;
+}
+
+void
+reverse_cigar(packed_cigar &cigar) {
+  std::reverse(std::begin(cigar), std::end(cigar));
+}
+
+template <class Consumes> static void
+truncate_packed_cigar(packed_cigar &cigar, const size_t target_ops,
+                      Consumes consumes) {
+  // same result as truncating the text form
+  size_t prev_ops = 0, i = 0;
+  for (; i < cigar.size(); ++i) {
+    const size_t curr_ops =
+      consumes(cigar_word_op(cigar[i])) ? cigar_word_len(cigar[i]) : 0;
+    if (prev_ops + curr_ops > target_ops) break;
+    prev_ops += curr_ops;
+  }
+  if (i < cigar.size() && target_ops > prev_ops) {
+    cigar[i] = cigar_word(target_ops - prev_ops, cigar[i] & 0xf);
+    ++i;
+  }
+  cigar.resize(i);
+}
+
+void
+truncate_cigar_q(packed_cigar &cigar, const size_t target_ops) {
+  truncate_packed_cigar(cigar, target_ops, consumes_query);
+}
+
+void
+truncate_cigar_r(packed_cigar &cigar, const size_t target_ops) {
+  truncate_packed_cigar(cigar, target_ops, consumes_reference);
+}
+
+void
+merge_equal_neighbor_cigar_ops(packed_cigar &cigar) {
+  if (cigar.empty()) return;
+  size_t j = 0;
+  for (size_t i = 1; i < cigar.size(); ++i) {
+    if ((cigar[i] & 0xf) == (cigar[j] & 0xf))
+      cigar[j] = cigar_word(cigar_word_len(cigar[j]) + cigar_word_len(cigar[i]),
+                            cigar[j] & 0xf);
+    else cigar[++j] = cigar[i];
+  }
+  cigar.resize(j + 1);
+}
+
+void
+internal_S_to_M(packed_cigar &cigar) {
+  for (size_t i = 1; i + 1 < cigar.size(); ++i)
+    if (is_S(cigar[i])) cigar[i] = to_M(cigar[i]);
+}
+
+void
+terminal_S_to_M(packed_cigar &cigar) {
+  if (!cigar.empty() && is_S(cigar.back())) cigar.back() = to_M(cigar.back());
+}
+
+void
+initial_S_to_M(packed_cigar &cigar) {
+  if (!cigar.empty() && is_S(cigar.front()))
+    cigar.front() = to_M(cigar.front());
+}
+
+size_t
+get_soft_clip_size(const packed_cigar &cigar) {
+  if (cigar.empty()) return 0;
+  size_t r = is_S(cigar.front()) ? cigar_word_len(cigar.front()) : 0;
+  if (cigar.size() > 1 && is_S(cigar.back()))
+    r += cigar_word_len(cigar.back());
+  return r;
+}
+
+size_t
+get_soft_clip_size_start(const packed_cigar &cigar) {
+  return (!cigar.empty() && is_S(cigar.front())) ?
+    cigar_word_len(cigar.front()) : 0;
+}
+
+void
+apply_cigar(const packed_cigar &cigar, string &to_inflate,
+            const char inflation_symbol) {
+  string inflated_seq;
+  size_t i = 0;
+  for (auto w : cigar) {
+    const char op = cigar_word_op(w);
+    const size_t n = cigar_word_len(w);
+    if (consumes_query(op) && i + n > to_inflate.length())
+      break; // reported below
+    if (consumes_reference(op) && consumes_query(op)) {
+      inflated_seq.append(to_inflate, i, n);
+      i += n;
+    }
+    else if (consumes_query(op))
+      i += n;
+    else if (consumes_reference(op))
+      inflated_seq.append(n, inflation_symbol);
+  }
+  if (i != to_inflate.length() || cigar_qseq_ops(cigar) != i)
+    throw runtime_error("inconsistent number of qseq ops in cigar: " +
+                        to_inflate + " " + to_string(cigar_qseq_ops(cigar)) +
+                        " " + to_string(to_inflate.length()));
+  to_inflate.swap(inflated_seq);
+}
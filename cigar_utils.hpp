@@ -19,6 +19,8 @@
 #include <algorithm>
 #include <cctype> // isdigit
 #include <string>
+#include <vector>
+#include <cstdint>
 
 inline bool
 consumes_query(const char op) {
@@ -337,4 +339,82 @@ void
 apply_cigar(const std::string &cigar, std::string &to_inflate,
             const char inflation_symbol = 'N');
 
+/* Packed cigar: one 32-bit word per operation, as in BAM, with the
+ * length in the high 28 bits and the op code in the low 4 bits, codes
+ * indexing "MIDNSHP=XB". The overloads below match the templates for
+ * cigar strings but never parse digits.
+ */
+typedef std::vector<uint32_t> packed_cigar;
+
+inline uint32_t
+cigar_word(const size_t len, const uint8_t code) {
+  return static_cast<uint32_t>(len << 4) | code;
+}
+
+inline size_t
+cigar_word_len(const uint32_t w) {return w >> 4;}
+
+inline char
+cigar_word_op(const uint32_t w) {return "MIDNSHP=XB??????"[w & 0xf];}
+
+// text to packed; "*" gives an empty cigar
+void
+pack_cigar(const std::string &cigar, packed_cigar &packed);
+
+// packed to text, appended to cigar; an empty cigar gives "*"
+void
+append_unpacked_cigar(const packed_cigar &packed, std::string &cigar);
+
+size_t
+cigar_total_ops(const packed_cigar &cigar);
+
+size_t
+cigar_qseq_ops(const packed_cigar &cigar);
+
+size_t
+cigar_rseq_ops(const packed_cigar &cigar);
+
+void
+reverse_cigar(packed_cigar &cigar);
+
+void
+truncate_cigar_q(packed_cigar &cigar, const size_t target_ops);
+
+void
+truncate_cigar_r(packed_cigar &cigar, const size_t target_ops);
+
+void
+merge_equal_neighbor_cigar_ops(packed_cigar &cigar);
+
+void
+internal_S_to_M(packed_cigar &cigar);
+
+void
+terminal_S_to_M(packed_cigar &cigar);
+
+void
+initial_S_to_M(packed_cigar &cigar);
+
+size_t
+get_soft_clip_size(const packed_cigar &cigar);
+
+size_t
+get_soft_clip_size_start(const packed_cigar &cigar);
+
+// the templates above take non-const references, so these keep
+// them from being chosen for a non-const packed cigar
+inline size_t
+get_soft_clip_size(packed_cigar &cigar) {
+  return get_soft_clip_size(static_cast<const packed_cigar &>(cigar));
+}
+
+inline size_t
+get_soft_clip_size_start(packed_cigar &cigar) {
+  return get_soft_clip_size_start(static_cast<const packed_cigar &>(cigar));
+}
+
+void
+apply_cigar(const packed_cigar &cigar, std::string &to_inflate,
+            const char inflation_symbol = 'N');
+
 #endif
@@ -0,0 +1,91 @@
+/* Part of Smith lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "dedup_utils.hpp"
+#include "cigar_utils.hpp"
+
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using std::string;
+
+void
+get_dedup_key(const MappedRead &mr, const bool, dedup_key &k) {
+  // get_chrom returns a copy, but short names fit in the SSO
+  k.chrom = mr.r.get_chrom();
+  k.start = mr.r.get_start();
+  k.end = mr.r.get_end();
+  k.strand = mr.r.get_strand();
+  k.mate_chrom.clear();
+  k.mate_start = 0;
+  k.segment = 0;
+}
+
+void
+get_dedup_key(const sam_rec &sr, const bool paired, dedup_key &k) {
+  k.chrom = sr.rname;
+  k.start = sr.pos;
+  k.end = sr.pos + (sr.has_packed_cigar() ? cigar_rseq_ops(sr.cigar_ops) :
+                    cigar_rseq_ops(sr.cigar));
+  k.strand = check_flag(sr, samflags::read_rc) ? '-' : '+';
+  if (paired && check_flag(sr, samflags::read_paired)) {
+    k.mate_chrom = (sr.rnext == "=") ? sr.rname : sr.rnext;
+    k.mate_start = sr.pnext;
+    k.segment = sr.flags & (samflags::mate_rc | samflags::template_first |
+                            samflags::template_last);
+  }
+  else {
+    k.mate_chrom.clear();
+    k.mate_start = 0;
+    k.segment = 0;
+  }
+}
+
+static size_t
+phred_sum(const string &q) {
+  size_t total = 0;
+  for (auto c : q)
+    total += (c > '!') ? c - '!' : 0;
+  return total;
+}
+
+size_t
+quality_sum(const MappedRead &mr) {
+  return phred_sum(mr.scr);
+}
+
+size_t
+quality_sum(const sam_rec &sr) {
+  return (sr.qual == "*") ? 0 : phred_sum(sr.qual);
+}
+
+size_t
+mismatch_count(const MappedRead &mr) {
+  return static_cast<size_t>(std::max(0.0f, std::round(mr.r.get_score())));
+}
+
+size_t
+mismatch_count(const sam_rec &sr) {
+  // reads without an NM tag are never preferred
+  int64_t nm = 0;
+  return (sr.get_int_tag("NM", nm) && nm >= 0) ?
+    static_cast<size_t>(nm) : std::numeric_limits<size_t>::max();
+}
@@ -0,0 +1,205 @@
+/* Part of Smith lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef DEDUP_UTILS_HPP
+#define DEDUP_UTILS_HPP
+
+#include "MappedRead.hpp"
+#include "sam_record.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include <cstdint>
+
+/* Reads are duplicates if they agree on chrom, start, end and strand;
+ * for paired-end keys they must also agree on the mate position and
+ * on which segment of the template they are. Since input is sorted by
+ * chrom and start, duplicates are always adjacent within one start
+ * position, and that is all the deduplicator keeps in memory.
+ */
+struct dedup_key {
+  std::string chrom;
+  size_t start;
+  size_t end;
+  char strand;
+  // only used for paired-end keys
+  std::string mate_chrom;
+  size_t mate_start;
+  uint16_t segment;
+
+  dedup_key() : start(0), end(0), strand('+'), mate_start(0), segment(0) {}
+  bool same_group(const dedup_key &other) const {
+    return end == other.end && strand == other.strand &&
+      mate_start == other.mate_start && segment == other.segment &&
+      mate_chrom == other.mate_chrom;
+  }
+};
+
+// MappedRead has no mate fields, so paired only matters for sam_rec
+void
+get_dedup_key(const MappedRead &mr, const bool, dedup_key &k);
+
+void
+get_dedup_key(const sam_rec &sr, const bool paired, dedup_key &k);
+
+// Reads that are not grouped but passed to the output as they are:
+// unmapped reads, which all share one key, and secondary and
+// supplementary alignments, which must not replace a primary.
+inline bool
+dedup_passes_through(const MappedRead &) {return false;}
+
+inline bool
+dedup_passes_through(const sam_rec &sr) {
+  return sr.flags & (samflags::read_unmapped | samflags::secondary_aln |
+                     samflags::supplementary_aln);
+}
+
+size_t
+quality_sum(const MappedRead &mr);
+
+size_t
+quality_sum(const sam_rec &sr);
+
+// number of mismatches: the score for MappedRead, NM tag for sam_rec
+size_t
+mismatch_count(const MappedRead &mr);
+
+size_t
+mismatch_count(const sam_rec &sr);
+
+// Criteria for which read to keep from a group: each returns true if
+// the first read should replace the second.
+struct higher_quality_sum {
+  template <class T> bool
+  operator()(const T &a, const T &b) const {
+    return quality_sum(a) > quality_sum(b);
+  }
+};
+
+struct fewer_mismatches {
+  template <class T> bool
+  operator()(const T &a, const T &b) const {
+    return mismatch_count(a) < mismatch_count(b);
+  }
+};
+
+/* StreamingDeduplicator: feed reads sorted by chrom and start through
+ * add(); the best read of each group is passed to the output functor
+ * once the input moves past its start position. Ties keep the read
+ * seen first, and reads are emitted in input order of their groups,
+ * so the output is still sorted. Reads for which dedup_passes_through
+ * holds are emitted unchanged. Call flush() after the last read.
+ */
+template <class T, class Better = fewer_mismatches>
+class StreamingDeduplicator {
+public:
+  explicit StreamingDeduplicator(const bool p = false,
+                                 const Better b = Better()) :
+    paired(p), better(b), n_best(0), n_in(0), n_out(0) {}
+
+  template <class Output> void
+  add(const T &r, Output &out) {
+    get_dedup_key(r, paired, curr);
+    ++n_in;
+    if (dedup_passes_through(r)) {
+      // groups at an earlier position go first, to keep the order
+      if (n_best > 0 && (curr.chrom != keys.front().chrom ||
+                         curr.start != keys.front().start))
+        flush(out);
+      out(r);
+      ++n_out;
+      return;
+    }
+    if (n_best == 0 || curr.chrom != keys.front().chrom ||
+        curr.start != keys.front().start) {
+      check_sorted();
+      flush(out);
+    }
+    auto the_group = group_hash.find(group_hash_value(curr));
+    size_t i = (the_group == end(group_hash)) ? n_best : the_group->second;
+    // hash collisions fall back to a scan of the groups here
+    if (i < n_best && !keys[i].same_group(curr))
+      for (i = 0; i < n_best && !keys[i].same_group(curr); ++i);
+    if (i == n_best) {
+      if (n_best == best.size()) {
+        best.push_back(r);
+        keys.push_back(curr);
+      }
+      else {
+        best[n_best] = r; // reuses the capacity of earlier reads
+        keys[n_best] = curr;
+      }
+      group_hash.insert(std::make_pair(group_hash_value(curr), n_best++));
+    }
+    else if (better(r, best[i]))
+      best[i] = r;
+  }
+
+  template <class Output> void
+  flush(Output &out) {
+    for (size_t i = 0; i < n_best; ++i)
+      out(best[i]);
+    n_out += n_best;
+    n_best = 0;
+    group_hash.clear();
+  }
+
+  size_t get_n_in() const {return n_in;}
+  size_t get_n_out() const {return n_out;}
+
+private:
+  static size_t group_hash_value(const dedup_key &k) {
+    return std::hash<size_t>()(k.end)*31 + std::hash<size_t>()(k.mate_start) +
+      (static_cast<size_t>(k.strand) << 17) + (k.segment << 9) +
+      std::hash<std::string>()(k.mate_chrom);
+  }
+
+  void check_sorted() {
+    if (keys.empty()) { // the first read grouped
+      seen_chroms.insert(curr.chrom);
+      return;
+    }
+    const dedup_key &prev = keys.front();
+    if (curr.chrom == prev.chrom) {
+      if (curr.start < prev.start)
+        throw std::runtime_error("input not sorted by position: " +
+                                 curr.chrom + ":" + std::to_string(curr.start));
+    }
+    else if (!seen_chroms.insert(curr.chrom).second)
+      throw std::runtime_error("input not sorted by chrom: " + curr.chrom);
+  }
+
+  bool paired;
+  Better better;
+
+  // groups at the current start position; the first n_best are in use
+  std::vector<T> best;
+  std::vector<dedup_key> keys;
+  std::unordered_multimap<size_t, size_t> group_hash;
+  size_t n_best;
+
+  dedup_key curr;
+  std::unordered_set<std::string> seen_chroms;
+  size_t n_in;
+  size_t n_out;
+};
+
+#endif
@@ -0,0 +1,137 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef HTSLIB_METHYLATION_HPP
+#define HTSLIB_METHYLATION_HPP
+
+#include "htslib_wrapper.hpp"
+#include "methylation_utils.hpp"
+#include "sam_filter.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+
+/* Counts methylation in an indexed file on n_workers threads, one
+ * chrom per worker at a time; names and seqs are the reference. The
+ * sites of each chrom go to out from the calling thread, in reference
+ * order, as soon as that chrom and all before it are done. Workers
+ * stay at most 2*n_workers chroms ahead of the output, which bounds
+ * the memory held in counts. Records failing the filter, e.g.
+ * "exclude 0xF04,mapq>=10" for duplicates, secondary, QC-failed and
+ * low MAPQ reads, are skipped before they are decoded; unmapped reads
+ * are always skipped.
+ */
+template <class Output> void
+count_methylation(const std::string &filename,
+                  const std::vector<std::string> &names,
+                  const std::vector<std::string> &seqs,
+                  const size_t n_workers, Output &out,
+                  const sam_filter &filter = sam_filter(),
+                  const bool covered_only = true) {
+  const std::vector<sam_shard> shards =
+    make_sam_shards(filename, std::numeric_limits<size_t>::max());
+  std::unordered_map<std::string, size_t> name_idx;
+  for (size_t i = 0; i < names.size(); ++i)
+    name_idx.insert(std::make_pair(names[i], i));
+  std::vector<size_t> seq_idx(shards.size());
+  for (size_t i = 0; i < shards.size(); ++i) {
+    auto the_name = name_idx.find(shards[i].chrom);
+    if (the_name == end(name_idx))
+      throw std::runtime_error("chrom not in reference: " + shards[i].chrom);
+    seq_idx[i] = the_name->second;
+  }
+  const size_t n_threads = std::max(n_workers, static_cast<size_t>(1));
+  const size_t max_ahead = 2*n_threads;
+
+  std::vector<chrom_methylation> counts(shards.size());
+  std::vector<bool> done(shards.size(), false);
+  size_t next_shard = 0, n_written = 0;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::exception_ptr error;
+
+  auto worker = [&]() {
+    try {
+      SAMReader reader(filename);
+      reader.set_filter(filter);
+      sam_rec sr;
+      while (true) {
+        size_t i = 0;
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          cv.wait(lock, [&] {
+            return error || next_shard == shards.size() ||
+              next_shard < n_written + max_ahead;
+          });
+          if (error || next_shard == shards.size()) return;
+          i = next_shard++;
+        }
+        counts[i].init(shards[i].chrom, seqs[seq_idx[i]]);
+        SAMShardReader shard_reader(reader, shards[i]);
+        while (shard_reader.get_sam_record(sr))
+          if (!samflags::check(sr.flags, samflags::read_unmapped))
+            counts[i].count_read(sr);
+        std::lock_guard<std::mutex> lock(mtx);
+        done[i] = true;
+        cv.notify_all();
+      }
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!error) error = std::current_exception();
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < n_threads; ++i)
+    threads.push_back(std::thread(worker));
+  try {
+    for (size_t i = 0; i < shards.size(); ++i) {
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] {return error || done[i];});
+        if (error) break;
+      }
+      counts[i].write_sites(out, covered_only);
+      counts[i].clear();
+      std::lock_guard<std::mutex> lock(mtx);
+      ++n_written;
+      cv.notify_all();
+    }
+  }
+  catch (...) { // from out; stop the workers before leaving
+    std::lock_guard<std::mutex> lock(mtx);
+    if (!error) error = std::current_exception();
+    cv.notify_all();
+  }
+  for (auto &t : threads)
+    t.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+#endif
@@ -20,36 +20,127 @@
 #include <vector>
 #include <fstream>
 #include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <mutex>
+#include <list>
+#include <algorithm>
 
 #include "htslib_wrapper.hpp"
 #include "smithlab_utils.hpp"
 #include "MappedRead.hpp"
+#include "chromosome_utils.hpp"
+#include "sam_filter.hpp"
+
+extern "C" {
+#include <htslib/thread_pool.h>
+#include <htslib/bgzf.h>
+#include <htslib/hfile.h>
+}
 
 using std::string;
 using std::vector;
 using std::cerr;
 using std::endl;
 using std::runtime_error;
+using smithlab::append_uint;
+using smithlab::append_int;
 
 char check_htslib_wrapper() {return 1;}
 
-SAMReader::SAMReader(const string &fn) :
-  filename(fn), good(true) {
+// one BGZF pool for all readers and writers, so opening several
+// files at once does not start a set of threads for each. A pool
+// cannot be resized, so a file asking for more threads than the
+// newest pool has starts a larger one, which later files then share;
+// each pool is destroyed when the last file using it is closed.
+struct shared_pool_entry {
+  htsThreadPool pool;
+  size_t n_threads;
+  size_t n_users;
+};
+static std::mutex shared_pool_mutex;
+static std::list<shared_pool_entry> shared_pools; // newest is largest
+
+static htsThreadPool *
+acquire_shared_pool(const size_t n_threads, size_t &pool_threads) {
+  std::lock_guard<std::mutex> lock(shared_pool_mutex);
+  if (shared_pools.empty() || shared_pools.back().n_threads < n_threads) {
+    shared_pool_entry e = {{nullptr, 0}, n_threads, 0};
+    if (!(e.pool.pool = hts_tpool_init(static_cast<int>(n_threads))))
+      throw runtime_error("failed to create thread pool");
+    shared_pools.push_back(e);
+  }
+  ++shared_pools.back().n_users;
+  pool_threads = shared_pools.back().n_threads;
+  return &shared_pools.back().pool;
+}
+
+static void
+release_shared_pool(htsThreadPool *pool) {
+  std::lock_guard<std::mutex> lock(shared_pool_mutex);
+  auto the_pool = std::find_if(begin(shared_pools), end(shared_pools),
+                               [&](const shared_pool_entry &e) {
+                                 return &e.pool == pool;
+                               });
+  if (the_pool != end(shared_pools) && --the_pool->n_users == 0) {
+    hts_tpool_destroy(the_pool->pool.pool);
+    shared_pools.erase(the_pool);
+  }
+}
 
-  if (!(hts = hts_open(filename.c_str(), "r")))
-    throw runtime_error("cannot open file: " + filename);
+SAMReader::SAMReader(const string &fn, const size_t n_threads) :
+  filename(fn), good(true), hts(0), hdr(0), b(0), thread_pool(nullptr),
+  n_threads(1), idx(0), itr(0), empty_regions(false), packed_cigar(false),
+  timing(false) {
+  try {
+    if (!(hts = hts_open(filename.c_str(), "r")))
+      throw runtime_error("cannot open file: " + filename);
 
-  if (hts_get_format(hts)->category != sequence_data)
-    throw runtime_error("file format appears wrong: " + filename);
+    if (hts_get_format(hts)->category != sequence_data)
+      throw runtime_error("file format appears wrong: " + filename);
 
-  if (!(hdr = sam_hdr_read(hts)))
-    throw runtime_error("failed to read header from file: " + filename);
+    if (!(hdr = sam_hdr_read(hts)))
+      throw runtime_error("failed to read header from file: " + filename);
+    vector<string> names;
+    vector<size_t> lengths;
+    get_chrom_sizes(names, lengths);
+    // ids must be the target ids of the records, whatever the text says
+    header.parse(get_header(), names, lengths);
 
-  if (!(b = bam_init1()))
-    throw runtime_error("failed to read record from file: " + filename);
+    if (!(b = bam_init1()))
+      throw runtime_error("failed to read record from file: " + filename);
+
+    set_threads(n_threads);
+  }
+  catch (...) { // the destructor does not run for a partial object
+    release();
+    throw;
+  }
+}
+
+void
+SAMReader::set_threads(const size_t n) {
+  if (n <= 1 || thread_pool)
+    return;
+  thread_pool = acquire_shared_pool(n, n_threads);
+  if (hts_set_opt(hts, HTS_OPT_THREAD_POOL, thread_pool) < 0)
+    throw runtime_error("failed to set threads for file: " + filename);
 }
 
 SAMReader::~SAMReader() {
+  release();
+}
+
+void
+SAMReader::release() {
+  if (itr) {
+    hts_itr_destroy(itr);
+    itr = 0;
+  }
+  if (idx) {
+    hts_idx_destroy(idx);
+    idx = 0;
+  }
   if (hdr) {
     bam_hdr_destroy(hdr);
     hdr = 0;
@@ -59,13 +150,63 @@ SAMReader::~SAMReader() {
     b = 0;
   }
   if (hts) {
-    assert(hts_close(hts) >= 0);
+    hts_close(hts); // nothing to report for a file only read
     hts = 0;
   }
+  // the pool must outlive the file that uses it
+  if (thread_pool) {
+    release_shared_pool(thread_pool);
+    thread_pool = nullptr;
+    n_threads = 1;
+  }
   good = false;
 }
 
 
+void
+SAMReader::set_region(const GenomicRegion &region) {
+  set_regions(vector<GenomicRegion>(1, region));
+}
+
+void
+SAMReader::set_region(const string &region_name) {
+  string chrom;
+  size_t start = 0, end = 0;
+  parse_region_name(region_name, chrom, start, end);
+  set_region(GenomicRegion(chrom, start, end));
+}
+
+void
+SAMReader::set_regions(const vector<GenomicRegion> &regions) {
+  if (itr) {
+    hts_itr_destroy(itr);
+    itr = 0;
+  }
+  // no regions select no records; sam_itr_regarray rejects an empty set
+  empty_regions = regions.empty();
+  if (empty_regions) {
+    good = false;
+    return;
+  }
+
+  if (!idx && !(idx = sam_index_load(hts, filename.c_str())))
+    throw runtime_error("failed to load index for file: " + filename);
+
+  // htslib regions are 1-based and closed
+  vector<string> names;
+  for (auto &r : regions)
+    names.push_back(r.get_chrom() + ":" + std::to_string(r.get_start() + 1) +
+                    "-" + std::to_string(r.get_end()));
+  vector<char *> name_ptrs;
+  for (auto &n : names)
+    name_ptrs.push_back(&n[0]);
+
+  itr = sam_itr_regarray(idx, hdr, name_ptrs.data(), name_ptrs.size());
+  if (!itr)
+    throw runtime_error("failed to set regions for file: " + filename);
+  good = true;
+}
+
 SAMReader&
 operator>>(SAMReader &reader, sam_rec &aln) {
   reader.get_sam_record(aln);
@@ -76,20 +217,215 @@ operator>>(SAMReader &reader, sam_rec &aln) {
 //// general facility for SAM format
 /////////////////////////////////////////////
 
+/////////////////////////////////////////////
+//// decoding bam1_t directly into sam_rec
+/////////////////////////////////////////////
+
+static void
+append_float(string &s, const double x) {
+  char buf[32];
+  const int n = snprintf(buf, sizeof(buf), "%g", x);
+  s.append(buf, n);
+}
+
+template <class T> static T
+aux_value(const uint8_t *p) {
+  // BAM is little-endian, as are the machines we build on
+  T x;
+  std::memcpy(&x, p, sizeof(T));
+  return x;
+}
+
+static size_t
+aux_type_size(const char type) {
+  switch (type) {
+  case 'A': case 'c': case 'C': return 1;
+  case 's': case 'S': return 2;
+  case 'i': case 'I': case 'f': return 4;
+  default: return 0;
+  }
+}
+
+// appends one numeric aux value of the given type; returns its size
+static size_t
+append_aux_number(string &s, const char type, const uint8_t *p) {
+  switch (type) {
+  case 'c': append_int(s, aux_value<int8_t>(p)); break;
+  case 'C': append_uint(s, aux_value<uint8_t>(p)); break;
+  case 's': append_int(s, aux_value<int16_t>(p)); break;
+  case 'S': append_uint(s, aux_value<uint16_t>(p)); break;
+  case 'i': append_int(s, aux_value<int32_t>(p)); break;
+  case 'I': append_uint(s, aux_value<uint32_t>(p)); break;
+  case 'f': append_float(s, aux_value<float>(p)); break;
+  default: return 0;
+  }
+  return aux_type_size(type);
+}
+
+// appends the aux field at p as SAM text; returns the next field
+static const uint8_t *
+format_aux(const uint8_t *p, const uint8_t *const lim, string &tag) {
+  if (lim - p < 3)
+    throw runtime_error("truncated aux data in BAM record");
+  const string tag_name(reinterpret_cast<const char *>(p), 2);
+  tag.append(tag_name);
+  tag.push_back(':');
+  const char type = p[2];
+  p += 3;
+  if (type == 'A') {
+    if (p == lim)
+      throw runtime_error("truncated aux data in BAM record");
+    tag.append("A:");
+    tag.push_back(*p++);
+  }
+  else if (type == 'Z' || type == 'H') {
+    const uint8_t *z = p;
+    while (z < lim && *z) ++z;
+    if (z == lim)
+      throw runtime_error("unterminated string in BAM aux data");
+    tag.push_back(type);
+    tag.push_back(':');
+    tag.append(reinterpret_cast<const char *>(p), z - p);
+    p = z + 1;
+  }
+  else if (type == 'B') {
+    if (lim - p < 5)
+      throw runtime_error("truncated aux array in BAM record");
+    const char sub_type = p[0];
+    const uint32_t n = aux_value<uint32_t>(p + 1);
+    const size_t width = aux_type_size(sub_type);
+    p += 5;
+    if (width == 0 || static_cast<size_t>(lim - p) < n*width)
+      throw runtime_error("bad aux array in BAM record");
+    tag.append("B:");
+    tag.push_back(sub_type);
+    for (uint32_t i = 0; i < n; ++i, p += width) {
+      tag.push_back(',');
+      append_aux_number(tag, sub_type, p);
+    }
+  }
+  else {
+    // all integer types are written as 'i' in SAM
+    const size_t width = aux_type_size(type);
+    if (width == 0 || static_cast<size_t>(lim - p) < width)
+      throw runtime_error("bad aux type in BAM record: " + tag_name + type);
+    tag.append(type == 'f' ? "f:" : "i:");
+    p += append_aux_number(tag, type, p);
+  }
+  return p;
+}
+
+static void
+bam_to_sam_rec(const bam_hdr_t *hdr, const bam1_t *b, const bool packed_cigar,
+               sam_rec &sr) {
+  static const char *nt16 = "=ACMGRSVTWYHKDBN";
+  const bam1_core_t &c = b->core;
+
+  sr.qname.assign(bam_get_qname(b));
+  sr.flags = c.flag;
+  if (c.tid < 0) sr.rname.assign("*");
+  else sr.rname.assign(hdr->target_name[c.tid]);
+  sr.rname_id = c.tid < 0 ? -1 : c.tid;
+  sr.rnext_id = c.mtid < 0 ? -1 : c.mtid;
+  sr.pos = c.pos + 1;
+  sr.mapq = c.qual;
+
+  sr.cigar.clear();
+  sr.cigar_packed = packed_cigar;
+  const uint32_t *cig = bam_get_cigar(b);
+  if (packed_cigar) // BAM words are already in the packed layout
+    sr.cigar_ops.assign(cig, cig + c.n_cigar);
+  else {
+    sr.cigar_ops.clear();
+    for (uint32_t i = 0; i < c.n_cigar; ++i) {
+      append_uint(sr.cigar, bam_cigar_oplen(cig[i]));
+      sr.cigar.push_back(bam_cigar_opchr(cig[i]));
+    }
+    if (c.n_cigar == 0) sr.cigar.assign("*");
+  }
+
+  if (c.mtid < 0) sr.rnext.assign("*");
+  else if (c.mtid == c.tid) sr.rnext.assign("=");
+  else sr.rnext.assign(hdr->target_name[c.mtid]);
+  sr.pnext = c.mpos + 1;
+  sr.tlen = c.isize;
+
+  const uint8_t *s = bam_get_seq(b);
+  sr.seq.resize(c.l_qseq);
+  for (int32_t i = 0; i < c.l_qseq; ++i)
+    sr.seq[i] = nt16[bam_seqi(s, i)];
+  if (c.l_qseq == 0) sr.seq.assign("*");
+
+  const uint8_t *q = bam_get_qual(b);
+  if (c.l_qseq == 0 || q[0] == 0xff)
+    sr.qual.assign("*");
+  else {
+    sr.qual.resize(c.l_qseq);
+    for (int32_t i = 0; i < c.l_qseq; ++i)
+      sr.qual[i] = q[i] + 33;
+  }
+
+  const uint8_t *aux = bam_get_aux(b);
+  const uint8_t *const aux_lim = aux + bam_get_l_aux(b);
+  sr.tags.clear();
+  while (aux < aux_lim)
+    aux = format_aux(aux, aux_lim, sr.tags.append_tag());
+}
+
+void
+SAMReader::set_filter(const sam_filter &f) {
+  filter.reset(new sam_filter(f));
+  vector<string> names;
+  vector<size_t> sizes;
+  get_chrom_sizes(names, sizes);
+  filter->bind(names);
+}
+
+static bool
+bam_passes_filter(const sam_filter &f, const bam1_t *b) {
+  if (!f.keep_core(b->core.flag, b->core.qual, b->core.tid))
+    return false;
+  for (auto &t : f.get_tag_tests()) {
+    const uint8_t *aux = bam_aux_get(b, t.tag);
+    // bam_aux2i gives 0 for other types; these fail as in keep_tags
+    if (!aux || !std::strchr("cCsSiI", *aux) || !t.test(bam_aux2i(aux)))
+      return false;
+  }
+  return true;
+}
+
+// size of the record as read: see reader_stats for n_bytes
+size_t
+SAMReader::input_bytes() const {
+  if (hts->is_bin || hts->is_cram)
+    return 36 + b->l_data; // block size, fixed fields and data
+  return thread_pool ? 0 : hts->line.l + 1;
+}
+
 bool
 SAMReader::get_sam_record(sam_rec &sr) {
+  if (empty_regions)
+    return good = false;
+  const bool timed = reader_stats::sample(timing, stats.n_records);
+  const double weight = reader_stats::timing_interval;
   int rd_ret = 0;
-  if ((rd_ret = sam_read1(hts, hdr, b)) >= 0) {
-    int fmt_ret = 0;
-    if ((fmt_ret = sam_format1(hdr, b, &hts->line)) <= 0)
-      throw runtime_error("failed reading record from: " + filename);
-    sr = sam_rec(hts->line.s);
-    good = true; //reader.get_sam_record(reader.hts->line.s, sr);
-    // ADS: line below seems to be needed when the file format is SAM
-    // because the hts_getline for parsing SAM format files within
-    // sam_read1 only get called when "(fp->line.l == 0)". For BAM
-    // format, it does not seem to matter.
-    hts->line.l = 0;
+  {
+    scoped_stats_timer t(timed, stats.read_time, weight);
+    rd_ret = itr ? sam_itr_multi_next(hts, itr, b) : sam_read1(hts, hdr, b);
+    while (filter && rd_ret >= 0 && !bam_passes_filter(*filter, b)) {
+      ++stats.n_filtered;
+      stats.n_bytes += input_bytes();
+      rd_ret = itr ? sam_itr_multi_next(hts, itr, b) : sam_read1(hts, hdr, b);
+    }
+  }
+  if (rd_ret >= 0) {
+    // no sam_format1 text round trip; SAM input is parsed into
+    // the bam1_t by sam_read1 as well, so this covers both formats
+    scoped_stats_timer t(timed, stats.decode_time, weight);
+    bam_to_sam_rec(hdr, b, packed_cigar, sr);
+    ++stats.n_records;
+    stats.n_bytes += input_bytes();
+    good = true;
   }
   else if (rd_ret == -1)
     good = false;
@@ -98,7 +434,453 @@ SAMReader::get_sam_record(sam_rec &sr) {
   return good;
 }
 
+size_t
+SAMReader::get_sam_records(vector<sam_rec> &batch, const size_t n) {
+  if (batch.size() < n)
+    batch.resize(n);
+  size_t n_read = 0;
+  while (n_read < n && get_sam_record(batch[n_read]))
+    ++n_read;
+  return n_read;
+}
+
+static size_t
+sam_rec_bytes(const sam_rec &sr) {
+  const size_t total = sizeof(sam_rec) + sr.qname.size() + sr.rname.size() +
+    sr.cigar.size() + sr.cigar_ops.size()*sizeof(uint32_t) +
+    sr.rnext.size() + sr.seq.size() + sr.qual.size();
+  return total + sr.tags.get_text().size();
+}
+
+size_t
+SAMReader::get_sam_records_bytes(vector<sam_rec> &batch,
+                                 const size_t max_bytes) {
+  size_t n_read = 0, n_bytes = 0;
+  while (n_bytes < max_bytes || n_read == 0) {
+    if (n_read == batch.size())
+      batch.push_back(sam_rec());
+    if (!get_sam_record(batch[n_read]))
+      break;
+    n_bytes += sam_rec_bytes(batch[n_read++]);
+  }
+  return n_read;
+}
+
 string
 SAMReader::get_header() const {
   return hdr->text; // includes newline
 }
+
+void
+SAMReader::get_chrom_sizes(vector<string> &names, vector<size_t> &sizes) const {
+  names.clear();
+  sizes.clear();
+  for (int32_t i = 0; i < hdr->n_targets; ++i) {
+    names.push_back(hdr->target_name[i]);
+    sizes.push_back(hdr->target_len[i]);
+  }
+}
+
+/////////////////////////////////////////////
+//// processing shards of an indexed file
+/////////////////////////////////////////////
+
+vector<sam_shard>
+make_sam_shards(const string &filename, const size_t max_shard_size) {
+  vector<string> names;
+  vector<size_t> sizes;
+  SAMReader(filename).get_chrom_sizes(names, sizes);
+
+  const size_t shard_size = std::max(max_shard_size, static_cast<size_t>(1));
+  vector<sam_shard> shards;
+  for (size_t i = 0; i < names.size(); ++i)
+    for (size_t start = 0; start < sizes[i]; start += shard_size) {
+      sam_shard s;
+      s.chrom = names[i];
+      s.start = start;
+      s.end = std::min(start + shard_size, sizes[i]);
+      shards.push_back(s);
+    }
+  return shards;
+}
+
+SAMShardReader::SAMShardReader(SAMReader &r, const sam_shard &shard) :
+  reader(r), shard_start(shard.start), good(true) {
+  reader.set_region(GenomicRegion(shard.chrom, shard.start, shard.end));
+}
+
+bool
+SAMShardReader::get_sam_record(sam_rec &sr) {
+  // sam_rec positions are 1-based, shard starts are 0-based
+  while ((good = reader.get_sam_record(sr)) && sr.pos <= shard_start);
+  return good;
+}
+
+SAMShardReader &
+operator>>(SAMShardReader &reader, sam_rec &sr) {
+  reader.get_sam_record(sr);
+  return reader;
+}
+
+/////////////////////////////////////////////
+//// reading ahead on a background thread
+/////////////////////////////////////////////
+
+AsyncSAMReader::AsyncSAMReader(SAMReader &r, const size_t bs,
+                               const size_t n_batches) :
+  reader(r), batch_size(std::max(bs, static_cast<size_t>(1))), good(true),
+  free_batches(n_batches), full_batches(n_batches), curr_n(0), curr_idx(0) {
+  for (size_t i = 0; i < std::max(n_batches, static_cast<size_t>(1)); ++i)
+    free_batches.push(vector<sam_rec>(batch_size));
+  worker = std::thread(&AsyncSAMReader::read_batches, this);
+}
+
+AsyncSAMReader::~AsyncSAMReader() {
+  free_batches.abort();
+  full_batches.abort();
+  worker.join();
+}
+
+void
+AsyncSAMReader::read_batches() {
+  try {
+    filled_batch batch;
+    while (free_batches.pop(batch.records) &&
+           (batch.n_records =
+            reader.get_sam_records(batch.records, batch_size)) > 0) {
+      {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats = reader.get_stats();
+      }
+      if (!full_batches.push(std::move(batch)))
+        break;
+    }
+  }
+  catch (...) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    error = std::current_exception();
+  }
+  full_batches.close();
+}
+
+size_t
+AsyncSAMReader::get_sam_records(vector<sam_rec> &batch) {
+  filled_batch next;
+  if (!full_batches.pop(next)) {
+    good = false;
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (error)
+      std::rethrow_exception(error);
+    return 0;
+  }
+  batch.swap(next.records);
+  free_batches.push(std::move(next.records));
+  return next.n_records;
+}
+
+bool
+AsyncSAMReader::get_sam_record(sam_rec &sr) {
+  if (curr_idx == curr_n) {
+    if (!(curr_n = get_sam_records(curr)))
+      return false;
+    curr_idx = 0;
+  }
+  std::swap(sr, curr[curr_idx++]);
+  return good;
+}
+
+reader_stats
+AsyncSAMReader::get_stats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  return stats;
+}
+
+AsyncSAMReader &
+operator>>(AsyncSAMReader &reader, sam_rec &sr) {
+  reader.get_sam_record(sr);
+  return reader;
+}
+
+/////////////////////////////////////////////
+//// writing SAM/BAM through htslib
+/////////////////////////////////////////////
+
+SAMWriter::SAMWriter(const string &fn, const string &header_text,
+                     const string &mode, const int compression_level,
+                     const size_t n) :
+  filename(fn), good(true), hts(0), hdr(0), b(0), thread_pool(nullptr),
+  n_threads(1), text_output(mode.find_first_of("bc") == string::npos), last_ref_id(-1) {
+  try {
+    string full_mode(mode);
+    if (compression_level >= 0) {
+      if (compression_level > 9)
+        throw runtime_error("bad compression level: " +
+                            std::to_string(compression_level));
+      full_mode += static_cast<char>('0' + compression_level);
+    }
+
+    if (!(hts = hts_open(filename.c_str(), full_mode.c_str())))
+      throw runtime_error("cannot open file for writing: " + filename);
+
+    if (n > 1) {
+      thread_pool = acquire_shared_pool(n, n_threads);
+      if (hts_set_opt(hts, HTS_OPT_THREAD_POOL, thread_pool) < 0)
+        throw runtime_error("failed to set threads for file: " + filename);
+    }
+
+    if (!(hdr = sam_hdr_parse(header_text.size(), header_text.c_str())))
+      throw runtime_error("failed to parse header for file: " + filename);
+
+    if (sam_hdr_write(hts, hdr) < 0)
+      throw runtime_error("failed to write header to file: " + filename);
+
+    if (!(b = bam_init1()))
+      throw runtime_error("failed to allocate record for file: " + filename);
+  }
+  catch (...) { // the destructor does not run for a partial object
+    try {close();} catch (...) {}
+    throw;
+  }
+}
+
+SAMWriter::~SAMWriter() {
+  try {
+    close();
+  }
+  catch (...) {} // call close() to see errors
+}
+
+void
+SAMWriter::close() {
+  if (b) {
+    bam_destroy1(b);
+    b = 0;
+  }
+  if (hdr) {
+    bam_hdr_destroy(hdr);
+    hdr = 0;
+  }
+  const bool closed_ok = !hts || hts_close(hts) >= 0;
+  hts = 0;
+  if (thread_pool) {
+    release_shared_pool(thread_pool);
+    thread_pool = nullptr;
+    n_threads = 1;
+  }
+  good = false;
+  if (!closed_ok)
+    throw runtime_error("failed to close file: " + filename);
+}
+
+template <class T> static void
+append_aux_value(string &out, const T x) {
+  char buf[sizeof(T)];
+  std::memcpy(buf, &x, sizeof(T)); // little-endian, as in format_aux
+  out.append(buf, sizeof(T));
+}
+
+// appends x as the given integer type, or throws if it does not fit
+static void
+append_aux_int(string &out, const char type, const int64_t x) {
+  switch (type) {
+  case 'c':
+    if (x >= INT8_MIN && x <= INT8_MAX)
+      return append_aux_value(out, static_cast<int8_t>(x));
+    break;
+  case 'C':
+    if (x >= 0 && x <= UINT8_MAX)
+      return append_aux_value(out, static_cast<uint8_t>(x));
+    break;
+  case 's':
+    if (x >= INT16_MIN && x <= INT16_MAX)
+      return append_aux_value(out, static_cast<int16_t>(x));
+    break;
+  case 'S':
+    if (x >= 0 && x <= UINT16_MAX)
+      return append_aux_value(out, static_cast<uint16_t>(x));
+    break;
+  case 'i':
+    if (x >= INT32_MIN && x <= INT32_MAX)
+      return append_aux_value(out, static_cast<int32_t>(x));
+    break;
+  case 'I':
+    if (x >= 0 && x <= UINT32_MAX)
+      return append_aux_value(out, static_cast<uint32_t>(x));
+    break;
+  }
+  throw runtime_error("aux value out of range for type " + string(1, type));
+}
+
+// the smallest type holding x, as htslib picks for SAM "i" tags
+static char
+aux_int_type(const int64_t x) {
+  if (x < 0)
+    return x >= INT8_MIN ? 'c' : (x >= INT16_MIN ? 's' : 'i');
+  return x <= UINT8_MAX ? 'C' : (x <= UINT16_MAX ? 'S' : 'I');
+}
+
+// appends the SAM text tag [s, lim) in BAM aux layout, the inverse of
+// format_aux
+static void
+encode_aux(const char *s, const char *const lim, string &out) {
+  if (lim - s < 5 || s[2] != ':' || s[4] != ':')
+    throw runtime_error("bad SAM tag: " + string(s, lim));
+  const char type = s[3];
+  const char *v = s + 5;
+  out.append(s, 2);
+  int64_t x = 0;
+  double f = 0.0;
+  if (type == 'A') {
+    if (lim - v != 1)
+      throw runtime_error("bad SAM tag: " + string(s, lim));
+    out.push_back('A');
+    out.push_back(*v);
+  }
+  else if (type == 'i') {
+    if (!smithlab::token_to_int(v, lim, x))
+      throw runtime_error("bad SAM tag: " + string(s, lim));
+    const char int_type = aux_int_type(x);
+    out.push_back(int_type);
+    append_aux_int(out, int_type, x);
+  }
+  else if (type == 'f') {
+    if (!smithlab::token_to_double(v, lim, f))
+      throw runtime_error("bad SAM tag: " + string(s, lim));
+    out.push_back('f');
+    append_aux_value(out, static_cast<float>(f));
+  }
+  else if (type == 'Z' || type == 'H') {
+    out.push_back(type);
+    out.append(v, lim);
+    out.push_back('\0');
+  }
+  else if (type == 'B') {
+    if (v == lim || aux_type_size(*v) == 0 || *v == 'A')
+      throw runtime_error("bad SAM tag: " + string(s, lim));
+    const char sub_type = *v++;
+    out.push_back('B');
+    out.push_back(sub_type);
+    const size_t count_at = out.size();
+    append_aux_value(out, static_cast<uint32_t>(0));
+    uint32_t n = 0;
+    while (v < lim) {
+      if (*v++ != ',')
+        throw runtime_error("bad SAM tag: " + string(s, lim));
+      const char *e = std::find(v, lim, ',');
+      if (sub_type == 'f') {
+        if (!smithlab::token_to_double(v, e, f))
+          throw runtime_error("bad SAM tag: " + string(s, lim));
+        append_aux_value(out, static_cast<float>(f));
+      }
+      else {
+        if (!smithlab::token_to_int(v, e, x))
+          throw runtime_error("bad SAM tag: " + string(s, lim));
+        append_aux_int(out, sub_type, x);
+      }
+      ++n;
+      v = e;
+    }
+    std::memcpy(&out[count_at], &n, sizeof(n));
+  }
+  else throw runtime_error("bad SAM tag type: " + string(s, lim));
+}
+
+int32_t
+SAMWriter::get_ref_id(const string &name) {
+  if (name == "*")
+    return -1;
+  if (last_ref_id < 0 || name != last_ref) {
+    const int id = bam_name2id(hdr, name.c_str());
+    if (id < 0)
+      throw runtime_error("reference not in header: " + name);
+    last_ref = name;
+    last_ref_id = id;
+  }
+  return last_ref_id;
+}
+
+void
+SAMWriter::encode(const sam_rec &sr) {
+  const int32_t tid = get_ref_id(sr.rname);
+  const int32_t mtid = (sr.rnext == "=") ? tid : get_ref_id(sr.rnext);
+
+  const packed_cigar *ops = &sr.cigar_ops;
+  if (!sr.has_packed_cigar()) {
+    ::pack_cigar(sr.cigar, cigar_buf);
+    ops = &cigar_buf;
+  }
+
+  const size_t l_seq = (sr.seq == "*") ? 0 : sr.seq.size();
+  const char *qual = nullptr; // all 0xff in BAM
+  if (sr.qual != "*") {
+    if (sr.qual.size() != l_seq)
+      throw runtime_error("seq and qual differ in length: " + sr.qname);
+    qual_buf.resize(l_seq);
+    for (size_t i = 0; i < l_seq; ++i)
+      qual_buf[i] = sr.qual[i] - 33;
+    qual = qual_buf.data();
+  }
+
+  aux_buf.clear();
+  for (auto t : sr.tags)
+    encode_aux(t.begin(), t.end(), aux_buf);
+
+  if (bam_set1(b, sr.qname.size(), sr.qname.data(), sr.flags, tid,
+               static_cast<hts_pos_t>(sr.pos) - 1, sr.mapq,
+               ops->size(), ops->data(), mtid,
+               static_cast<hts_pos_t>(sr.pnext) - 1, sr.tlen,
+               l_seq, l_seq ? sr.seq.data() : nullptr, qual,
+               aux_buf.size()) < 0)
+    throw runtime_error("failed to encode record: " + sr.qname);
+  // bam_set1 reserves room for the aux data but does not fill it
+  std::memcpy(b->data + b->l_data, aux_buf.data(), aux_buf.size());
+  b->l_data += aux_buf.size();
+}
+
+void
+SAMWriter::write_text(const string &text) {
+  const ssize_t n = hts->is_bgzf ?
+    bgzf_write(hts->fp.bgzf, text.data(), text.size()) :
+    hwrite(hts->fp.hfile, text.data(), text.size());
+  if (n < 0 || static_cast<size_t>(n) != text.size())
+    throw runtime_error("failed to write records to file: " + filename);
+}
+
+void
+SAMWriter::write(const sam_rec &sr) {
+  if (!hts)
+    throw runtime_error("write after close: " + filename);
+  if (text_output) {
+    line.clear();
+    sr.append_to(line);
+    line.push_back('\n');
+    write_text(line);
+    return;
+  }
+  encode(sr);
+  if (sam_write1(hts, hdr, b) < 0)
+    throw runtime_error("failed to write record to file: " + filename);
+}
+
+void
+SAMWriter::write(const vector<sam_rec> &batch) {
+  if (!text_output) {
+    for (auto &sr : batch)
+      write(sr);
+    return;
+  }
+  if (!hts)
+    throw runtime_error("write after close: " + filename);
+  line.clear();
+  for (auto &sr : batch) {
+    sr.append_to(line);
+    line.push_back('\n');
+  }
+  write_text(line);
+}
+
+SAMWriter &
+operator<<(SAMWriter &writer, const sam_rec &sr) {
+  writer.write(sr);
+  return writer;
+}
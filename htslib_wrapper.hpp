@@ -21,10 +21,22 @@
 
 #include "smithlab_utils.hpp"
 #include "sam_record.hpp"
+#include "sam_header.hpp"
+#include "cigar_utils.hpp"
+#include "GenomicRegion.hpp"
+#include "thread_utils.hpp"
+#include "reader_stats.hpp"
 
 #include <string>
 #include <vector>
 #include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
 
 extern "C" {
 #include <htslib/sam.h>
@@ -33,18 +45,77 @@ extern "C" {
 
 extern "C" {char check_htslib_wrapper();}
 
+class sam_filter;
+
+/* SAMReader: reads SAM, BAM or CRAM through htslib. With more than
+ * one thread, BGZF decompression runs on a thread pool shared by all
+ * readers and writers in the process. A reader joins the newest pool
+ * if it has at least the threads asked for, and otherwise starts a
+ * larger pool that later files share. A pool is destroyed when the
+ * last file using it is closed.
+ */
 class SAMReader {
 public:
-  SAMReader(const std::string &filename);
+  SAMReader(const std::string &filename, const size_t n_threads = 1);
   ~SAMReader();
 
   operator bool() const {return good;}
 
+  // attach to a shared pool if not already; n_threads <= 1 is a no-op
+  void set_threads(const size_t n_threads);
+  // threads in the pool in use, which may be more than asked for; 1
+  // without a pool
+  size_t get_n_threads() const {return n_threads;}
+
+  // leave the cigar of each record packed (see sam_rec::pack_cigar)
+  void set_packed_cigar(const bool p) {packed_cigar = p;}
+
+  // Skip records failing the filter. Flags, MAPQ, chrom and tags are
+  // tested on the raw BAM record, so skipped records are never decoded.
+  void set_filter(const sam_filter &f);
+
+  // see reader_stats; records skipped by the filter count as filtered
+  void set_timing(const bool t) {timing = t;}
+  const reader_stats &get_stats() const {return stats;}
+  void clear_stats() {stats.clear();}
+
+  // Restrict reading to records overlapping the given regions, using
+  // the BAI/CSI index. Regions are in GenomicRegion coordinates, and
+  // overlapping regions are merged so no record is returned twice.
+  // An empty set of regions selects no records. Strings are as
+  // accepted by parse_region_name: "chrom:start-end".
+  void set_region(const GenomicRegion &region);
+  void set_region(const std::string &region_name);
+  void set_regions(const std::vector<GenomicRegion> &regions);
+
   bool get_sam_record(sam_rec &sr);
 
+  // The batch calls fill batch from its start and return the number
+  // of records read; zero means the end. The batch grows as needed but
+  // is never shrunk, so passing the same batch each time reuses the
+  // strings of its elements; those past the count are left over from
+  // earlier calls.
+
+  // up to n records
+  size_t get_sam_records(std::vector<sam_rec> &batch, const size_t n);
+
+  // records until they hold at least max_bytes, counting their
+  // strings; at least one record unless at the end
+  size_t get_sam_records_bytes(std::vector<sam_rec> &batch,
+                               const size_t max_bytes);
+
   std::string get_header() const;
+  // parsed once when the file is opened
+  const sam_header &get_sam_header() const {return header;}
+
+  // reference names and lengths, in header order
+  void get_chrom_sizes(std::vector<std::string> &names,
+                       std::vector<size_t> &sizes) const;
 
 private:
+  // frees everything held; safe on a partly constructed reader
+  void release();
+  size_t input_bytes() const;
 
   // data
   std::string filename;
@@ -52,10 +123,213 @@ private:
 
   htsFile* hts;
   bam_hdr_t *hdr;
+  sam_header header;
   bam1_t *b;
+  htsThreadPool *thread_pool; // shared; null if not used
+  size_t n_threads;
+
+  hts_idx_t *idx;
+  hts_itr_t *itr;
+  bool empty_regions; // set_regions was given none
+  bool packed_cigar;
+
+  // bound to the reference ids of hdr; null if not set
+  std::unique_ptr<sam_filter> filter;
+
+  bool timing;
+  reader_stats stats;
 };
 
 SAMReader &
 operator>>(SAMReader& sam_stream, sam_rec &samr);
 
+/* AsyncSAMReader: decodes records from a SAMReader on a background
+ * thread into a ring of preallocated batches, while the caller works
+ * on earlier batches. The thread blocks when all batches are full,
+ * and an exception on it is rethrown to the caller. The SAMReader
+ * must outlive this object and not be used directly meanwhile; set
+ * regions or threads on it before starting.
+ */
+class AsyncSAMReader {
+public:
+  AsyncSAMReader(SAMReader &reader, const size_t batch_size = 4096,
+                 const size_t n_batches = 4);
+  ~AsyncSAMReader();
+
+  operator bool() const {return good;}
+
+  // Swaps the next batch into the argument and returns the number of
+  // records in it, zero at the end; as for SAMReader, elements past
+  // that are left over. The old contents of batch are recycled by the
+  // background thread.
+  size_t get_sam_records(std::vector<sam_rec> &batch);
+  bool get_sam_record(sam_rec &sr);
+
+  // the reader's stats as of the last batch read, which may be ahead
+  // of the caller; set timing on the reader before starting
+  reader_stats get_stats() const;
+
+private:
+  struct filled_batch {
+    std::vector<sam_rec> records;
+    size_t n_records;
+  };
+
+  void read_batches();
+
+  SAMReader &reader;
+  size_t batch_size;
+  bool good;
+
+  BoundedQueue<std::vector<sam_rec> > free_batches;
+  BoundedQueue<filled_batch> full_batches;
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  mutable std::mutex stats_mutex;
+  reader_stats stats; // copied from the reader after each batch
+  std::thread worker;
+
+  // for taking one record at a time
+  std::vector<sam_rec> curr;
+  size_t curr_n;
+  size_t curr_idx;
+};
+
+AsyncSAMReader &
+operator>>(AsyncSAMReader &reader, sam_rec &sr);
+
+/* SAMWriter: writes sam_rec through htslib. The mode is as for
+ * hts_open: "wb" for BAM, "w" for SAM and "wz" for bgzipped SAM. A
+ * compression level from 0 to 9 may be given (-1 for the default),
+ * and with more than one thread BGZF compression runs on the pool
+ * shared with SAMReader. For BAM, each record is encoded directly into
+ * a bam1_t, and the header text must name every reference that the
+ * records use. For SAM, records are written as their text, and a
+ * vector of records is formatted into one buffer and written at once.
+ */
+class SAMWriter {
+public:
+  SAMWriter(const std::string &filename, const std::string &header_text,
+            const std::string &mode = "wb", const int compression_level = -1,
+            const size_t n_threads = 1);
+  SAMWriter(const std::string &filename, const sam_header &header,
+            const std::string &mode = "wb", const int compression_level = -1,
+            const size_t n_threads = 1) :
+    SAMWriter(filename, header.tostring(), mode, compression_level,
+              n_threads) {}
+  // closes the file, ignoring errors; call close() to see them
+  ~SAMWriter();
+
+  operator bool() const {return good;}
+
+  void write(const sam_rec &sr);
+  void write(const std::vector<sam_rec> &batch);
+
+  // flush and close; throws if the data could not be written
+  void close();
+
+  // as for SAMReader
+  size_t get_n_threads() const {return n_threads;}
+
+private:
+  int32_t get_ref_id(const std::string &name);
+  void encode(const sam_rec &sr);
+  void write_text(const std::string &text);
+
+  std::string filename;
+  bool good;
+
+  htsFile *hts;
+  bam_hdr_t *hdr;
+  bam1_t *b;
+  htsThreadPool *thread_pool; // shared; null if not used
+  size_t n_threads;
+  bool text_output;
+
+  // reused across records
+  std::string line;
+  std::string aux_buf;
+  std::string qual_buf;
+  packed_cigar cigar_buf;
+  std::string last_ref;
+  int32_t last_ref_id;
+};
+
+SAMWriter &
+operator<<(SAMWriter &writer, const sam_rec &sr);
+
+/* Processing an indexed file in parallel, one shard at a time. A
+ * shard is a range of one reference in GenomicRegion coordinates;
+ * make_sam_shards splits references longer than max_shard_size. Each
+ * read belongs to the shard containing its start, so SAMShardReader
+ * skips reads that the index returns because they overlap the shard
+ * but start before it. Unplaced reads are in no shard.
+ */
+struct sam_shard {
+  std::string chrom;
+  size_t start;
+  size_t end;
+};
+
+std::vector<sam_shard>
+make_sam_shards(const std::string &filename, const size_t max_shard_size);
+
+class SAMShardReader {
+public:
+  SAMShardReader(SAMReader &reader, const sam_shard &shard);
+  operator bool() const {return good;}
+  bool get_sam_record(sam_rec &sr);
+private:
+  SAMReader &reader;
+  size_t shard_start;
+  bool good;
+};
+
+SAMShardReader &
+operator>>(SAMShardReader &reader, sam_rec &sr);
+
+/* Runs fn(shard, shard_reader, result) for every shard on n_workers
+ * threads, each with its own SAMReader, and returns the results in
+ * shard order, which is reference order for make_sam_shards. The
+ * first exception thrown by any worker is rethrown here.
+ */
+template <class Result, class Fn> std::vector<Result>
+process_sam_shards(const std::string &filename,
+                   const std::vector<sam_shard> &shards,
+                   const size_t n_workers, Fn fn) {
+  std::vector<Result> results(shards.size());
+  std::atomic<size_t> next_shard(0);
+  std::mutex error_mutex;
+  std::exception_ptr error;
+
+  auto worker = [&]() {
+    try {
+      SAMReader reader(filename);
+      for (size_t i = next_shard++; i < shards.size(); i = next_shard++) {
+        {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (error) return;
+        }
+        SAMShardReader shard_reader(reader, shards[i]);
+        fn(shards[i], shard_reader, results[i]);
+      }
+    }
+    catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) error = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_workers; ++i)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (auto &t : threads)
+    t.join();
+
+  if (error)
+    std::rethrow_exception(error);
+  return results;
+}
+
 #endif
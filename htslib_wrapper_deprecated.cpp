@@ -21,6 +21,8 @@
 #include <vector>
 #include <fstream>
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
 
 #include "htslib_wrapper_deprecated.hpp"
 #include "smithlab_utils.hpp"
@@ -36,7 +38,7 @@ using std::runtime_error;
 char check_htslib_wrapper() {return 1;}
 
 SAMReader_deprecated::SAMReader_deprecated(const string &fn, const string &mpr) :
-  filename(fn), mapper(mpr), good(true) {
+  filename(fn), mapper(mpr), good(true), decode(0) {
 
   if (!(hts = hts_open(filename.c_str(), "r")))
     throw runtime_error("cannot open file: " + filename);
@@ -53,7 +55,13 @@ SAMReader_deprecated::SAMReader_deprecated(const string &fn, const string &mpr)
   if (mapper == "bsmap")
     throw runtime_error("bsmap no longer supported [use general]");
 
-  if (mapper != "bismark" && mapper != "bs_seeker" && mapper != "general")
+  if (mapper == "bismark")
+    decode = &SAMReader_deprecated::get_SAMRecord_bismark;
+  else if (mapper == "bs_seeker")
+    decode = &SAMReader_deprecated::get_SAMRecord_bsseeker;
+  else if (mapper == "general")
+    decode = &SAMReader_deprecated::get_SAMRecord_general;
+  else
     throw runtime_error("mapper not supported: " + mapper);
 }
 
@@ -74,42 +82,94 @@ SAMReader_deprecated::~SAMReader_deprecated() {
 }
 
 
-bool
-SAMReader_deprecated::get_SAMRecord(const string &str, SAMRecord &samr) {
-  if (mapper == "bsmap")
-    return get_SAMRecord_bsmap(str, samr);
-  else if (mapper == "bismark")
-    return get_SAMRecord_bismark(str, samr);
-  else if (mapper == "bs_seeker")
-    return get_SAMRecord_bsseeker(str, samr);
-  else if (mapper == "general")
-    return get_SAMRecord_general(str, samr);
-  else
-    good = false;
-  return false;
-}
-
 SAMReader_deprecated&
 operator>>(SAMReader_deprecated &reader, SAMRecord &aln) {
-  int rd_ret = 0;
-  if ((rd_ret = sam_read1(reader.hts, reader.hdr, reader.b)) >= 0) {
-    int fmt_ret = 0;
-    if ((fmt_ret = sam_format1(reader.hdr, reader.b, &reader.hts->line)) <= 0)
-      throw runtime_error("failed reading record from: " + reader.filename);
-    reader.good = reader.get_SAMRecord(reader.hts->line.s, aln);
-    // ADS: line below seems to be needed when the file format is SAM
-    // because the hts_getline for parsing SAM format files within
-    // sam_read1 only get called when "(fp->line.l == 0)". For BAM
-    // format, it does not seem to matter.
-    reader.hts->line.l = 0;
-  }
-  if (rd_ret == -1)
+  const int rd_ret = sam_read1(reader.hts, reader.hdr, reader.b);
+  if (rd_ret >= 0)
+    reader.good = (reader.*reader.decode)(aln);
+  else if (rd_ret == -1)
     reader.good = false;
-  else if (rd_ret < -1)
+  else // rd_ret < -1
     throw runtime_error("failed to read record from file: " + reader.filename);
   return reader;
 }
 
+////////////////////////////////////////
+// decoding from the bam1_t
+////////////////////////////////////////
+
+static const char *
+bam_chrom(const bam_hdr_t *hdr, const int32_t tid) {
+  return tid < 0 ? "*" : hdr->target_name[tid];
+}
+
+// bytes in the value of an aux field of the given type
+static size_t
+aux_value_size(const uint8_t *p, const uint8_t *lim) {
+  switch (*p) {
+  case 'A': case 'c': case 'C': return 1;
+  case 's': case 'S': return 2;
+  case 'i': case 'I': case 'f': return 4;
+  case 'd': return 8;
+  case 'Z': case 'H': {
+    const uint8_t *e = p + 1;
+    while (e < lim && *e) ++e;
+    return e - p; // includes the NUL, excludes the type
+  }
+  case 'B': {
+    if (lim - p < 6) return lim - p;
+    uint32_t n = 0;
+    std::memcpy(&n, p + 2, sizeof(n));
+    return 5 + n*aux_value_size(p + 1, lim);
+  }
+  default: return lim - p;
+  }
+}
+
+// the k-th aux field, pointing at its type; null if there are fewer
+static const uint8_t *
+get_aux_field(const bam1_t *b, size_t k) {
+  const uint8_t *p = bam_get_aux(b);
+  const uint8_t *const lim = p + bam_get_l_aux(b);
+  for (; p + 3 <= lim; --k) {
+    if (k == 0) return p + 2;
+    p += 3 + aux_value_size(p + 2, lim);
+  }
+  return 0;
+}
+
+// these take fields by position, as the text parsing did
+static int
+aux_field_int(const bam1_t *b, const size_t k) {
+  const uint8_t *aux = get_aux_field(b, k);
+  if (!aux) return 0;
+  return *aux == 'Z' ? atoi(bam_aux2Z(aux)) : bam_aux2i(aux);
+}
+
+static const char *
+aux_field_string(const bam1_t *b, const size_t k) {
+  const uint8_t *aux = get_aux_field(b, k);
+  return (aux && *aux == 'Z') ? bam_aux2Z(aux) : "";
+}
+
+static bool
+has_aux_fields(const bam1_t *b, const size_t n) {
+  return n == 0 || get_aux_field(b, n - 1) != 0;
+}
+
+void
+SAMReader_deprecated::get_inflated_seq(string &seq) {
+  static const char *nt16 = "=ACMGRSVTWYHKDBN";
+  const bam1_core_t &c = b->core;
+  const uint8_t *s = bam_get_seq(b);
+  seq.resize(c.l_qseq);
+  for (int32_t i = 0; i < c.l_qseq; ++i)
+    seq[i] = nt16[bam_seqi(s, i)];
+  if (c.l_qseq == 0) seq.assign("*");
+  const uint32_t *cig = bam_get_cigar(b);
+  cigar_buf.assign(cig, cig + c.n_cigar);
+  apply_cigar(cigar_buf, seq);
+}
 
 class FLAG {
 public:
@@ -146,39 +206,31 @@ bsmap_get_strand(const string &strand_str, string &strand, string &bs_forward) {
 }
 
 bool
-SAMReader_deprecated::get_SAMRecord_bsmap(const string &str, SAMRecord &samr) {
+SAMReader_deprecated::get_SAMRecord_bsmap(SAMRecord &samr) {
 
   cerr << "WARNING: "<< "[BSMAP Converter] test "
        << "version: may contain bugs" << endl;
 
-  string name, chrom, CIGAR, mate_name, seq, qual, strand_str, mismatch_str;
-  size_t flag, start, mapq_score, mate_start;
-  int seg_len;
-
-  std::istringstream iss(str);
-  if (!(iss >> name >> flag >> chrom >> start >> mapq_score >> CIGAR
-        >> mate_name >> mate_start >> seg_len >> seq >> qual
-        >> mismatch_str >> strand_str)) {
+  if (!has_aux_fields(b, 2)) {
     good = false;
-    throw runtime_error("malformed line in bsmap SAM format:\n" + str);
+    throw runtime_error("malformed record in bsmap SAM format: " +
+                        string(bam_get_qname(b)));
   }
 
-  BSMAPFLAG Flag(flag);
+  BSMAPFLAG Flag(b->core.flag);
 
-  samr.mr.r.set_chrom(chrom);
-  samr.mr.r.set_start(start - 1);
-  samr.mr.r.set_name(name);
-  samr.mr.r.set_score(atoi(mismatch_str.substr(5).c_str()));
+  samr.mr.r.set_chrom(bam_chrom(hdr, b->core.tid));
+  samr.mr.r.set_start(b->core.pos);
+  samr.mr.r.set_name(bam_get_qname(b));
+  samr.mr.r.set_score(aux_field_int(b, 0));
 
+  const string strand_str = string("ZS:Z:") + aux_field_string(b, 1);
   string strand, bs_forward;
   bsmap_get_strand(strand_str, strand, bs_forward);
   samr.mr.r.set_strand(strand[0]);
 
-  string new_seq(seq);
-  apply_cigar(CIGAR, new_seq);
-
-  samr.mr.r.set_end(samr.mr.r.get_start() + new_seq.size());
-  samr.mr.seq = new_seq;
+  get_inflated_seq(samr.mr.seq);
+  samr.mr.r.set_end(samr.mr.r.get_start() + samr.mr.seq.size());
 
   samr.is_Trich = Flag.is_Trich();
   samr.is_mapping_paired = Flag.is_mapping_paired();
@@ -197,59 +249,41 @@ public:
 };
 
 static size_t
-get_mismatch_bismark(const string &edit_distance_str,
-                     const string &meth_call_str) {
+get_mismatch_bismark(const size_t edit_distance, const char *meth_call) {
   /* the result of this function might not be accurate, because if a
   sequencing error occurs on a cytosine, then it probably will be
   reported as a convertion
   */
-  size_t edit_distance;
-  edit_distance = atoi(edit_distance_str.substr(5).c_str());
-
   int convert_count = 0;
-  const char *temp = meth_call_str.substr(5).c_str();
-  while (*temp != '\0') {
+  for (const char *temp = meth_call; *temp != '\0'; ++temp)
     if (*temp == 'x' || *temp == 'h' || *temp == 'z')
       ++convert_count;
-    ++temp;
-  }
 
   return edit_distance - convert_count;
 }
 
 bool
-SAMReader_deprecated::get_SAMRecord_bismark(const string &str, SAMRecord &samr) {
-  string name, chrom, CIGAR, mate_name, seq, qual, strand_str,
-    edit_distance_str, mismatch_str, meth_call_str,
-    read_conv_str, genome_conv_str;
-  size_t flag, start, mapq_score, mate_start;
-  int seg_len;
-
-  std::istringstream iss(str);
-  if (!(iss >> name >> flag >> chrom >> start >> mapq_score >> CIGAR
-        >> mate_name >> mate_start >> seg_len >> seq >> qual
-        >> edit_distance_str >> mismatch_str >> meth_call_str
-        >> read_conv_str >> genome_conv_str)) {
+SAMReader_deprecated::get_SAMRecord_bismark(SAMRecord &samr) {
+  if (!has_aux_fields(b, 5)) {
     good = false;
-    throw runtime_error("malformed line in bismark SAM format:\n" + str);
+    throw runtime_error("malformed record in bismark SAM format: " +
+                        string(bam_get_qname(b)));
   }
 
-  BISMARKFLAG Flag(flag);
+  BISMARKFLAG Flag(b->core.flag);
 
-  samr.mr.r.set_chrom(chrom);
-  samr.mr.r.set_start(start - 1);
-  samr.mr.r.set_name(name);
-  samr.mr.r.set_score(get_mismatch_bismark(edit_distance_str, meth_call_str));
+  samr.mr.r.set_chrom(bam_chrom(hdr, b->core.tid));
+  samr.mr.r.set_start(b->core.pos);
+  samr.mr.r.set_name(bam_get_qname(b));
+  samr.mr.r.set_score(get_mismatch_bismark(aux_field_int(b, 0),
+                                           aux_field_string(b, 2)));
   samr.mr.r.set_strand(Flag.is_revcomp() ? '-' : '+');
 
-  string new_seq(seq);
-  apply_cigar(CIGAR, new_seq);
-
+  get_inflated_seq(samr.mr.seq);
   if (Flag.is_revcomp())
-    revcomp_inplace(new_seq);
+    revcomp_inplace(samr.mr.seq);
 
-  samr.mr.r.set_end(samr.mr.r.get_start() + new_seq.size());
-  samr.mr.seq = new_seq;
+  samr.mr.r.set_end(samr.mr.r.get_start() + samr.mr.seq.size());
 
   samr.is_Trich = Flag.is_Trich();
   samr.is_mapping_paired = Flag.is_mapping_paired();
@@ -284,41 +318,26 @@ public:
 };
 
 bool
-SAMReader_deprecated::get_SAMRecord_bsseeker(const string &str, SAMRecord &samr) {
-
-  string name, chrom, CIGAR, mate_name, seq, qual, orientation_str,
-    conversion_str, mismatch_str, mismatch_type_str, seq_genome_str;
-  size_t flag, start, mapq_score, mate_start;
-  int seg_len;
-
-  std::istringstream iss(str);
-  if (!(iss >> name >> flag >> chrom >> start >> mapq_score >> CIGAR
-        >> mate_name >> mate_start >> seg_len >> seq >> qual
-        >> orientation_str >> conversion_str >> mismatch_str
-        >> mismatch_type_str >> seq_genome_str)) {
+SAMReader_deprecated::get_SAMRecord_bsseeker(SAMRecord &samr) {
+  if (!has_aux_fields(b, 5)) {
     good = false;
-    throw runtime_error("malformed line in bs_seeker SAM format:\n" + str);
+    throw runtime_error("malformed record in bs_seeker SAM format: " +
+                        string(bam_get_qname(b)));
   }
 
-  // bs_seeker also doesn't keep sequencing quality information?
-  qual = string(seq.size(), 'h');
+  BSSEEKERFLAG Flag(b->core.flag);
 
-  BSSEEKERFLAG Flag(flag);
-
-  samr.mr.r.set_chrom(chrom);
-  samr.mr.r.set_start(start - 1);
-  samr.mr.r.set_name(name);
-  samr.mr.r.set_score(atoi(mismatch_str.substr(5).c_str()));
+  samr.mr.r.set_chrom(bam_chrom(hdr, b->core.tid));
+  samr.mr.r.set_start(b->core.pos);
+  samr.mr.r.set_name(bam_get_qname(b));
+  samr.mr.r.set_score(aux_field_int(b, 2));
   samr.mr.r.set_strand(Flag.is_revcomp() ? '-' : '+');
 
-  string new_seq(seq);
-  apply_cigar(CIGAR, new_seq);
-
+  get_inflated_seq(samr.mr.seq);
   if (Flag.is_revcomp())
-    revcomp_inplace(new_seq);
+    revcomp_inplace(samr.mr.seq);
 
-  samr.mr.r.set_end(samr.mr.r.get_start() + new_seq.size());
-  samr.mr.seq = new_seq;
+  samr.mr.r.set_end(samr.mr.r.get_start() + samr.mr.seq.size());
 
   samr.is_Trich = Flag.is_Trich();
   samr.is_mapping_paired = Flag.is_mapping_paired();
@@ -337,48 +356,33 @@ public:
 };
 
 bool
-SAMReader_deprecated::get_SAMRecord_general(const string &str, SAMRecord &samr) {
-  string name, chrom, CIGAR, mate_name, seq, qual;
-  size_t flag, start, mapq_score, mate_start;
-  int seg_len;
-
-  std::istringstream iss(str);
-  if (!(iss >> name >> flag >> chrom >> start >> mapq_score >> CIGAR
-        >> mate_name >> mate_start >> seg_len >> seq >> qual)) {
-    good = false;
-    throw runtime_error("malformed line in SAM format:\n" + str);
-  }
-
-  GENERALFLAG Flag(flag);
+SAMReader_deprecated::get_SAMRecord_general(SAMRecord &samr) {
+  const bam1_core_t &c = b->core;
+  GENERALFLAG Flag(c.flag);
   samr.is_primary = Flag.is_primary();
   samr.is_mapped = Flag.is_mapped();
 
-  samr.seg_len = seg_len;
-  samr.mr.r.set_name(name);
+  samr.seg_len = c.isize;
+  samr.mr.r.set_name(bam_get_qname(b));
 
   if (samr.is_mapped) {
-    samr.mr.r.set_chrom(chrom);
-    samr.mr.r.set_start(start - 1);
+    samr.mr.r.set_chrom(bam_chrom(hdr, c.tid));
+    samr.mr.r.set_start(c.pos);
     samr.mr.r.set_score(0);
     samr.mr.r.set_strand(Flag.is_revcomp() ? '-' : '+');
 
-    string new_seq(seq);
-    apply_cigar(CIGAR, new_seq);
-
+    get_inflated_seq(samr.mr.seq);
     if (Flag.is_revcomp())
-      revcomp_inplace(new_seq);
-
-    samr.mr.r.set_end(samr.mr.r.get_start() + new_seq.size());
-
-    samr.mr.seq = new_seq;
+      revcomp_inplace(samr.mr.seq);
 
+    samr.mr.r.set_end(samr.mr.r.get_start() + samr.mr.seq.size());
   }
   samr.is_Trich = Flag.is_Trich();
   samr.is_mapping_paired = Flag.is_mapping_paired();
   // if the mapped chromosomes differ but the mapping is "concordant",
-  // then change the mapping to disconcordant
-  if (samr.is_mapping_paired &&
-      !((mate_name == "=") || (mate_name == chrom))) {
+  // then change the mapping to disconcordant; the mate chrom is "=" or
+  // equal to the chrom exactly when the ids are equal
+  if (samr.is_mapping_paired && c.mtid != c.tid) {
     samr.is_mapping_paired = false;
   }
 
@@ -73,26 +73,30 @@ public:
   operator>>(SAMReader_deprecated& sam_stream, SAMRecord &samr);
 
 private:
-  // internal methods
+  // internal methods: each decodes the current bam1_t directly, with
+  // no text formatting and parsing in between
+  typedef bool (SAMReader_deprecated::*decoder)(SAMRecord&);
   bool
-  get_SAMRecord(const std::string&, SAMRecord&);
+  get_SAMRecord_bsmap(SAMRecord&);
   bool
-  get_SAMRecord_bsmap(const std::string&, SAMRecord&);
+  get_SAMRecord_bismark(SAMRecord&);
   bool
-  get_SAMRecord_bismark(const std::string&, SAMRecord&);
+  get_SAMRecord_bsseeker(SAMRecord&);
   bool
-  get_SAMRecord_bsseeker(const std::string&, SAMRecord&);
-  bool
-  get_SAMRecord_general(const std::string&, SAMRecord&);
+  get_SAMRecord_general(SAMRecord&);
+  void
+  get_inflated_seq(std::string &seq);
 
   // data
   std::string filename;
   std::string mapper;
   bool good;
+  decoder decode; // resolved from the mapper once, at construction
 
   htsFile* hts;
   bam_hdr_t *hdr;
   bam1_t *b;
+  std::vector<uint32_t> cigar_buf;
 };
 
 SAMReader_deprecated &
@@ -0,0 +1,184 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "mate_pair_utils.hpp"
+#include "smithlab_utils.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <unistd.h>
+
+using std::string;
+using std::runtime_error;
+
+const size_t MatePairer::n_spill_files;
+const size_t MatePairer::max_split_depth;
+
+// 2^25 bits is 4MB, with few false positives up to ~2M spilled names
+static const size_t filter_words = size_t(1) << 19;
+static const size_t filter_probes = 3;
+
+// probe i of the filter is bit h1 + i*h2, from the halves of the hash
+static inline uint64_t
+filter_bit(const uint64_t h, const size_t i) {
+  const uint64_t h1 = h >> 32, h2 = (h & 0xffffffff) | 1;
+  return (h1 + i*h2) % (filter_words*64);
+}
+
+MatePairer::MatePairer(const size_t mw, const string &sd) :
+  max_waiting(mw), spill_dir(sd), n_pairs(0), n_fragments(0), n_spilled(0) {
+  if (spill_dir.empty()) {
+    const char *tmpdir = std::getenv("TMPDIR");
+    spill_dir = (tmpdir && *tmpdir) ? tmpdir : "/tmp";
+  }
+}
+
+bool
+MatePairer::first_by_position(const sam_rec &a, const sam_rec &b) {
+  // mates on different chroms have no order without the header
+  if (a.rname != b.rname) return a.rname < b.rname;
+  return a.pos < b.pos;
+}
+
+uint64_t
+MatePairer::name_hash(const string &qname) {
+  // mix so every group of 4 bits depends on the whole name
+  uint64_t h = std::hash<string>()(qname);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 33);
+}
+
+bool
+MatePairer::maybe_spilled(const string &qname) const {
+  const uint64_t h = name_hash(qname);
+  for (size_t i = 0; i < filter_probes; ++i) {
+    const uint64_t b = filter_bit(h, i);
+    if (!(spilled_filter[b/64] & (uint64_t(1) << (b % 64))))
+      return false;
+  }
+  return true;
+}
+
+void
+MatePairer::spill(const sam_rec &sr) {
+  if (spill_files.empty())
+    spill_files.resize(n_spill_files);
+  if (spilled_filter.empty())
+    spilled_filter.resize(filter_words, 0);
+  const uint64_t h = name_hash(sr.qname);
+  write_spilled(spill_files[h % n_spill_files], sr);
+  for (size_t i = 0; i < filter_probes; ++i) {
+    const uint64_t b = filter_bit(h, i);
+    spilled_filter[b/64] |= uint64_t(1) << (b % 64);
+  }
+  ++n_spilled;
+}
+
+void
+MatePairer::open_spill(spill_file &f) {
+  string fn = spill_dir + "/mate_pairs.XXXXXX";
+  const int fd = mkstemp(&fn[0]);
+  if (fd < 0)
+    throw runtime_error("cannot create spill file in: " + spill_dir);
+  unlink(fn.c_str()); // removed once closed
+  f.file = fdopen(fd, "w+");
+  if (!f.file) {
+    close(fd);
+    throw runtime_error("cannot open spill file in: " + spill_dir);
+  }
+}
+
+void
+MatePairer::write_spilled(spill_file &f, const sam_rec &sr) {
+  if (!f.file) open_spill(f);
+  // SAM text loses the reference ids and the packed cigar, so they
+  // go first on the line
+  spill_buf.clear();
+  smithlab::append_int(spill_buf, sr.rname_id);
+  spill_buf.push_back('\t');
+  smithlab::append_int(spill_buf, sr.rnext_id);
+  spill_buf.push_back('\t');
+  spill_buf.push_back(sr.has_packed_cigar() ? 'p' : 't');
+  spill_buf.push_back('\t');
+  sr.append_to(spill_buf);
+  spill_buf.push_back('\n');
+  if (std::fwrite(spill_buf.data(), 1, spill_buf.size(), f.file) !=
+      spill_buf.size())
+    throw runtime_error("failed writing spill file in: " + spill_dir);
+  ++f.n_reads;
+}
+
+void
+MatePairer::rewind_spill(spill_file &f) {
+  if (std::fseek(f.file, 0, SEEK_SET) != 0)
+    throw runtime_error("failed reading spill file in: " + spill_dir);
+}
+
+// the inverse of write_spilled, for a line without its newline
+static void
+restore_spilled(const string &line, sam_rec &sr) {
+  const char *const b = line.c_str();
+  char *p = nullptr;
+  const int32_t rname_id = std::strtol(b, &p, 10);
+  const int32_t rnext_id = std::strtol(p + 1, &p, 10);
+  const bool packed = p[1] == 'p';
+  p += 3;
+  sr.assign(p, line.size() - (p - b));
+  sr.rname_id = rname_id;
+  sr.rnext_id = rnext_id;
+  if (packed)
+    sr.pack_cigar();
+}
+
+bool
+MatePairer::read_spilled(spill_file &f, sam_rec &sr) {
+  spill_buf.clear();
+  char buf[4096];
+  while (std::fgets(buf, sizeof(buf), f.file)) {
+    const size_t n = std::strlen(buf);
+    if (n > 0 && buf[n - 1] == '\n') {
+      spill_buf.append(buf, n - 1);
+      restore_spilled(spill_buf, sr);
+      return true;
+    }
+    spill_buf.append(buf, n);
+  }
+  if (std::ferror(f.file))
+    throw runtime_error("failed reading spill file in: " + spill_dir);
+  return false; // every spilled line ends in a newline
+}
+
+// moves the reads of f into files chosen by the next 4 bits of the
+// name hash; mates stay together since they have the same name
+void
+MatePairer::split_spill(spill_file &f, const size_t depth,
+                        std::vector<spill_file> &parts) {
+  parts.clear();
+  parts.resize(n_spill_files);
+  const size_t shift = 4*depth;
+  sam_rec sr;
+  while (read_spilled(f, sr))
+    write_spilled(parts[(name_hash(sr.qname) >> shift) % n_spill_files], sr);
+  std::fclose(f.file);
+  f.file = nullptr;
+}
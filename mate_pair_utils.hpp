@@ -0,0 +1,247 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef MATE_PAIR_UTILS_HPP
+#define MATE_PAIR_UTILS_HPP
+
+#include "sam_record.hpp"
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <unordered_map>
+#include <functional>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+
+/* MatePairer: pairs mates in a coordinate-sorted stream of sam_rec.
+ * A read whose mate comes later on the same chrom waits, keyed by
+ * name, until its mate arrives or the stream passes the mate's
+ * position (pnext), when it is given up and emitted alone. So memory
+ * is bounded by the reads spanning one insert. Mates on different
+ * chroms, and reads beyond max_waiting, go to temporary spill files
+ * and are paired by flush(). Secondary and supplementary records are
+ * never paired. Pairs go to one functor, called as pairs(first,
+ * second) with first the earlier mate, and reads without a mate go to
+ * another, called as fragments(read). Pairs are emitted when
+ * completed, so they are ordered by the second mate. Spilled reads
+ * come back with their reference ids and packed cigar as they were.
+ *
+ * Spilled reads are split into files by a hash of the name, and
+ * flush() pairs one file at a time, splitting again any file holding
+ * more than max_waiting reads. A read whose mate was spilled is found
+ * with a fixed-size Bloom filter of spilled names; a false positive
+ * only sends a read to be emitted alone by flush().
+ */
+class MatePairer {
+public:
+  // spill files go in spill_dir, or $TMPDIR or /tmp if it is empty
+  explicit MatePairer(const size_t max_waiting = 1000000,
+                      const std::string &spill_dir = "");
+
+  template <class Pairs, class Fragments> void
+  add(const sam_rec &sr, Pairs &pairs, Fragments &fragments) {
+    using samflags::check;
+    if (!check(sr.flags, samflags::read_paired) ||
+        check(sr.flags, samflags::mate_unmapped) ||
+        check(sr.flags, samflags::read_unmapped) ||
+        check(sr.flags, samflags::secondary_aln) ||
+        check(sr.flags, samflags::supplementary_aln)) {
+      ++n_fragments;
+      fragments(sr);
+      return;
+    }
+    if (sr.rname != curr_chrom) {
+      evict_all(pairs, fragments);
+      curr_chrom = sr.rname;
+    }
+    evict_passed(sr.pos, pairs, fragments);
+
+    if (sr.rnext != "=" && sr.rnext != sr.rname) { // mate on another chrom
+      spill(sr);
+      return;
+    }
+    auto the_mate = waiting.find(sr.qname);
+    if (the_mate != end(waiting)) {
+      if (same_segment(the_mate->second, sr)) { // not its mate
+        ++n_fragments;
+        fragments(sr);
+        return;
+      }
+      ++n_pairs;
+      pairs(the_mate->second, sr);
+      waiting.erase(the_mate);
+    }
+    else if (n_spilled > 0 && maybe_spilled(sr.qname)) // mate was spilled
+      spill(sr);
+    else if (sr.pnext >= sr.pos) { // mate should come later
+      if (waiting.size() >= max_waiting)
+        spill(sr);
+      else {
+        waiting.insert(std::make_pair(sr.qname, sr));
+        by_mate_pos.push(std::make_pair(sr.pnext, sr.qname));
+      }
+    }
+    else {
+      ++n_fragments;
+      fragments(sr);
+    }
+  }
+
+  // emits all waiting reads, then pairs the spilled reads
+  template <class Pairs, class Fragments> void
+  flush(Pairs &pairs, Fragments &fragments) {
+    evict_all(pairs, fragments);
+    curr_chrom.clear();
+    std::vector<spill_file> files;
+    files.swap(spill_files);
+    std::fill(begin(spilled_filter), end(spilled_filter), 0);
+    for (auto &f : files)
+      pair_spilled(f, 0, pairs, fragments);
+  }
+
+  size_t get_n_pairs() const {return n_pairs;}
+  size_t get_n_fragments() const {return n_fragments;}
+  size_t get_n_spilled() const {return n_spilled;}
+
+private:
+  typedef std::pair<uint32_t, std::string> mate_pos;
+  typedef std::priority_queue<mate_pos, std::vector<mate_pos>,
+                              std::greater<mate_pos> > mate_pos_queue;
+
+  // an unlinked temporary file of spilled reads, closed when destroyed
+  struct spill_file {
+    std::FILE *file;
+    size_t n_reads;
+    spill_file() : file(nullptr), n_reads(0) {}
+    spill_file(spill_file &&other) noexcept :
+      file(other.file), n_reads(other.n_reads) {other.file = nullptr;}
+    ~spill_file() {if (file) std::fclose(file);}
+    spill_file(const spill_file &) = delete;
+    spill_file &operator=(const spill_file &) = delete;
+  };
+
+  template <class Pairs, class Fragments> void
+  evict_passed(const uint32_t pos, Pairs &pairs, Fragments &fragments) {
+    while (!by_mate_pos.empty() && by_mate_pos.top().first < pos) {
+      auto the_read = waiting.find(by_mate_pos.top().second);
+      // the read may have been paired already
+      if (the_read != end(waiting) &&
+          the_read->second.pnext == by_mate_pos.top().first) {
+        ++n_fragments;
+        fragments(the_read->second);
+        waiting.erase(the_read);
+      }
+      by_mate_pos.pop();
+    }
+  }
+
+  template <class Pairs, class Fragments> void
+  evict_all(Pairs &pairs, Fragments &fragments) {
+    evict_passed(std::numeric_limits<uint32_t>::max(), pairs, fragments);
+    for (auto &w : waiting) {
+      ++n_fragments;
+      fragments(w.second);
+    }
+    waiting.clear();
+    by_mate_pos = mate_pos_queue();
+  }
+
+  // pairs the reads in one spill file, which is closed after
+  template <class Pairs, class Fragments> void
+  pair_spilled(spill_file &f, const size_t depth, Pairs &pairs,
+               Fragments &fragments) {
+    if (!f.file) return;
+    rewind_spill(f);
+    if (f.n_reads > max_waiting && depth + 1 < max_split_depth) {
+      std::vector<spill_file> parts;
+      split_spill(f, depth + 1, parts);
+      for (auto &p : parts)
+        pair_spilled(p, depth + 1, pairs, fragments);
+      return;
+    }
+    std::unordered_map<std::string, sam_rec> unmatched;
+    sam_rec sr;
+    while (read_spilled(f, sr)) {
+      auto the_mate = unmatched.find(sr.qname);
+      if (the_mate == end(unmatched))
+        unmatched.insert(std::make_pair(sr.qname, sr));
+      else if (same_segment(the_mate->second, sr)) {
+        ++n_fragments;
+        fragments(sr);
+      }
+      else {
+        ++n_pairs;
+        if (first_by_position(the_mate->second, sr))
+          pairs(the_mate->second, sr);
+        else pairs(sr, the_mate->second);
+        unmatched.erase(the_mate);
+      }
+    }
+    for (auto &u : unmatched) {
+      ++n_fragments;
+      fragments(u.second);
+    }
+    std::fclose(f.file);
+    f.file = nullptr;
+  }
+
+  static bool
+  first_by_position(const sam_rec &a, const sam_rec &b);
+  // both first or both last in the template, so not mates
+  static bool
+  same_segment(const sam_rec &a, const sam_rec &b) {
+    static const uint16_t segment_bits =
+      samflags::template_first | samflags::template_last;
+    return (a.flags & segment_bits) == (b.flags & segment_bits);
+  }
+
+  // files at each split; a name picks one with 4 bits of its hash
+  static const size_t n_spill_files = 16;
+  static const size_t max_split_depth = 16;
+  static uint64_t name_hash(const std::string &qname);
+
+  bool maybe_spilled(const std::string &qname) const;
+  void spill(const sam_rec &sr);
+  void open_spill(spill_file &f);
+  void write_spilled(spill_file &f, const sam_rec &sr);
+  void rewind_spill(spill_file &f);
+  bool read_spilled(spill_file &f, sam_rec &sr);
+  void split_spill(spill_file &f, const size_t depth,
+                   std::vector<spill_file> &parts);
+
+  size_t max_waiting;
+  std::string spill_dir;
+
+  std::string curr_chrom;
+  std::unordered_map<std::string, sam_rec> waiting;
+  mate_pos_queue by_mate_pos; // waiting reads, ordered by pnext
+
+  std::vector<spill_file> spill_files;
+  std::vector<uint64_t> spilled_filter; // Bloom filter bits
+  std::string spill_buf;
+
+  size_t n_pairs;
+  size_t n_fragments;
+  size_t n_spilled;
+};
+
+#endif
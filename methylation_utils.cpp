@@ -0,0 +1,165 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "methylation_utils.hpp"
+#include "bisulfite_utils.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+const char *
+meth_context_name(const uint8_t context) {
+  static const char *names[] = {"CpG", "CHG", "CHH"};
+  return names[context];
+}
+
+void
+append_methylation_site(const methylation_site &s, string &out) {
+  const uint32_t n_reads = s.n_meth + s.n_unmeth;
+  const double level =
+    n_reads > 0 ? static_cast<double>(s.n_meth)/n_reads : 0.0;
+  char buf[64];
+  const int n = std::snprintf(buf, sizeof(buf), "\t%u\t%c\t%s\t%g\t%u\n",
+                              s.pos, s.strand, meth_context_name(s.context),
+                              level, n_reads);
+  out.append(s.chrom);
+  out.append(buf, n);
+}
+
+static inline char
+upper(const char c) {
+  return std::toupper(static_cast<unsigned char>(c));
+}
+
+void
+chrom_methylation::init(const string &c, const string &s) {
+  clear();
+  chrom = c;
+  seq = &s;
+  for (size_t i = 0; i < s.size(); ++i) {
+    const char b = upper(s[i]);
+    if (b == 'C' || b == 'G')
+      pos.push_back(i);
+  }
+  n_meth.resize(pos.size(), 0);
+  n_unmeth.resize(pos.size(), 0);
+}
+
+void
+chrom_methylation::clear() {
+  chrom.clear();
+  seq = nullptr;
+  // swap to release the memory, as chroms differ greatly in size
+  vector<uint32_t>().swap(pos);
+  vector<uint16_t>().swap(n_meth);
+  vector<uint16_t>().swap(n_unmeth);
+}
+
+char
+chrom_methylation::site_strand(const size_t i) const {
+  return upper((*seq)[pos[i]]) == 'C' ? '+' : '-';
+}
+
+uint8_t
+chrom_methylation::site_context(const size_t i) const {
+  const string &s = *seq;
+  const size_t p = pos[i];
+  if (upper(s[p]) == 'C') {
+    if (p + 1 < s.size() && upper(s[p + 1]) == 'G') return meth_context::CpG;
+    if (p + 2 < s.size() && upper(s[p + 2]) == 'G') return meth_context::CHG;
+  }
+  else {
+    if (p >= 1 && upper(s[p - 1]) == 'C') return meth_context::CpG;
+    if (p >= 2 && upper(s[p - 2]) == 'C') return meth_context::CHG;
+  }
+  return meth_context::CHH;
+}
+
+static inline void
+increment(uint16_t &count) {
+  if (count < 65535) ++count;
+}
+
+void
+chrom_methylation::count_read(const sam_rec &sr) {
+  if (sr.seq == "*" || pos.empty()) return;
+  const packed_cigar *cigar = &sr.cigar_ops;
+  if (!sr.has_packed_cigar()) {
+    pack_cigar(sr.cigar, cigar_buf);
+    cigar = &cigar_buf;
+  }
+  // the reference base of the counted strand's cytosines, and the read
+  // bases for methylated and unmethylated
+  const bool rc = samflags::check(sr.flags, samflags::read_rc);
+  const bool pos_strand = is_t_rich(sr) != rc;
+  const char ref_c = pos_strand ? 'C' : 'G';
+  const char unmeth_c = pos_strand ? 'T' : 'A';
+
+  uint32_t r = sr.pos - 1;
+  size_t q = 0;
+  size_t i = std::lower_bound(begin(pos), end(pos), r) - begin(pos);
+  const string &s = *seq;
+  for (auto w : *cigar) {
+    const size_t len = cigar_word_len(w);
+    const char op = cigar_word_op(w);
+    if (op == 'M' || op == '=' || op == 'X') {
+      const uint32_t r_end = r + len;
+      for (; i < pos.size() && pos[i] < r_end; ++i) {
+        const size_t read_pos = q + (pos[i] - r);
+        if (read_pos >= sr.seq.size() || upper(s[pos[i]]) != ref_c)
+          continue;
+        const char b = upper(sr.seq[read_pos]);
+        if (b == ref_c) increment(n_meth[i]);
+        else if (b == unmeth_c) increment(n_unmeth[i]);
+      }
+      r = r_end;
+      q += len;
+    }
+    else if (op == 'D' || op == 'N') {
+      r += len;
+      for (; i < pos.size() && pos[i] < r; ++i);
+    }
+    else if (op == 'I' || op == 'S') q += len;
+  }
+}
+
+MethylationCounter::MethylationCounter(const vector<string> &names,
+                                       const vector<string> &s,
+                                       const bool co) :
+  seqs(s), covered_only(co), prev_pos(0) {
+  if (names.size() != seqs.size())
+    throw runtime_error("chrom names and sequences differ in number");
+  for (size_t i = 0; i < names.size(); ++i)
+    chrom_index.insert(std::make_pair(names[i], i));
+}
+
+void
+MethylationCounter::start_chrom(const string &chrom) {
+  if (!seen_chroms.insert(chrom).second)
+    throw runtime_error("input not sorted by chrom: " + chrom);
+  auto the_chrom = chrom_index.find(chrom);
+  if (the_chrom == end(chrom_index))
+    throw runtime_error("chrom not in reference: " + chrom);
+  counts.init(chrom, seqs[the_chrom->second]);
+  prev_pos = 0;
+}
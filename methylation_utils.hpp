@@ -0,0 +1,147 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef METHYLATION_UTILS_HPP
+#define METHYLATION_UTILS_HPP
+
+#include "sam_record.hpp"
+#include "cigar_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <stdexcept>
+#include <cstdint>
+
+namespace meth_context {
+  static const uint8_t CpG = 0;
+  static const uint8_t CHG = 1;
+  static const uint8_t CHH = 2;
+}
+
+// "CpG", "CHG" or "CHH"
+const char *
+meth_context_name(const uint8_t context);
+
+// one cytosine; pos is 0-based, and strand '-' means a G in the reference
+struct methylation_site {
+  std::string chrom;
+  uint32_t pos;
+  char strand;
+  uint8_t context;
+  uint32_t n_meth;
+  uint32_t n_unmeth;
+};
+
+// appends "chrom pos strand context level n_reads" and a newline
+void
+append_methylation_site(const methylation_site &s, std::string &out);
+
+/* chrom_methylation: counts for every cytosine, on either strand, of
+ * one chrom. Only the site positions and two 16-bit counts are kept,
+ * 8 bytes per site; counts saturate at 65535. Contexts are found from
+ * the reference when sites are written, so the reference must outlive
+ * this object. Reads from the T-rich strand count C's on the strand
+ * they map to, and A-rich reads count the opposite strand: a C (or G
+ * on the - strand) in the read is methylated and a T (or A) is not.
+ */
+class chrom_methylation {
+public:
+  chrom_methylation() : seq(nullptr) {}
+  void init(const std::string &chrom, const std::string &seq);
+  void clear();
+
+  const std::string &get_chrom() const {return chrom;}
+  size_t n_sites() const {return pos.size();}
+  void count_read(const sam_rec &sr);
+
+  template <class Output> void
+  write_sites(Output &out, const bool covered_only = true) const {
+    methylation_site s;
+    s.chrom = chrom;
+    for (size_t i = 0; i < pos.size(); ++i)
+      if (!covered_only || n_meth[i] + n_unmeth[i] > 0) {
+        s.pos = pos[i];
+        s.strand = site_strand(i);
+        s.context = site_context(i);
+        s.n_meth = n_meth[i];
+        s.n_unmeth = n_unmeth[i];
+        out(s);
+      }
+  }
+
+private:
+  char site_strand(const size_t i) const;
+  uint8_t site_context(const size_t i) const;
+
+  std::string chrom;
+  const std::string *seq;
+  std::vector<uint32_t> pos; // sorted
+  std::vector<uint16_t> n_meth;
+  std::vector<uint16_t> n_unmeth;
+  packed_cigar cigar_buf;
+};
+
+/* MethylationCounter: counts from one stream of records sorted by
+ * chrom and position, such as a SAM text file. Each chrom is written
+ * to the output functor, as methylation_site objects in position
+ * order, once the input moves on to the next chrom, so memory is the
+ * arrays for one chrom. Unmapped records are skipped; any other
+ * filtering is for the caller. The names and sequences must outlive
+ * the counter. Call flush() after the last record.
+ */
+class MethylationCounter {
+public:
+  MethylationCounter(const std::vector<std::string> &names,
+                     const std::vector<std::string> &seqs,
+                     const bool covered_only = true);
+
+  template <class Output> void
+  add(const sam_rec &sr, Output &out) {
+    if (sr.pos == 0 || samflags::check(sr.flags, samflags::read_unmapped))
+      return;
+    if (sr.rname != counts.get_chrom()) {
+      flush(out);
+      start_chrom(sr.rname);
+    }
+    else if (sr.pos < prev_pos)
+      throw std::runtime_error("input not sorted by position: " +
+                               sr.rname + ":" + std::to_string(sr.pos));
+    prev_pos = sr.pos;
+    counts.count_read(sr);
+  }
+
+  template <class Output> void
+  flush(Output &out) {
+    counts.write_sites(out, covered_only);
+    counts.clear();
+  }
+
+private:
+  void start_chrom(const std::string &chrom);
+
+  const std::vector<std::string> &seqs;
+  std::unordered_map<std::string, size_t> chrom_index;
+  std::unordered_set<std::string> seen_chroms;
+  bool covered_only;
+  chrom_methylation counts;
+  uint32_t prev_pos;
+};
+
+#endif
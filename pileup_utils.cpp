@@ -0,0 +1,98 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "pileup_utils.hpp"
+
+using std::string;
+using std::vector;
+
+static const size_t initial_ring_size = 1 << 12;
+
+PileupEngine::PileupEngine(const pileup_filter &f) :
+  filter(f), ring(initial_ring_size), ring_mask(initial_ring_size - 1),
+  win_start(0), win_end(0), n_used(0), n_filtered(0) {
+  col.pos = 0;
+}
+
+void
+PileupEngine::reserve_window(const uint32_t end_pos) {
+  if (end_pos - win_start <= ring.size()) return;
+  size_t new_size = ring.size();
+  while (new_size < end_pos - win_start)
+    new_size <<= 1;
+  // slots move because the mask changes with the size
+  vector<pileup_counts> new_ring(new_size);
+  for (uint32_t i = win_start; i < win_end; ++i)
+    new_ring[i & (new_size - 1)] = ring[i & ring_mask];
+  ring.swap(new_ring);
+  ring_mask = new_size - 1;
+}
+
+static inline size_t
+base_index(const char c) {
+  switch (c) {
+  case 'A': case 'a': return pileup_base::A;
+  case 'C': case 'c': return pileup_base::C;
+  case 'G': case 'g': return pileup_base::G;
+  case 'T': case 't': return pileup_base::T;
+  default: return pileup_base::N;
+  }
+}
+
+void
+PileupEngine::count_read(const sam_rec &sr) {
+  const packed_cigar *cigar = &sr.cigar_ops;
+  if (!sr.has_packed_cigar()) {
+    pack_cigar(sr.cigar, cigar_buf);
+    cigar = &cigar_buf;
+  }
+  const uint32_t start = sr.pos - 1;
+  const uint32_t end_pos = start + cigar_rseq_ops(*cigar);
+  reserve_window(end_pos);
+  win_end = std::max(win_end, end_pos);
+
+  const bool rc = samflags::check(sr.flags, samflags::read_rc);
+  const bool check_qual = filter.min_base_qual > 0 && sr.qual != "*";
+  // unsigned, as min_base_qual + 33 does not fit in a char above 94
+  const unsigned min_qual = filter.min_base_qual + 33u;
+  const size_t seq_len = sr.seq == "*" ? 0 : sr.seq.size();
+
+  uint32_t r = start;
+  size_t q = 0;
+  for (auto w : *cigar) {
+    const size_t len = cigar_word_len(w);
+    const char op = cigar_word_op(w);
+    if (op == 'M' || op == '=' || op == 'X') {
+      for (size_t j = 0; j < len; ++j, ++r, ++q) {
+        if (q >= seq_len ||
+            (check_qual && static_cast<uint8_t>(sr.qual[q]) < min_qual))
+          continue;
+        pileup_counts &c = ring[r & ring_mask];
+        ++(rc ? c.rev : c.fwd)[base_index(sr.seq[q])];
+      }
+    }
+    else if (op == 'D') {
+      for (size_t j = 0; j < len; ++j, ++r) {
+        pileup_counts &c = ring[r & ring_mask];
+        ++(rc ? c.rev : c.fwd)[pileup_base::del];
+      }
+    }
+    else if (op == 'N') r += len;
+    else if (op == 'I' || op == 'S') q += len;
+  }
+}
@@ -0,0 +1,167 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PILEUP_UTILS_HPP
+#define PILEUP_UTILS_HPP
+
+#include "sam_record.hpp"
+#include "cigar_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdint>
+
+// indices into the per-strand counts of a pileup column
+namespace pileup_base {
+  static const size_t A = 0;
+  static const size_t C = 1;
+  static const size_t G = 2;
+  static const size_t T = 3;
+  static const size_t N = 4; // any other base
+  static const size_t del = 5;
+  static const size_t n_kinds = 6;
+}
+
+struct pileup_counts {
+  uint32_t fwd[pileup_base::n_kinds];
+  uint32_t rev[pileup_base::n_kinds];
+
+  pileup_counts() {clear();}
+  void clear() {
+    for (size_t i = 0; i < pileup_base::n_kinds; ++i)
+      fwd[i] = rev[i] = 0;
+  }
+  uint32_t total() const {
+    uint32_t t = 0;
+    for (size_t i = 0; i < pileup_base::n_kinds; ++i)
+      t += fwd[i] + rev[i];
+    return t;
+  }
+};
+
+// a finished column; pos is 0-based, unlike sam_rec::pos
+struct pileup_column {
+  std::string chrom;
+  uint32_t pos;
+  pileup_counts counts;
+};
+
+/* Reads failing the flag or MAPQ tests are skipped entirely; bases
+ * below min_base_qual are skipped individually (deletions have no
+ * quality and are always counted). By default unmapped, secondary,
+ * QC-failed, duplicate and supplementary records are excluded.
+ */
+struct pileup_filter {
+  uint16_t required_flags;
+  uint16_t excluded_flags;
+  uint8_t min_mapq;
+  uint8_t min_base_qual;
+
+  pileup_filter() :
+    required_flags(0),
+    excluded_flags(samflags::read_unmapped | samflags::secondary_aln |
+                   samflags::below_quality | samflags::pcr_duplicate |
+                   samflags::supplementary_aln),
+    min_mapq(0), min_base_qual(0) {}
+  bool keep(const sam_rec &sr) const {
+    return (sr.flags & required_flags) == required_flags &&
+      (sr.flags & excluded_flags) == 0 && sr.mapq >= min_mapq && sr.pos > 0;
+  }
+};
+
+/* PileupEngine: feed records sorted by chrom and position through
+ * add(); each reference position with any coverage is passed to the
+ * output functor as a pileup_column once the input has moved past it,
+ * so columns come out in order. Counts for unfinished positions live
+ * in a ring buffer indexed by position, which grows to the longest
+ * reference span of a read but is never larger than that. The two
+ * mates of an overlapping pair are both counted. Call flush() after
+ * the last record.
+ */
+class PileupEngine {
+public:
+  explicit PileupEngine(const pileup_filter &f = pileup_filter());
+
+  template <class Output> void
+  add(const sam_rec &sr, Output &out) {
+    if (!filter.keep(sr)) {
+      ++n_filtered;
+      return;
+    }
+    if (sr.rname != col.chrom) {
+      flush(out);
+      if (!seen_chroms.insert(sr.rname).second)
+        throw std::runtime_error("input not sorted by chrom: " + sr.rname);
+      col.chrom = sr.rname;
+      win_start = win_end = sr.pos - 1;
+    }
+    else if (sr.pos - 1 < win_start)
+      throw std::runtime_error("input not sorted by position: " +
+                               sr.rname + ":" + std::to_string(sr.pos));
+    emit_before(sr.pos - 1, out);
+    count_read(sr);
+    ++n_used;
+  }
+
+  template <class Output> void
+  flush(Output &out) {
+    emit_before(win_end, out);
+  }
+
+  size_t get_n_used() const {return n_used;}
+  size_t get_n_filtered() const {return n_filtered;}
+
+private:
+  template <class Output> void
+  emit_before(const uint32_t pos, Output &out) {
+    const uint32_t lim = std::min(pos, win_end);
+    for (uint32_t i = win_start; i < lim; ++i) {
+      pileup_counts &c = ring[i & ring_mask];
+      if (c.total() > 0) {
+        col.pos = i;
+        col.counts = c;
+        out(col);
+        c.clear();
+      }
+    }
+    win_start = pos;
+    win_end = std::max(win_end, pos);
+  }
+
+  void count_read(const sam_rec &sr);
+  void reserve_window(const uint32_t end_pos);
+
+  pileup_filter filter;
+
+  // counts for positions [win_start, win_end) are at pos & ring_mask
+  std::vector<pileup_counts> ring;
+  size_t ring_mask;
+  uint32_t win_start;
+  uint32_t win_end;
+
+  pileup_column col; // reused for each column emitted
+  packed_cigar cigar_buf;
+  std::unordered_set<std::string> seen_chroms;
+  size_t n_used;
+  size_t n_filtered;
+};
+
+#endif
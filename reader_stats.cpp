@@ -0,0 +1,42 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "reader_stats.hpp"
+
+#include <sstream>
+
+using std::string;
+
+const size_t reader_stats::timing_interval;
+
+string
+reader_stats::tostring() const {
+  std::ostringstream oss;
+  oss << "records: " << n_records << '\n'
+      << "filtered: " << n_filtered << '\n'
+      << "bytes: " << n_bytes << '\n'
+      << "read_time: " << read_time << '\n'
+      << "decode_time: " << decode_time << '\n'
+      << "parse_time: " << parse_time;
+  return oss.str();
+}
+
+std::ostream &
+operator<<(std::ostream &out, const reader_stats &s) {
+  return out << s.tostring();
+}
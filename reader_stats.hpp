@@ -0,0 +1,93 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef READER_STATS_HPP
+#define READER_STATS_HPP
+
+#include <string>
+#include <iostream>
+#include <chrono>
+
+/* reader_stats: counters kept by SAMReader and SAMTextReader, to be
+ * logged at the end of a run. Counts are always kept, as they cost an
+ * addition per record. Times are only kept after set_timing(true) on
+ * the reader. All times are in seconds of work, summed over threads,
+ * so with threads they can exceed the time elapsed:
+ *
+ *   read_time    getting raw records: sam_read1 (including BGZF
+ *                decompression) or reading and inflating text blocks
+ *   decode_time  converting a bam1_t into a sam_rec
+ *   parse_time   parsing SAM text into a sam_rec
+ *
+ * Steps done per record are timed on one record in every
+ * timing_interval, which stands for the records in between, so those
+ * times are estimates. Text blocks, and the chunks of a parallel
+ * parse, are each timed in full.
+ *
+ * n_bytes is the uncompressed size of the records read, as stored in
+ * the input: lines of SAM text with their newlines, or BAM records of
+ * 36 + l_data bytes, their size after BGZF decompression. Headers are
+ * not counted. SAMReader only sees SAM text it reads on the calling
+ * thread; with threads, htslib parses SAM on the pool, and those
+ * records add nothing to n_bytes.
+ */
+struct reader_stats {
+  static const size_t timing_interval = 64;
+
+  size_t n_records;  // records returned to the caller
+  size_t n_filtered; // records read but skipped by a filter
+  size_t n_bytes;
+  double read_time;
+  double decode_time;
+  double parse_time;
+
+  reader_stats() {clear();}
+  void clear() {
+    n_records = n_filtered = n_bytes = 0;
+    read_time = decode_time = parse_time = 0.0;
+  }
+  // whether to time the next record, counting those returned so far
+  static bool sample(const bool timing, const size_t n) {
+    return timing && n % timing_interval == 0;
+  }
+  std::string tostring() const;
+};
+
+std::ostream &
+operator<<(std::ostream &out, const reader_stats &s);
+
+// adds the time until it goes out of scope, times weight, to t, if on
+class scoped_stats_timer {
+public:
+  scoped_stats_timer(const bool o, double &t, const double w = 1.0) :
+    on(o), total(t), weight(w) {
+    if (on) start = std::chrono::steady_clock::now();
+  }
+  ~scoped_stats_timer() {
+    if (on)
+      total += weight*std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+private:
+  bool on;
+  double &total;
+  double weight;
+  std::chrono::steady_clock::time_point start;
+};
+
+#endif
@@ -0,0 +1,193 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "sam_filter.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+#include <iterator>
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+static void
+throw_bad_clause(const string &clause) {
+  throw runtime_error("bad filter spec clause: " + clause);
+}
+
+static string
+trim(const string &s) {
+  const size_t a = s.find_first_not_of(" \t");
+  if (a == string::npos) return string();
+  return s.substr(a, s.find_last_not_of(" \t") - a + 1);
+}
+
+// base 0 only for flag masks, so "mapq>=010" is not octal
+static int64_t
+parse_integer(const string &s, const string &clause, const int base = 10) {
+  const string t = trim(s);
+  if (t.empty()) throw_bad_clause(clause);
+  char *end = nullptr;
+  errno = 0;
+  const int64_t x = std::strtoll(t.c_str(), &end, base);
+  if (errno != 0 || *end != '\0') throw_bad_clause(clause);
+  return x;
+}
+
+static uint16_t
+parse_flag_mask(const string &s, const string &clause) {
+  const int64_t x = parse_integer(s, clause, 0);
+  if (x < 0 || x > 0xffff)
+    throw runtime_error("flag mask not 16 bits in filter spec: " + clause);
+  return x;
+}
+
+// splits "lhs<op>rhs" at the first comparison operator
+static bool
+split_comparison(const string &clause, string &lhs,
+                 sam_tag_test::op_type &op, string &rhs) {
+  const size_t i = clause.find_first_of("<>=!");
+  if (i == string::npos || i + 1 >= clause.size()) return false;
+  const bool two = clause[i + 1] == '=';
+  switch (clause[i]) {
+  case '<': op = two ? sam_tag_test::le : sam_tag_test::lt; break;
+  case '>': op = two ? sam_tag_test::ge : sam_tag_test::gt; break;
+  case '=': if (!two) return false; op = sam_tag_test::eq; break;
+  default: if (!two) return false; op = sam_tag_test::ne; break;
+  }
+  lhs = trim(clause.substr(0, i));
+  rhs = clause.substr(i + (two ? 2 : 1));
+  return true;
+}
+
+void
+sam_filter::clear() {
+  required = 0;
+  forbidden = 0;
+  mapq_ok.set();
+  all_chroms = true;
+  chroms.clear();
+  chrom_bits.clear();
+  tag_tests.clear();
+}
+
+void
+sam_filter::parse_clause(const string &clause) {
+  if (clause.compare(0, 8, "require ") == 0)
+    required |= parse_flag_mask(clause.substr(8), clause);
+  else if (clause.compare(0, 8, "exclude ") == 0)
+    forbidden |= parse_flag_mask(clause.substr(8), clause);
+  else if (clause.compare(0, 5, "rname") == 0) {
+    const string rest = trim(clause.substr(5));
+    if (rest.compare(0, 2, "in") != 0) throw_bad_clause(clause);
+    const string names = trim(rest.substr(2));
+    if (names.size() < 2 || names.front() != '{' || names.back() != '}')
+      throw_bad_clause(clause);
+    std::unordered_set<string> these;
+    size_t start = 1;
+    while (start < names.size()) {
+      size_t comma = names.find(',', start);
+      if (comma == string::npos) comma = names.size() - 1;
+      const string name = trim(names.substr(start, comma - start));
+      if (!name.empty()) these.insert(name);
+      start = comma + 1;
+    }
+    // each clause must hold, so a later set narrows an earlier one
+    if (all_chroms)
+      chroms.swap(these);
+    else
+      for (auto i = begin(chroms); i != end(chroms);)
+        i = these.count(*i) ? std::next(i) : chroms.erase(i);
+    all_chroms = false; // an empty set keeps no records
+  }
+  else {
+    string lhs, rhs;
+    sam_tag_test::op_type op;
+    if (!split_comparison(clause, lhs, op, rhs)) throw_bad_clause(clause);
+    const int64_t value = parse_integer(rhs, clause);
+    if (lhs == "mapq") {
+      sam_tag_test t;
+      t.op = op;
+      t.value = value;
+      for (size_t q = 0; q < mapq_ok.size(); ++q)
+        if (!t.test(q)) mapq_ok.reset(q);
+      if (mapq_ok.none())
+        throw runtime_error("no MAPQ kept by filter spec: " + clause);
+    }
+    else {
+      if (lhs.size() != 2 ||
+          !std::isalpha(static_cast<unsigned char>(lhs[0])))
+        throw_bad_clause(clause);
+      sam_tag_test t;
+      t.tag[0] = lhs[0];
+      t.tag[1] = lhs[1];
+      t.tag[2] = '\0';
+      t.op = op;
+      t.value = value;
+      tag_tests.push_back(t);
+    }
+  }
+}
+
+void
+sam_filter::parse(const string &spec) {
+  clear();
+  // commas inside braces separate chrom names, not clauses
+  size_t start = 0, depth = 0;
+  for (size_t i = 0; i <= spec.size(); ++i) {
+    if (i == spec.size() || (spec[i] == ',' && depth == 0)) {
+      const string clause = trim(spec.substr(start, i - start));
+      if (!clause.empty()) parse_clause(clause);
+      start = i + 1;
+    }
+    else if (spec[i] == '{') ++depth;
+    else if (spec[i] == '}') {
+      if (depth == 0) throw_bad_clause(spec);
+      --depth;
+    }
+  }
+  if (depth != 0) throw_bad_clause(spec);
+}
+
+void
+sam_filter::bind(const vector<string> &ref_names) {
+  chrom_bits.resize(ref_names.size());
+  for (size_t i = 0; i < ref_names.size(); ++i)
+    chrom_bits[i] = chroms.count(ref_names[i]) > 0;
+}
+
+void
+sam_filter::bind(const sam_header &hdr) {
+  vector<string> ref_names;
+  for (auto &s : hdr.get_refs())
+    ref_names.push_back(s.name);
+  bind(ref_names);
+}
+
+bool
+sam_filter::keep_tags(const sam_rec &sr) const {
+  int64_t x = 0;
+  for (auto &t : tag_tests)
+    if (!sr.get_int_tag(t.tag, x) || !t.test(x))
+      return false;
+  return true;
+}
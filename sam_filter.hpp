@@ -0,0 +1,115 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef SAM_FILTER_HPP
+#define SAM_FILTER_HPP
+
+#include "sam_record.hpp"
+#include "sam_header.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <bitset>
+#include <cstdint>
+
+// an integer tag compared with a constant; a missing tag fails
+struct sam_tag_test {
+  enum op_type {lt, le, gt, ge, eq, ne};
+  char tag[3];
+  op_type op;
+  int64_t value;
+
+  bool test(const int64_t x) const {
+    switch (op) {
+    case lt: return x < value;
+    case le: return x <= value;
+    case gt: return x > value;
+    case ge: return x >= value;
+    case eq: return x == value;
+    default: return x != value;
+    }
+  }
+};
+
+/* sam_filter: a record filter compiled once from a spec, a comma
+ * separated list of clauses, all of which must hold:
+ *
+ *   require 0x3          all these flag bits set
+ *   exclude 0x904        none of these flag bits set
+ *   mapq>=10             also >, <=, <, ==, !=
+ *   rname in {chr1,chr2} reference name is one of these
+ *   NM<=5                integer tag; also <, >, >=, ==, !=
+ *
+ * Flag masks are 16 bits, in decimal, hex (0x) or octal (leading 0);
+ * other numbers are decimal. An integer tag test fails if the tag is
+ * missing or not of an integer type. Clauses on the same field must
+ * all hold, so a second "rname in" keeps only names in both sets.
+ *
+ * Flags reduce to a required/forbidden mask pair and MAPQ to a table
+ * of the 256 values kept, so keep_core() is a few tests without
+ * branches. Chroms are
+ * tested by name in keep(), or as a bitset over reference ids after
+ * bind(), which is how SAMReader tests records before decoding them.
+ */
+class sam_filter {
+public:
+  sam_filter() {clear();}
+  explicit sam_filter(const std::string &spec) {parse(spec);}
+
+  // replaces the current filter; throws on a bad spec
+  void parse(const std::string &spec);
+  void clear();
+
+  // set the chrom bitset for reference ids in header order
+  void bind(const std::vector<std::string> &ref_names);
+  void bind(const sam_header &hdr);
+
+  // chrom_id is the reference id from bind(); -1 if unplaced
+  bool keep_core(const uint16_t flags, const uint8_t mapq,
+                 const int32_t chrom_id) const {
+    return ((flags & required) == required) & ((flags & forbidden) == 0) &
+      mapq_ok[mapq] &
+      (all_chroms || (chrom_id >= 0 &&
+                      static_cast<size_t>(chrom_id) < chrom_bits.size() &&
+                      chrom_bits[chrom_id]));
+  }
+  bool keep_tags(const sam_rec &sr) const;
+  bool keep(const sam_rec &sr) const {
+    return ((sr.flags & required) == required) &
+      ((sr.flags & forbidden) == 0) &
+      mapq_ok[sr.mapq] &&
+      (all_chroms || chroms.count(sr.rname) > 0) &&
+      (tag_tests.empty() || keep_tags(sr));
+  }
+
+  const std::vector<sam_tag_test> &get_tag_tests() const {return tag_tests;}
+
+private:
+  void parse_clause(const std::string &clause);
+
+  uint16_t required;
+  uint16_t forbidden;
+  std::bitset<256> mapq_ok; // by MAPQ value
+  bool all_chroms;
+  std::unordered_set<std::string> chroms;
+  std::vector<bool> chrom_bits;
+  std::vector<sam_tag_test> tag_tests;
+};
+
+#endif
@@ -0,0 +1,262 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "sam_header.hpp"
+
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::runtime_error;
+
+string
+sam_header_line::get(const string &tag) const {
+  for (auto &f : fields)
+    if (f.first == tag) return f.second;
+  return string();
+}
+
+void
+sam_header_line::set(const string &tag, const string &value) {
+  for (auto &f : fields)
+    if (f.first == tag) {
+      f.second = value;
+      return;
+    }
+  fields.push_back(std::make_pair(tag, value));
+}
+
+void
+sam_header::clear() {
+  hd = sam_header_line();
+  sq.clear();
+  rg.clear();
+  pg.clear();
+  other.clear();
+  co.clear();
+  name_to_id.clear();
+  order.clear();
+}
+
+int32_t
+sam_header::add_ref(const string &name, const size_t length) {
+  if (!name_to_id.insert(std::make_pair(name, sq.size())).second)
+    throw runtime_error("duplicate reference in SAM header: " + name);
+  return push_ref(name, length);
+}
+
+int32_t
+sam_header::push_ref(const string &name, const size_t length) {
+  const int32_t id = sq.size();
+  sam_header_sq s;
+  s.name = name;
+  s.length = length;
+  s.chrom_id = GenomicRegion::assign_chrom(name);
+  if (sq.empty())
+    order.push_back(std::make_pair(sq_kind, 0));
+  sq.push_back(s);
+  return id;
+}
+
+void
+sam_header::add_sq_fields(const sam_header_line &line, const int32_t id) {
+  for (auto &f : line.fields)
+    if (f.first != "SN" && f.first != "LN")
+      sq[id].other_fields.push_back(f);
+}
+
+void
+sam_header::add_line(const sam_header_line &line) {
+  if (line.type == "SQ") {
+    const string name = line.get("SN"), length = line.get("LN");
+    if (name.empty() || length.empty() ||
+        length.find_first_not_of("0123456789") != string::npos)
+      throw runtime_error("bad @SQ line in SAM header: SN:" + name);
+    add_sq_fields(line, add_ref(name, std::strtoull(length.c_str(), 0, 10)));
+  }
+  else if (line.type == "HD") hd = line;
+  else if (line.type == "RG") {
+    order.push_back(std::make_pair(rg_kind, rg.size()));
+    rg.push_back(line);
+  }
+  else if (line.type == "PG") {
+    order.push_back(std::make_pair(pg_kind, pg.size()));
+    pg.push_back(line);
+  }
+  else {
+    order.push_back(std::make_pair(other_kind, other.size()));
+    other.push_back(line);
+  }
+}
+
+void
+sam_header::add_comment(const string &comment) {
+  order.push_back(std::make_pair(co_kind, co.size()));
+  co.push_back(comment);
+}
+
+void
+sam_header::parse(const string &text) {
+  clear();
+  parse_lines(text, false);
+}
+
+void
+sam_header::parse(const string &text, const vector<string> &names,
+                  const vector<size_t> &lengths) {
+  clear();
+  // a repeated name keeps its id, but lookups find the first
+  for (size_t i = 0; i < names.size(); ++i) {
+    name_to_id.insert(std::make_pair(names[i], sq.size()));
+    push_ref(names[i], lengths[i]);
+  }
+  parse_lines(text, true);
+}
+
+void
+sam_header::parse_lines(const string &text, const bool refs_given) {
+  // given references are placed where the first @SQ line names one
+  if (refs_given)
+    order.clear();
+  bool sq_placed = false;
+  vector<bool> seen(refs_given ? sq.size() : 0, false);
+
+  const char *p = text.data();
+  const char *const lim = p + text.size();
+  sam_header_line line;
+  while (p < lim) {
+    const char *nl = static_cast<const char *>(std::memchr(p, '\n', lim - p));
+    const char *line_end = nl ? nl : lim;
+    const char *const next = line_end + 1;
+    if (line_end > p && *(line_end - 1) == '\r')
+      --line_end;
+    // skip blank and malformed lines
+    if (line_end - p < 3 || *p != '@' ||
+        (line_end - p > 3 && p[3] != '\t')) {
+      p = next;
+      continue;
+    }
+
+    if (p[1] == 'C' && p[2] == 'O')
+      add_comment(string(p + std::min<ptrdiff_t>(line_end - p, 4), line_end));
+    else {
+      line.type.assign(p + 1, 2);
+      line.fields.clear();
+      for (const char *f = p + 3; f < line_end;) {
+        ++f; // the tab
+        const char *tab =
+          static_cast<const char *>(std::memchr(f, '\t', line_end - f));
+        const char *f_end = tab ? tab : line_end;
+        if (f_end - f >= 3 && f[2] == ':')
+          line.fields.push_back(std::make_pair(string(f, 2),
+                                               string(f + 3, f_end)));
+        f = f_end;
+      }
+      if (refs_given && line.type == "SQ") {
+        // only the first line for each given reference counts
+        const int32_t id = ref_id(line.get("SN"));
+        if (id >= 0 && !seen[id]) {
+          if (!sq_placed)
+            order.push_back(std::make_pair(sq_kind, 0));
+          sq_placed = true;
+          seen[id] = true;
+          add_sq_fields(line, id);
+        }
+      }
+      else add_line(line);
+    }
+    p = next;
+  }
+  // otherwise they follow @HD
+  if (refs_given && !sq.empty() && !sq_placed)
+    order.insert(begin(order), std::make_pair(sq_kind, 0));
+}
+
+GenomicRegion
+sam_header::make_region(const int32_t id, const size_t start,
+                        const size_t end) const {
+  GenomicRegion r;
+  r.chrom = sq[id].chrom_id; // already interned by add_ref
+  r.start = start;
+  r.end = end;
+  return r;
+}
+
+static void
+append_fields(const vector<pair<string, string> > &fields, string &out) {
+  for (auto &f : fields) {
+    out.push_back('\t');
+    out.append(f.first);
+    out.push_back(':');
+    out.append(f.second);
+  }
+}
+
+static void
+append_line(const sam_header_line &line, string &out) {
+  out.push_back('@');
+  out.append(line.type);
+  append_fields(line.fields, out);
+  out.push_back('\n');
+}
+
+void
+sam_header::append_to(string &out) const {
+  if (!hd.type.empty())
+    append_line(hd, out);
+  for (auto &entry : order)
+    switch (entry.first) {
+    case sq_kind:
+      for (auto &s : sq) {
+        out.append("@SQ\tSN:");
+        out.append(s.name);
+        out.append("\tLN:");
+        out.append(std::to_string(s.length));
+        append_fields(s.other_fields, out);
+        out.push_back('\n');
+      }
+      break;
+    case rg_kind: append_line(rg[entry.second], out); break;
+    case pg_kind: append_line(pg[entry.second], out); break;
+    case other_kind: append_line(other[entry.second], out); break;
+    case co_kind:
+      out.append("@CO\t");
+      out.append(co[entry.second]);
+      out.push_back('\n');
+      break;
+    }
+}
+
+string
+sam_header::tostring() const {
+  string out;
+  // @SQ lines dominate in size, so reserve for them up front
+  out.reserve(sq.size()*32);
+  append_to(out);
+  return out;
+}
+
+std::ostream &
+operator<<(std::ostream &out, const sam_header &hdr) {
+  return out << hdr.tostring();
+}
@@ -0,0 +1,130 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef SAM_HEADER_HPP
+#define SAM_HEADER_HPP
+
+#include "GenomicRegion.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <iostream>
+#include <cstdint>
+
+// one header line other than @SQ or @CO, as its TAG:value fields
+struct sam_header_line {
+  std::string type; // two letters, without the '@'
+  std::vector<std::pair<std::string, std::string> > fields;
+
+  sam_header_line() {}
+  explicit sam_header_line(const std::string &t) : type(t) {}
+  // empty if the tag is absent
+  std::string get(const std::string &tag) const;
+  void set(const std::string &tag, const std::string &value);
+};
+
+// a reference sequence; chrom_id is its id in the GenomicRegion table
+struct sam_header_sq {
+  std::string name;
+  size_t length;
+  chrom_id_type chrom_id;
+  std::vector<std::pair<std::string, std::string> > other_fields;
+};
+
+/* sam_header: a parsed SAM header. References are numbered in header
+ * order, as in BAM, so records can be handled by integer id and name
+ * lookups are a single hash probe. Each reference name is also
+ * interned in the GenomicRegion chrom table when it is added, so
+ * regions made from an id need no further string lookups.
+ *
+ * Parsing is strict only for @SQ lines, since the reference ids
+ * depend on them: an @SQ line without SN, with an LN that is not a
+ * number, or with a repeated SN is an error. Other lines that are not
+ * '@' and a two letter type are skipped, as are empty fields and
+ * fields not of the form TAG:value.
+ *
+ * Serializing writes @HD first, then the other lines in the order
+ * they were parsed or added, except that all @SQ lines are written
+ * together, in id order, where the first one was.
+ */
+class sam_header {
+public:
+  sam_header() {}
+  explicit sam_header(const std::string &text) {parse(text);}
+
+  // replaces the contents with the header lines in text
+  void parse(const std::string &text);
+  // as above, but the references are the given names and lengths, as
+  // in the target list of a BAM file, which need not agree with the
+  // text; @SQ lines in text only add other fields to these
+  void parse(const std::string &text, const std::vector<std::string> &names,
+             const std::vector<size_t> &lengths);
+
+  size_t n_refs() const {return sq.size();}
+  const std::string &ref_name(const int32_t id) const {return sq[id].name;}
+  size_t ref_length(const int32_t id) const {return sq[id].length;}
+  chrom_id_type chrom_id(const int32_t id) const {return sq[id].chrom_id;}
+  // -1 if the name is not a reference in this header
+  int32_t ref_id(const std::string &name) const {
+    auto the_ref = name_to_id.find(name);
+    return the_ref == end(name_to_id) ? -1 : the_ref->second;
+  }
+  GenomicRegion make_region(const int32_t id, const size_t start,
+                            const size_t end) const;
+
+  int32_t add_ref(const std::string &name, const size_t length);
+  void add_line(const sam_header_line &line);
+  void add_comment(const std::string &comment);
+
+  const std::vector<sam_header_sq> &get_refs() const {return sq;}
+  const std::vector<sam_header_line> &get_read_groups() const {return rg;}
+  const std::vector<sam_header_line> &get_programs() const {return pg;}
+  const sam_header_line &get_hd() const {return hd;}
+
+  void clear();
+
+  // appends the whole header, each line ending in a newline
+  void append_to(std::string &out) const;
+  std::string tostring() const;
+
+private:
+  void parse_lines(const std::string &text, const bool refs_given);
+  int32_t push_ref(const std::string &name, const size_t length);
+  void add_sq_fields(const sam_header_line &line, const int32_t id);
+
+  // kinds of line, to keep them in order
+  enum line_kind {sq_kind, rg_kind, pg_kind, other_kind, co_kind};
+  // lines other than @HD in order, as kind and index; one sq_kind
+  // entry stands for all @SQ lines
+  std::vector<std::pair<line_kind, size_t> > order;
+
+  sam_header_line hd;
+  std::vector<sam_header_sq> sq;
+  std::vector<sam_header_line> rg;
+  std::vector<sam_header_line> pg;
+  std::vector<sam_header_line> other;
+  std::vector<std::string> co;
+  std::unordered_map<std::string, int32_t> name_to_id;
+};
+
+std::ostream &
+operator<<(std::ostream &out, const sam_header &hdr);
+
+#endif
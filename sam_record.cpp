@@ -20,6 +20,10 @@
 
 #include <regex>
 #include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cassert>
 
 #include "cigar_utils.hpp"
 #include "bisulfite_utils.hpp"
@@ -77,57 +81,348 @@ format_sam_flags(const uint16_t the_flags) {
 size_t
 sam_rec::estimate_line_size() const {
   static const size_t all_field_estimates = 100;
-  return qname.size() + rname.size() + qual.size() + all_field_estimates;
+  return qname.size() + rname.size() + seq.size() + qual.size() +
+    tags.get_text().size() + all_field_estimates;
+}
+
+void
+sam_rec::append_to(string &out) const {
+  out.append(qname);
+  out.push_back('\t');
+  smithlab::append_uint(out, flags);
+  out.push_back('\t');
+  out.append(rname);
+  out.push_back('\t');
+  smithlab::append_uint(out, pos);
+  out.push_back('\t');
+  smithlab::append_uint(out, mapq);
+  out.push_back('\t');
+  assert(!cigar_packed || cigar.empty()); // text set without unpacking
+  if (cigar_packed)
+    append_unpacked_cigar(cigar_ops, out);
+  else out.append(cigar);
+  out.push_back('\t');
+  out.append(rnext);
+  out.push_back('\t');
+  smithlab::append_uint(out, pnext);
+  out.push_back('\t');
+  smithlab::append_int(out, tlen);
+  out.push_back('\t');
+  out.append(seq);
+  out.push_back('\t');
+  out.append(qual);
+  if (!tags.empty()) {
+    out.push_back('\t');
+    out.append(tags.get_text());
+  }
 }
 
 string
 sam_rec::tostring() const {
   string out;
   out.reserve(estimate_line_size());
-  out.append(qname + "\t" +
-               to_string(flags) + "\t" +
-               rname + "\t" +
-               to_string(pos) + "\t" +
-               to_string(static_cast<unsigned>(mapq)) + "\t" +
-               cigar + "\t" +
-               rnext + "\t" +
-               to_string(pnext) + "\t" +
-               to_string(tlen) + "\t" +
-               seq + "\t" +
-               qual);
-  for (auto it(begin(tags)); it != end(tags); ++it)
-    out.append("\t" + *it);
-
+  append_to(out);
   return out;
 }
 
 ostream &
 operator<<(std::ostream &the_stream, const sam_rec &r) {
-  the_stream << r.tostring();
-  return the_stream;
+  static thread_local string buf; // keeps its capacity between records
+  buf.clear();
+  r.append_to(buf);
+  return the_stream.write(buf.data(), buf.size());
 }
 
-sam_rec::sam_rec(const string &line) {
+sam_rec::sam_rec(const string &line) :
+  flags(0), pos(0), mapq(255), cigar_packed(false), pnext(0), tlen(0),
+  rname_id(-1), rnext_id(-1) {
+  assign(line.data(), line.size());
+}
+
+static void
+throw_bad_sam_rec(const char *line, const size_t len) {
+  throw runtime_error("incorrect SAM record:\n" + string(line, len));
+}
+
+// returns false for empty tokens, non-digits, or values above max_val
+static bool
+token_to_uint(const char *s, const char *const lim, const uint64_t max_val,
+              uint64_t &x) {
+  if (s == lim) return false;
+  x = 0;
+  for (; s != lim; ++s) {
+    if (*s < '0' || *s > '9') return false;
+    x = x*10 + (*s - '0');
+    if (x > max_val) return false;
+  }
+  return true;
+}
 
-  istringstream iss; // ADS: change to set the buffer from "line"
-  iss.rdbuf()->pubsetbuf(const_cast<char*>(line.c_str()), line.size());
-  uint32_t will_become_mapq = 0; // to not read mapq as character
-                                 // since it's uint8_t
-  if (!(iss >>
-        qname >> flags >> rname >> pos >> will_become_mapq >>
-        cigar >> rnext >> pnext >> tlen >> seq >> qual))
-    throw runtime_error("incorrect SAM record:\n" + line);
-  if (mapq > 255)
-    throw runtime_error("invalid mapq in SAM record: " + line);
-  mapq = static_cast<uint8_t>(will_become_mapq);
+void
+sam_rec::assign(const char *line, size_t len) {
+  static const size_t n_mandatory = 11;
+  // drop the line ending if the caller left it on
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    --len;
+
+  const char *field[n_mandatory];
+  const char *field_end[n_mandatory];
+  const char *const lim = line + len;
+  const char *p = line;
+  for (size_t i = 0; i < n_mandatory; ++i) {
+    if (p > lim) throw_bad_sam_rec(line, len);
+    const char *tab = static_cast<const char *>(std::memchr(p, '\t', lim - p));
+    field[i] = p;
+    field_end[i] = tab ? tab : lim;
+    p = field_end[i] + 1;
+  }
+
+  uint64_t flags_val = 0, pos_val = 0, mapq_val = 0, pnext_val = 0,
+    tlen_val = 0;
+  const bool neg_tlen = (*field[8] == '-');
+  if (!token_to_uint(field[1], field_end[1], 0xffff, flags_val) ||
+      !token_to_uint(field[3], field_end[3], 0xffffffff, pos_val) ||
+      !token_to_uint(field[4], field_end[4], 255, mapq_val) ||
+      !token_to_uint(field[7], field_end[7], 0xffffffff, pnext_val) ||
+      !token_to_uint(field[8] + neg_tlen, field_end[8],
+                     0x7fffffffull + neg_tlen, tlen_val))
+    throw_bad_sam_rec(line, len);
+
+  qname.assign(field[0], field_end[0]);
+  flags = static_cast<uint16_t>(flags_val);
+  rname.assign(field[2], field_end[2]);
+  pos = static_cast<uint32_t>(pos_val);
+  mapq = static_cast<uint8_t>(mapq_val);
+  cigar.assign(field[5], field_end[5]);
+  cigar_ops.clear();
+  cigar_packed = false;
+  rnext.assign(field[6], field_end[6]);
+  pnext = static_cast<uint32_t>(pnext_val);
+  tlen = static_cast<int32_t>(neg_tlen ? -static_cast<int64_t>(tlen_val) :
+                              static_cast<int64_t>(tlen_val));
+  seq.assign(field[9], field_end[9]);
+  qual.assign(field[10], field_end[10]);
+  rname_id = -1;
+  rnext_id = -1;
+
+  // the tag buffer is refilled, so its capacity is reused
+  if (p < lim) tags.assign(p, lim - p);
+  else tags.clear();
+}
+
+void
+sam_rec_view::set(const char *l, const size_t n) {
+  line = l;
+  len = n;
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    --len;
+  parsed = 0;
+  const char *const lim = line + len;
+  const char *p = line;
+  for (size_t i = 0; i < n_fields; ++i) {
+    if (p > lim) throw_bad_sam_rec(line, len);
+    field_start[i] = p - line;
+    const char *tab = static_cast<const char *>(std::memchr(p, '\t', lim - p));
+    p = (tab ? tab : lim) + 1;
+  }
+  field_start[n_fields] = p - line;
+}
+
+void
+sam_rec_view::parse_flags() const {
+  uint64_t x = 0;
+  if (!token_to_uint(field_begin(1), field_end(1), 0xffff, x))
+    throw_bad_sam_rec(line, len);
+  flags = static_cast<uint16_t>(x);
+  parsed |= flags_parsed;
+}
+
+void
+sam_rec_view::parse_pos() const {
+  uint64_t x = 0;
+  if (!token_to_uint(field_begin(3), field_end(3), 0xffffffff, x))
+    throw_bad_sam_rec(line, len);
+  pos = static_cast<uint32_t>(x);
+  parsed |= pos_parsed;
+}
+
+void
+sam_rec_view::parse_mapq() const {
+  uint64_t x = 0;
+  if (!token_to_uint(field_begin(4), field_end(4), 255, x))
+    throw_bad_sam_rec(line, len);
+  mapq = static_cast<uint8_t>(x);
+  parsed |= mapq_parsed;
+}
+
+/////////////////////////////////////////////
+//// optional tags
+/////////////////////////////////////////////
+
+void
+sam_tags::assign(const char *s, const size_t len) {
+  clear();
+  const char *const lim = s + len;
+  while (s < lim) {
+    const char *tab = static_cast<const char *>(std::memchr(s, '\t', lim - s));
+    const char *const tag_end = tab ? tab : lim;
+    if (tag_end != s) // skip empty fields
+      append_tag().append(s, tag_end);
+    s = tag_end + 1;
+  }
+}
+
+size_t
+sam_tags::find(const char *tag) const {
+  for (size_t i = 0; i < starts.size(); ++i)
+    if (text[starts[i]] == tag[0] && text[starts[i] + 1] == tag[1])
+      return i;
+  return starts.size();
+}
+
+// the value of a tag of the given type, or false if absent or another type
+static bool
+find_tag_value(const sam_tags &tags, const char *tag, const char type,
+               const char *&value, const char *&value_end) {
+  const size_t i = tags.find(tag);
+  if (i == tags.size()) return false;
+  const char *b = tags.tag_begin(i);
+  value_end = tags.tag_end(i);
+  if (value_end - b < 5 || b[2] != ':' || b[3] != type || b[4] != ':')
+    return false;
+  value = b + 5;
+  return true;
+}
+
+bool
+sam_tags::get_int(const char *tag, int64_t &x) const {
+  const char *v = nullptr, *v_end = nullptr;
+  if (!find_tag_value(*this, tag, 'i', v, v_end))
+    return false;
+  return smithlab::token_to_int(v, v_end, x);
+}
+
+bool
+sam_tags::get_float(const char *tag, double &x) const {
+  const char *v = nullptr, *v_end = nullptr;
+  if (!find_tag_value(*this, tag, 'f', v, v_end))
+    return false;
+  return smithlab::token_to_double(v, v_end, x);
+}
+
+bool
+sam_tags::get_string(const char *tag, string &x) const {
+  const char *v = nullptr, *v_end = nullptr;
+  if (!find_tag_value(*this, tag, 'Z', v, v_end) &&
+      !find_tag_value(*this, tag, 'A', v, v_end) &&
+      !find_tag_value(*this, tag, 'H', v, v_end))
+    return false;
+  x.assign(v, v_end);
+  return true;
+}
+
+void
+sam_tags::erase(const size_t i) {
+  // remove the tag and one adjacent tab, then shift later offsets
+  const size_t b = starts[i];
+  const size_t e = tag_end(i) - text.data();
+  const size_t erase_from = (i + 1 < starts.size() || i == 0) ? b : b - 1;
+  const size_t erase_to = (i + 1 < starts.size()) ? e + 1 : e;
+  text.erase(erase_from, erase_to - erase_from);
+  starts.erase(std::begin(starts) + i);
+  for (size_t j = i; j < starts.size(); ++j)
+    starts[j] -= erase_to - erase_from;
+}
+
+void
+sam_tags::set_value(const char *tag, const char type, const char *value,
+                    const size_t len) {
+  const size_t i = find(tag);
+  if (i == starts.size()) {
+    string &t = append_tag();
+    t.append(tag, 2);
+    t.push_back(':');
+    t.push_back(type);
+    t.push_back(':');
+    t.append(value, len);
+    return;
+  }
+  // rewrite the tag where it is, then shift the later offsets
+  const size_t b = starts[i];
+  const size_t old_len = tag_end(i) - tag_begin(i);
+  const size_t new_len = len + 5;
+  text.replace(b, old_len, new_len, ':');
+  text[b] = tag[0];
+  text[b + 1] = tag[1];
+  text[b + 3] = type;
+  std::copy(value, value + len, text.begin() + b + 5);
+  for (size_t j = i + 1; j < starts.size(); ++j)
+    starts[j] = starts[j] + new_len - old_len;
+}
+
+void
+sam_tags::set_int(const char *tag, const int64_t x) {
+  string buf;
+  smithlab::append_int(buf, x);
+  set_value(tag, 'i', buf.data(), buf.size());
+}
+
+void
+sam_tags::set_float(const char *tag, const double x) {
+  char buf[32];
+  const int n = snprintf(buf, sizeof(buf), "%g", x);
+  set_value(tag, 'f', buf, n);
+}
+
+void
+sam_tags::set_string(const char *tag, const string &x) {
+  set_value(tag, 'Z', x.data(), x.size());
+}
+
+std::vector<string>
+sam_tags::to_vector() const {
+  std::vector<string> v;
+  for (size_t i = 0; i < size(); ++i)
+    v.push_back(string(tag_begin(i), tag_end(i)));
+  return v;
+}
+
+void
+sam_rec::pack_cigar() {
+  if (!cigar_packed) {
+    ::pack_cigar(cigar, cigar_ops);
+    cigar.clear();
+    cigar_packed = true;
+  }
+}
+
+void
+sam_rec::unpack_cigar() {
+  if (cigar_packed) {
+    cigar.clear();
+    append_unpacked_cigar(cigar_ops, cigar);
+    cigar_ops.clear();
+    cigar_packed = false;
+  }
+}
 
-  string tmp;
-  while (iss >> tmp)
-    tags.push_back(tmp);
+istream &
+operator>>(istream &in, sam_rec &r) {
+  // header lines are skipped, so this can read a whole SAM file
+  string line;
+  while (getline(in, line))
+    if (!line.empty() && line[0] != '@') {
+      r.assign(line);
+      break;
+    }
+  return in;
 }
 
 void
 inflate_with_cigar(const sam_rec &sr, string &to_inflate,
                    const char inflation_symbol) {
-  apply_cigar(sr.cigar, to_inflate, inflation_symbol);
+  if (sr.has_packed_cigar())
+    apply_cigar(sr.cigar_ops, to_inflate, inflation_symbol);
+  else
+    apply_cigar(sr.cigar, to_inflate, inflation_symbol);
 }
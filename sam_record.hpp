@@ -20,7 +20,10 @@
 #define SAM_RECORD_HPP
 
 #include <string>
+#include <algorithm>
 #include <vector>
+#include <cstdint>
+#include <cstddef>
 #include <iostream>
 #include <sstream>
 #include <iterator>
@@ -79,6 +82,108 @@ format_sam_flags(const uint16_t the_flags);
 //10 SEQ segment SEQuence
 //11 QUAL Phred-scaled base QUALity+33
 
+/* sam_tag_view: the text of one optional field, e.g. "NM:i:0", inside
+ * the sam_tags it came from. It is valid until those tags change.
+ */
+class sam_tag_view {
+public:
+  sam_tag_view(const char *b, const char *e) : first(b), last(e) {}
+
+  const char *begin() const {return first;}
+  const char *end() const {return last;}
+  size_t size() const {return last - first;}
+  // the two letter name and the type letter, e.g. 'i'
+  std::string name() const {return std::string(first, first + 2);}
+  char type() const {return size() > 3 ? first[3] : '\0';}
+  std::string str() const {return std::string(first, last);}
+  bool operator==(const std::string &s) const {
+    return s.size() == size() && std::equal(first, last, s.data());
+  }
+  bool operator!=(const std::string &s) const {return !(*this == s);}
+
+private:
+  const char *first;
+  const char *last;
+};
+
+/* sam_tags: the optional fields of a SAM record, kept as their SAM
+ * text in one tab-separated buffer with the offset of each tag, so a
+ * record holds two allocations for its tags however many there are.
+ * Values are only parsed when asked for by the typed accessors; the
+ * tag names are two characters, e.g. "NM". Setting a tag that exists
+ * replaces its value in place, otherwise the tag is appended.
+ */
+class sam_tags {
+public:
+  // visits the tags in order as sam_tag_view
+  class const_iterator {
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef sam_tag_view value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const sam_tag_view *pointer;
+    typedef sam_tag_view reference;
+
+    const_iterator(const sam_tags &t, const size_t i) : tags(&t), idx(i) {}
+    sam_tag_view operator*() const {return (*tags)[idx];}
+    const_iterator &operator++() {++idx; return *this;}
+    const_iterator operator++(int) {const_iterator t(*this); ++idx; return t;}
+    bool operator==(const const_iterator &rhs) const {return idx == rhs.idx;}
+    bool operator!=(const const_iterator &rhs) const {return idx != rhs.idx;}
+
+  private:
+    const sam_tags *tags;
+    size_t idx;
+  };
+
+  size_t size() const {return starts.size();}
+  bool empty() const {return starts.empty();}
+  void clear() {text.clear(); starts.clear();}
+
+  // the i-th tag, read only; change tags with the setters
+  sam_tag_view operator[](const size_t i) const {
+    return sam_tag_view(tag_begin(i), tag_end(i));
+  }
+  const_iterator begin() const {return const_iterator(*this, 0);}
+  const_iterator end() const {return const_iterator(*this, size());}
+  const char *tag_begin(const size_t i) const {return text.data() + starts[i];}
+  const char *tag_end(const size_t i) const {
+    return (i + 1 < starts.size()) ?
+      text.data() + starts[i + 1] - 1 : text.data() + text.size();
+  }
+  // all tags, tab-separated, as they appear in SAM
+  const std::string &get_text() const {return text;}
+  // a copy of each tag as a string, as sam_rec::tags was before
+  std::vector<std::string> to_vector() const;
+
+  // replace all tags with the tab-separated tags in s
+  void assign(const char *s, const size_t len);
+  void push_back(const std::string &tag) {append_tag().append(tag);}
+  // start a new tag and return the buffer to append its text to
+  std::string &append_tag() {
+    if (!starts.empty()) text.push_back('\t');
+    starts.push_back(text.size());
+    return text;
+  }
+
+  // the index of the tag, or size() if absent
+  size_t find(const char *tag) const;
+  bool get_int(const char *tag, int64_t &x) const;
+  bool get_float(const char *tag, double &x) const;
+  bool get_string(const char *tag, std::string &x) const;
+  void set_int(const char *tag, const int64_t x);
+  void set_float(const char *tag, const double x);
+  void set_string(const char *tag, const std::string &x);
+  void erase(const size_t i);
+
+private:
+  void set_value(const char *tag, const char type, const char *value,
+                 const size_t len);
+
+  std::string text;
+  std::vector<uint32_t> starts;
+};
+
 class sam_rec {
 public:
   // ADS: instance vars *are* in SAM order
@@ -88,13 +193,23 @@ public:
   uint32_t pos;
   uint8_t mapq;
   std::string cigar;
+  // Used instead of cigar when cigar_packed is set, and cigar is then
+  // empty; a packed "*" has no ops. Call unpack_cigar() before editing
+  // cigar as text.
+  std::vector<uint32_t> cigar_ops;
+  bool cigar_packed;
   std::string rnext;
   uint32_t pnext;
   int32_t tlen;
   std::string seq;
   std::string qual;
-  std::vector<std::string> tags;
-  sam_rec() : flags(0), pos(0), mapq(255), pnext(0), tlen(0) {}
+  sam_tags tags;
+  // ids of rname and rnext in the header of the file read, as in BAM;
+  // -1 if unplaced or unknown, as for records parsed from bare text
+  int32_t rname_id;
+  int32_t rnext_id;
+  sam_rec() : flags(0), pos(0), mapq(255), cigar_packed(false), pnext(0),
+              tlen(0), rname_id(-1), rnext_id(-1) {}
   explicit sam_rec(const std::string &line);
   sam_rec(const std::string &_qname,
           const uint16_t _flags,
@@ -113,13 +228,46 @@ public:
     pos(_pos),
     mapq(_mapq),
     cigar(_cigar),
+    cigar_packed(false),
     rnext(_rnext),
     pnext(_pnext),
     tlen(_tlen),
     seq(_seq),
-    qual(_qual) {}
+    qual(_qual),
+    rname_id(-1),
+    rnext_id(-1) {}
+  // Refill from one line of SAM text (tab-separated, no newline
+  // needed). The strings and tags already held are overwritten in
+  // place, so reusing one sam_rec for many lines avoids allocation.
+  // The reference ids are reset to -1; readers with a header set them.
+  void assign(const char *line, const size_t len);
+  void assign(const std::string &line) {assign(line.data(), line.size());}
+  // convert between the text and packed cigar; the packed form is
+  // turned back into text only when the record is written
+  void pack_cigar();
+  void unpack_cigar();
+  bool has_packed_cigar() const {return cigar_packed;}
   void add_tag(const std::string &the_tag) {tags.push_back(the_tag);}
+  bool get_int_tag(const char *tag, int64_t &x) const {
+    return tags.get_int(tag, x);
+  }
+  bool get_float_tag(const char *tag, double &x) const {
+    return tags.get_float(tag, x);
+  }
+  bool get_string_tag(const char *tag, std::string &x) const {
+    return tags.get_string(tag, x);
+  }
+  void set_int_tag(const char *tag, const int64_t x) {tags.set_int(tag, x);}
+  void set_float_tag(const char *tag, const double x) {
+    tags.set_float(tag, x);
+  }
+  void set_string_tag(const char *tag, const std::string &x) {
+    tags.set_string(tag, x);
+  }
   size_t estimate_line_size() const;
+  // appends the SAM line, without a newline, to out; reusing out for
+  // many records avoids any allocation once it is large enough
+  void append_to(std::string &out) const;
   std::string tostring() const;
 };
 
@@ -138,6 +286,97 @@ unset_flag(sam_rec &sr, const uint16_t f) {
   return samflags::unset(sr.flags, f);
 }
 
+/* sam_rec_view: one SAM line held as offsets into a buffer owned by
+ * the caller, which must outlive the view and not change under it.
+ * Only the tabs are located when the view is set; flags, pos and
+ * mapq are parsed the first time they are asked for, and the other
+ * fields are copied only on request. Records that survive filtering
+ * can be converted to a full sam_rec.
+ */
+class sam_rec_view {
+public:
+  sam_rec_view() : line(nullptr), len(0), parsed(0),
+                   flags(0), pos(0), mapq(255) {}
+  sam_rec_view(const char *line, const size_t len) {set(line, len);}
+  explicit sam_rec_view(const std::string &line) {set(line);}
+
+  void set(const char *line, const size_t len);
+  void set(const std::string &line) {set(line.data(), line.size());}
+
+  // mandatory fields by 0-based column, without copying
+  const char *field_begin(const size_t i) const {return line + field_start[i];}
+  const char *field_end(const size_t i) const {
+    return line + field_start[i + 1] - 1;
+  }
+  size_t field_size(const size_t i) const {
+    return field_start[i + 1] - 1 - field_start[i];
+  }
+  std::string field(const size_t i) const {
+    return std::string(field_begin(i), field_end(i));
+  }
+  bool field_equals(const size_t i, const std::string &s) const {
+    return s.size() == field_size(i) &&
+      std::equal(begin(s), end(s), field_begin(i));
+  }
+
+  uint16_t get_flags() const {
+    if (!(parsed & flags_parsed)) parse_flags();
+    return flags;
+  }
+  uint32_t get_pos() const {
+    if (!(parsed & pos_parsed)) parse_pos();
+    return pos;
+  }
+  uint8_t get_mapq() const {
+    if (!(parsed & mapq_parsed)) parse_mapq();
+    return mapq;
+  }
+  std::string get_qname() const {return field(0);}
+  std::string get_rname() const {return field(2);}
+  std::string get_cigar() const {return field(5);}
+  std::string get_seq() const {return field(9);}
+  std::string get_qual() const {return field(10);}
+
+  // the optional tags, still tab-separated
+  const char *tags_begin() const {
+    return line + std::min(field_start[n_fields], len);
+  }
+  const char *tags_end() const {return line + len;}
+
+  void to_sam_rec(sam_rec &sr) const {sr.assign(line, len);}
+  sam_rec to_sam_rec() const {
+    sam_rec sr;
+    to_sam_rec(sr);
+    return sr;
+  }
+
+private:
+  static const size_t n_fields = 11;
+  static const uint8_t flags_parsed = 1;
+  static const uint8_t pos_parsed = 2;
+  static const uint8_t mapq_parsed = 4;
+
+  void parse_flags() const;
+  void parse_pos() const;
+  void parse_mapq() const;
+
+  const char *line;
+  size_t len;
+  // start of each field; the last entry is one past the tab ending
+  // the qual field, or len + 1 if there are no tags
+  size_t field_start[n_fields + 1];
+
+  mutable uint8_t parsed;
+  mutable uint16_t flags;
+  mutable uint32_t pos;
+  mutable uint8_t mapq;
+};
+
+inline bool
+check_flag(const sam_rec_view &sv, const uint16_t f) {
+  return samflags::check(sv.get_flags(), f);
+}
+
 std::istream &
 operator>>(std::istream &in, sam_rec &r);
 
@@ -0,0 +1,428 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "sam_text_io.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <limits>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+using std::runtime_error;
+
+SAMTextWriter::SAMTextWriter(const string &fn, const size_t bs) :
+  filename(fn), good(true), buffer_size(bs), out(nullptr) {
+  if (filename == "-")
+    out = &std::cout;
+  else if (has_gz_ext(filename)) {
+    gz.reset(new ogzfstream(filename));
+    if (!*gz)
+      throw runtime_error("cannot open output file: " + filename);
+  }
+  else {
+    file.open(filename.c_str(), std::ios::binary);
+    if (!file)
+      throw runtime_error("cannot open output file: " + filename);
+    out = &file;
+  }
+  // flushing happens after the limit is passed, so leave room
+  buf.reserve(buffer_size + 4096);
+}
+
+SAMTextWriter::~SAMTextWriter() {
+  try {
+    close();
+  }
+  catch (...) {} // call close() to see errors
+}
+
+void
+SAMTextWriter::write_buffer() {
+  if (buf.empty()) return;
+  if (gz) {
+    if (gzwrite(gz->fileobj, buf.data(), buf.size()) !=
+        static_cast<int>(buf.size()))
+      good = false;
+  }
+  else if (!out)
+    throw runtime_error("write after close: " + filename);
+  else if (!out->write(buf.data(), buf.size()))
+    good = false;
+  buf.clear();
+  if (!good)
+    throw runtime_error("failed writing to file: " + filename);
+}
+
+void
+SAMTextWriter::flush() {
+  write_buffer();
+  // a gzip stream is not flushed, as that would hurt compression
+  if (out && !out->flush()) {
+    good = false;
+    throw runtime_error("failed writing to file: " + filename);
+  }
+}
+
+void
+SAMTextWriter::close() {
+  if (!gz && !out) return;
+  // the file is closed even if the last write fails
+  bool ok = true;
+  try {
+    write_buffer();
+  }
+  catch (const runtime_error &) {
+    ok = false;
+    buf.clear();
+  }
+  if (gz) {
+    ok = (gzclose_w(gz->fileobj) == Z_OK) && ok;
+    gz->fileobj = NULL; // so ~ogzfstream does not close it again
+    gz.reset();
+  }
+  else if (file.is_open()) {
+    file.close();
+    ok = !file.fail() && ok;
+  }
+  else ok = static_cast<bool>(out->flush()) && ok;
+  out = nullptr;
+  if (!ok) {
+    good = false;
+    throw runtime_error("failed writing to file: " + filename);
+  }
+}
+
+void
+SAMTextWriter::write_header(const string &header_text) {
+  buf.append(header_text);
+  if (!header_text.empty() && header_text.back() != '\n')
+    buf.push_back('\n');
+  flush_if_full();
+}
+
+void
+SAMTextWriter::write_header(const sam_header &hdr) {
+  hdr.append_to(buf);
+  flush_if_full();
+}
+
+void
+SAMTextWriter::write(const sam_rec &sr) {
+  sr.append_to(buf);
+  buf.push_back('\n');
+  flush_if_full();
+}
+
+void
+SAMTextWriter::write(const vector<sam_rec> &batch) {
+  for (auto &sr : batch)
+    write(sr);
+}
+
+SAMTextWriter &
+operator<<(SAMTextWriter &writer, const sam_rec &sr) {
+  writer.write(sr);
+  return writer;
+}
+
+/////////////////////////////////////////////
+//// reading SAM text
+/////////////////////////////////////////////
+
+// the work queues never hold more than one entry per thread, and must
+// not block, or workers and the caller could wait on each other
+static const size_t no_limit = std::numeric_limits<size_t>::max();
+
+SAMTextReader::SAMTextReader(const string &fn, const size_t bs) :
+  filename(fn), good(true), block_size(std::max(bs, static_cast<size_t>(1))),
+  fd(-1), map_data(nullptr), map_size(0), gz(nullptr), at_eof(false),
+  cur(nullptr), lim(nullptr), todo(no_limit), done(no_limit), timing(false) {
+
+  struct stat st;
+  const bool mappable = filename != "-" && !has_gz_ext(filename) &&
+    stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+
+  if (mappable) {
+    if ((fd = open(filename.c_str(), O_RDONLY)) < 0)
+      throw runtime_error("cannot open input file: " + filename);
+    map_size = st.st_size;
+    void *m = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+      close(fd);
+      throw runtime_error("cannot map input file: " + filename);
+    }
+    madvise(m, map_size, MADV_SEQUENTIAL);
+    map_data = static_cast<char *>(m);
+    cur = map_data;
+    lim = map_data + map_size;
+    at_eof = true;
+  }
+  else {
+    // stdin, gzipped or empty files, and pipes are streamed; stdin is
+    // duplicated so closing the reader leaves fd 0 open
+    if (filename == "-") {
+      const int in_fd = dup(fileno(stdin));
+      if (in_fd < 0 || !(gz = gzdopen(in_fd, "rb"))) {
+        if (in_fd >= 0) close(in_fd);
+        throw runtime_error("cannot open input file: " + filename);
+      }
+    }
+    else if (!(gz = gzopen(filename.c_str(), "rb")))
+      throw runtime_error("cannot open input file: " + filename);
+    gzbuffer(gz, 128*1024);
+  }
+  read_header();
+}
+
+SAMTextReader::~SAMTextReader() {
+  todo.close();
+  for (auto &w : workers)
+    w.join();
+  if (map_data) munmap(map_data, map_size);
+  if (fd >= 0) close(fd);
+  if (gz) gzclose(gz);
+}
+
+void
+SAMTextReader::refill(const size_t min_bytes) {
+  scoped_stats_timer t(timing, stats.read_time);
+  // keep the unread text, moved to the front of the buffer
+  if (cur)
+    stream_buf.erase(0, cur - stream_buf.data());
+  while (stream_buf.size() < min_bytes && !at_eof) {
+    const size_t old_size = stream_buf.size();
+    stream_buf.resize(old_size + block_size);
+    const int n_read = gzread(gz, &stream_buf[old_size], block_size);
+    if (n_read < 0)
+      throw runtime_error("failed reading input file: " + filename);
+    stream_buf.resize(old_size + n_read);
+    at_eof = (n_read == 0);
+  }
+  cur = stream_buf.data();
+  lim = cur + stream_buf.size();
+}
+
+bool
+SAMTextReader::next_line(const char *&line, const char *&line_end,
+                         const bool may_refill) {
+  for (;;) {
+    const char *nl = (cur < lim) ?
+      static_cast<const char *>(std::memchr(cur, '\n', lim - cur)) : nullptr;
+    if (nl) {
+      line = cur;
+      line_end = nl;
+      cur = nl + 1;
+      return true;
+    }
+    if (!at_eof) {
+      if (!may_refill) return false;
+      refill((lim - cur) + block_size);
+      continue;
+    }
+    if (cur < lim) { // no newline at the end
+      line = cur;
+      line_end = lim;
+      cur = lim;
+      return true;
+    }
+    return (good = false);
+  }
+}
+
+void
+SAMTextReader::read_header() {
+  const char *line = nullptr, *line_end = nullptr;
+  for (;;) {
+    if (cur == lim && !at_eof)
+      refill(block_size);
+    if (cur == lim || *cur != '@')
+      break;
+    next_line(line, line_end, true);
+    header_text.append(line, line_end);
+    header_text.push_back('\n');
+  }
+  header.parse(header_text);
+}
+
+// the ids of rname and rnext in the header, as a BAM reader gives them
+static inline void
+set_ref_ids(const sam_header &header, sam_rec &sr) {
+  sr.rname_id = (sr.rname == "*") ? -1 : header.ref_id(sr.rname);
+  if (sr.rnext == "=") sr.rnext_id = sr.rname_id;
+  else sr.rnext_id = (sr.rnext == "*") ? -1 : header.ref_id(sr.rnext);
+}
+
+bool
+SAMTextReader::get_sam_record(sam_rec &sr) {
+  const char *line = nullptr, *line_end = nullptr;
+  while (next_line(line, line_end, true))
+    if (line_end != line) {
+      scoped_stats_timer t(reader_stats::sample(timing, stats.n_records),
+                           stats.parse_time, reader_stats::timing_interval);
+      sr.assign(line, line_end - line);
+      set_ref_ids(header, sr);
+      ++stats.n_records;
+      stats.n_bytes += line_end - line + 1;
+      return true;
+    }
+  return false;
+}
+
+size_t
+SAMTextReader::get_sam_records(vector<sam_rec> &batch, const size_t n) {
+  if (batch.size() < n)
+    batch.resize(n);
+  size_t n_read = 0;
+  while (n_read < n && get_sam_record(batch[n_read]))
+    ++n_read;
+  return n_read;
+}
+
+size_t
+SAMTextReader::get_sam_views(vector<sam_rec_view> &views, const size_t n) {
+  views.clear();
+  const char *line = nullptr, *line_end = nullptr;
+  // refilling moves the buffer, so only before the first view
+  while (views.size() < n && next_line(line, line_end, views.empty()))
+    if (line_end != line) {
+      views.push_back(sam_rec_view(line, line_end - line));
+      stats.n_bytes += line_end - line + 1;
+    }
+  stats.n_records += views.size();
+  if (!views.empty())
+    good = true; // a short batch is not the end
+  return views.size();
+}
+
+static void
+parse_chunk(const sam_header &header, const char *p, const char *const end,
+            vector<sam_rec> &part, size_t &n_parsed) {
+  n_parsed = 0;
+  while (p < end) {
+    const char *nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    const char *line_end = nl ? nl : end;
+    if (line_end != p) {
+      if (n_parsed == part.size())
+        part.push_back(sam_rec());
+      part[n_parsed].assign(p, line_end - p);
+      set_ref_ids(header, part[n_parsed++]);
+    }
+    p = line_end + 1;
+  }
+}
+
+void
+SAMTextReader::parse_part(const size_t i) {
+  try {
+    scoped_stats_timer t(timing, parse_times[i]);
+    parse_chunk(header, bounds[i], bounds[i + 1], parts[i], n_parsed[i]);
+  }
+  catch (...) {
+    errors[i] = std::current_exception();
+  }
+}
+
+void
+SAMTextReader::start_workers(const size_t n) {
+  while (workers.size() < n)
+    workers.push_back(std::thread([this] {
+      size_t i = 0;
+      while (todo.pop(i)) {
+        parse_part(i);
+        done.push(i);
+      }
+    }));
+}
+
+size_t
+SAMTextReader::get_sam_records_parallel(vector<sam_rec> &batch,
+                                        const size_t n_threads,
+                                        const size_t max_bytes) {
+  // find a block of whole lines of about max_bytes
+  const char *end = nullptr;
+  while (!end) {
+    if (!at_eof && static_cast<size_t>(lim - cur) < max_bytes)
+      refill(max_bytes);
+    const char *target = cur + std::min(max_bytes, static_cast<size_t>(lim - cur));
+    const char *nl = (target < lim) ?
+      static_cast<const char *>(std::memchr(target, '\n', lim - target)) :
+      nullptr;
+    if (nl) end = nl + 1;
+    else if (at_eof) end = lim;
+    else refill((lim - cur) + block_size); // a line longer than the block
+  }
+  if (cur == end) {
+    good = false;
+    return 0;
+  }
+
+  // split the block into chunks that start just after a newline
+  const size_t n_chunks = std::max(n_threads, static_cast<size_t>(1));
+  bounds.assign(n_chunks + 1, end);
+  bounds[0] = cur;
+  const size_t chunk_size = (end - cur)/n_chunks;
+  for (size_t i = 1; i < n_chunks; ++i) {
+    const char *b = std::max(bounds[i - 1], cur + i*chunk_size);
+    const char *nl = (b < end) ?
+      static_cast<const char *>(std::memchr(b, '\n', end - b)) : nullptr;
+    bounds[i] = nl ? nl + 1 : end;
+  }
+
+  parts.resize(std::max(parts.size(), n_chunks));
+  n_parsed.assign(n_chunks, 0);
+  parse_times.assign(n_chunks, 0.0);
+  errors.assign(n_chunks, std::exception_ptr());
+  start_workers(n_chunks - 1);
+  for (size_t i = 1; i < n_chunks; ++i)
+    todo.push(i);
+  parse_part(0);
+  size_t part = 0;
+  for (size_t n_done = 1; n_done < n_chunks; ++n_done)
+    done.pop(part);
+  for (auto &e : errors)
+    if (e) std::rethrow_exception(e);
+  for (auto x : parse_times)
+    stats.parse_time += x;
+
+  stats.n_bytes += end - cur;
+  cur = end;
+
+  // swapping recycles the strings of the old batch into parts
+  size_t total = 0;
+  for (auto n : n_parsed)
+    total += n;
+  if (batch.size() < total)
+    batch.resize(total);
+  size_t k = 0;
+  for (size_t i = 0; i < n_chunks; ++i)
+    for (size_t j = 0; j < n_parsed[i]; ++j)
+      std::swap(batch[k++], parts[i][j]);
+  stats.n_records += total;
+  return total;
+}
@@ -0,0 +1,161 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef SAM_TEXT_IO_HPP
+#define SAM_TEXT_IO_HPP
+
+/* SAM text input and output that do not need htslib */
+
+#include "sam_record.hpp"
+#include "sam_header.hpp"
+#include "zlib_wrapper.hpp"
+#include "reader_stats.hpp"
+#include "thread_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <exception>
+
+/* SAMTextWriter: formats records into one buffer and writes it out in
+ * large blocks. The output is stdout for "-", gzip compressed through
+ * ogzfstream for names ending in ".gz", and a plain file otherwise.
+ * The buffer is written out when full and by flush(), which also
+ * flushes a plain file or stdout. Call close() to finish the file and
+ * see any error; the destructor closes it too, but ignores errors.
+ */
+class SAMTextWriter {
+public:
+  explicit SAMTextWriter(const std::string &filename,
+                         const size_t buffer_size = 1 << 20);
+  ~SAMTextWriter();
+
+  operator bool() const {return good;}
+
+  void write_header(const std::string &header_text);
+  void write_header(const sam_header &hdr);
+  void write(const sam_rec &sr);
+  void write(const std::vector<sam_rec> &batch);
+  void flush();
+  void close();
+
+private:
+  void write_buffer();
+  void flush_if_full() {if (buf.size() >= buffer_size) write_buffer();}
+
+  std::string filename;
+  bool good;
+  size_t buffer_size;
+  std::string buf;
+
+  std::ofstream file;
+  std::unique_ptr<ogzfstream> gz;
+  std::ostream *out;
+};
+
+SAMTextWriter &
+operator<<(SAMTextWriter &writer, const sam_rec &sr);
+
+/* SAMTextReader: reads SAM text without htslib. A regular file is
+ * memory-mapped; names ending in ".gz", and "-" for stdin or other
+ * non-regular files, are read in large blocks through zlib. The
+ * header is read when the file is opened. Records can be taken one
+ * at a time, in batches, as views, or parsed in parallel by splitting
+ * a large block of text into newline-aligned chunks, one per thread.
+ * The threads for parallel parsing are started by the first call that
+ * needs them and kept until the reader is destroyed.
+ */
+class SAMTextReader {
+public:
+  explicit SAMTextReader(const std::string &filename,
+                         const size_t block_size = 1 << 22);
+  ~SAMTextReader();
+
+  operator bool() const {return good;}
+
+  const std::string &get_header_text() const {return header_text;}
+  const sam_header &get_header() const {return header;}
+
+  bool get_sam_record(sam_rec &sr);
+
+  // As for SAMReader: up to n records from the start of batch, which
+  // is never shrunk; returns the number read
+  size_t get_sam_records(std::vector<sam_rec> &batch, const size_t n);
+
+  // Views into the reader's buffer, valid until the next call that
+  // reads from this reader. When reading through zlib a batch may be
+  // cut short at the end of a block; zero is returned only at the end.
+  size_t get_sam_views(std::vector<sam_rec_view> &views, const size_t n);
+
+  // Parses about max_bytes of text on n_threads threads into batch, in
+  // file order, and returns the number of records, zero at the end; as
+  // for get_sam_records, the batch is never shrunk.
+  size_t get_sam_records_parallel(std::vector<sam_rec> &batch,
+                                  const size_t n_threads,
+                                  const size_t max_bytes = 1 << 24);
+
+  // see reader_stats; views are counted but take no parsing time
+  void set_timing(const bool t) {timing = t;}
+  const reader_stats &get_stats() const {return stats;}
+  void clear_stats() {stats.clear();}
+
+private:
+  bool next_line(const char *&line, const char *&line_end,
+                 const bool may_refill);
+  void refill(const size_t min_bytes);
+  void read_header();
+  void parse_part(const size_t i);
+  void start_workers(const size_t n);
+
+  std::string filename;
+  bool good;
+  size_t block_size;
+
+  // the mapped file, or text read through zlib
+  int fd;
+  char *map_data;
+  size_t map_size;
+  gzFile gz;
+  bool at_eof; // no more text beyond lim
+  std::string stream_buf;
+  const char *cur;
+  const char *lim;
+
+  std::string header_text;
+  sam_header header;
+
+  // records parsed by each thread, recycled between calls
+  std::vector<std::vector<sam_rec> > parts;
+  // for each part: where its text starts, and how parsing it went
+  std::vector<const char *> bounds;
+  std::vector<size_t> n_parsed;
+  std::vector<double> parse_times;
+  std::vector<std::exception_ptr> errors;
+
+  // workers take the index of a part from todo and put it in done
+  std::vector<std::thread> workers;
+  BoundedQueue<size_t> todo;
+  BoundedQueue<size_t> done;
+
+  bool timing;
+  reader_stats stats;
+};
+
+#endif
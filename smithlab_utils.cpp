@@ -22,6 +22,8 @@
 
 #include "smithlab_utils.hpp"
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include <string>
 #include <cmath>
 
@@ -140,6 +142,36 @@ smithlab::strip(const std::string& s) {
   else return s.substr(i, j - i);
 }
 
+bool
+smithlab::token_to_double(const char *s, const char *lim, double &x) {
+  static const size_t max_chars = 63;
+  char buf[max_chars + 1];
+  const size_t len = lim - s;
+  if (len == 0 || len > max_chars) return false;
+  std::copy(s, lim, buf);
+  buf[len] = '\0';
+  char *buf_end = nullptr;
+  x = std::strtod(buf, &buf_end);
+  return buf_end == buf + len;
+}
+
+bool
+smithlab::token_to_int(const char *s, const char *lim, int64_t &x) {
+  const bool neg = (s != lim && *s == '-');
+  if (neg || (s != lim && *s == '+')) ++s;
+  if (s == lim) return false;
+  const uint64_t max_val = neg ? 0x8000000000000000ull : 0x7fffffffffffffffull;
+  uint64_t u = 0;
+  for (; s != lim; ++s) {
+    if (*s < '0' || *s > '9') return false;
+    const uint64_t d = *s - '0';
+    if (u > (max_val - d)/10) return false;
+    u = u*10 + d;
+  }
+  x = neg ? static_cast<int64_t>(0 - u) : static_cast<int64_t>(u);
+  return true;
+}
+
 void
 smithlab::split_whitespace(const string &s, vector<string> &v) {
   v.clear();
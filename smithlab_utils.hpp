@@ -36,6 +36,7 @@
 #include <cmath>
 #include <numeric>
 #include <iomanip>
+#include <cstdint>
 
 extern "C" {char have_smithlab_cpp();}
 
@@ -70,6 +71,31 @@ namespace smithlab {
 
   std::string strip(const std::string& s);
 
+  // Parse [s, lim) as a floating point number. The token is copied to
+  // the stack first, so strtod cannot read past it; false if it is
+  // empty, too long, or not entirely a number.
+  bool token_to_double(const char *s, const char *lim, double &x);
+  // Parse [s, lim) as a decimal integer with an optional sign; false
+  // if it is empty, has other characters, or does not fit.
+  bool token_to_int(const char *s, const char *lim, int64_t &x);
+
+  // Append the decimal form of x to out, with no temporary string
+  inline void
+  append_uint(std::string &out, uint64_t x) {
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    do {*--p = '0' + (x % 10); x /= 10;} while (x);
+    out.append(p, buf + sizeof(buf));
+  }
+  inline void
+  append_int(std::string &out, const int64_t x) {
+    if (x < 0) {
+      out.push_back('-');
+      append_uint(out, 0 - static_cast<uint64_t>(x));
+    }
+    else append_uint(out, x);
+  }
+
   std::vector<std::string>
   squash(const std::vector<std::string> &v);
 
@@ -0,0 +1,207 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Checks how StreamingDeduplicator groups sorted reads: which read of
+ * a group is kept, what separates groups for single and paired keys,
+ * that unmapped, secondary and supplementary records pass through,
+ * that output stays sorted, and that unsorted input is rejected.
+ */
+
+#include "dedup_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static sam_rec
+make_sam(const string &qname, const int flags, const string &rname,
+         const int pos, const string &cigar, const int nm,
+         const string &rnext = "*", const int pnext = 0) {
+  return sam_rec(qname + "\t" + std::to_string(flags) + "\t" + rname + "\t" +
+                 std::to_string(pos) + "\t60\t" + cigar + "\t" + rnext +
+                 "\t" + std::to_string(pnext) + "\t0\t*\t*\tNM:i:" +
+                 std::to_string(nm));
+}
+
+template <class T>
+struct collect {
+  vector<T> out;
+  void operator()(const T &r) {out.push_back(r);}
+};
+
+static string
+names(const vector<sam_rec> &v) {
+  string s;
+  for (auto &sr : v)
+    s += (s.empty() ? "" : ",") + sr.qname;
+  return s;
+}
+
+static void
+test_single() {
+  StreamingDeduplicator<sam_rec> dedup;
+  collect<sam_rec> out;
+  vector<sam_rec> in = {
+    make_sam("a1", 0, "chr1", 100, "50M", 3),
+    make_sam("a2", 0, "chr1", 100, "50M", 1),  // fewer mismatches: kept
+    make_sam("a3", 0, "chr1", 100, "50M", 1),  // a tie keeps a2
+    make_sam("b1", 16, "chr1", 100, "50M", 0), // other strand
+    make_sam("c1", 0, "chr1", 100, "40M", 0),  // other end
+    make_sam("a4", 0, "chr1", 100, "50M", 0),  // best of the a group
+    make_sam("d1", 0, "chr1", 200, "50M", 2),
+    make_sam("e1", 0, "chr2", 100, "50M", 2),
+  };
+  for (auto &sr : in)
+    dedup.add(sr, out);
+  dedup.flush(out);
+  check(names(out.out) == "a4,b1,c1,d1,e1", "single: kept " +
+        names(out.out));
+  check(dedup.get_n_in() == in.size() && dedup.get_n_out() == 5,
+        "single: counts");
+}
+
+static void
+test_paired() {
+  StreamingDeduplicator<sam_rec> dedup(true);
+  collect<sam_rec> out;
+  vector<sam_rec> in = {
+    make_sam("p1", 99, "chr1", 100, "50M", 1, "=", 300),
+    make_sam("p2", 99, "chr1", 100, "50M", 0, "=", 300),  // same fragment
+    make_sam("p3", 99, "chr1", 100, "50M", 0, "=", 310),  // other mate
+    make_sam("p4", 163, "chr1", 100, "50M", 0, "=", 300), // other segment
+    make_sam("p5", 99, "chr1", 100, "50M", 0, "chr2", 300),
+  };
+  for (auto &sr : in)
+    dedup.add(sr, out);
+  dedup.flush(out);
+  check(names(out.out) == "p2,p3,p4,p5", "paired: kept " + names(out.out));
+}
+
+static void
+test_pass_through() {
+  StreamingDeduplicator<sam_rec> dedup;
+  collect<sam_rec> out;
+  vector<sam_rec> in = {
+    make_sam("a1", 0, "chr1", 100, "50M", 2),
+    make_sam("s1", 2048, "chr1", 100, "50M", 0), // supplementary
+    make_sam("x1", 256, "chr1", 100, "50M", 0),  // secondary
+    make_sam("a2", 0, "chr1", 100, "50M", 1),
+    make_sam("b1", 0, "chr1", 150, "50M", 1),
+    make_sam("u1", 4, "*", 0, "*", 0),
+    make_sam("u2", 4, "*", 0, "*", 0),
+    make_sam("u3", 4, "*", 0, "*", 0),
+  };
+  for (auto &sr : in)
+    dedup.add(sr, out);
+  dedup.flush(out);
+  // the a group is still open when s1 and x1 arrive at its position
+  check(names(out.out) == "s1,x1,a2,b1,u1,u2,u3", "pass through: kept " +
+        names(out.out));
+  check(dedup.get_n_out() == 7, "pass through: counts");
+}
+
+static void
+test_mapped_read() {
+  StreamingDeduplicator<MappedRead, higher_quality_sum> dedup;
+  collect<MappedRead> out;
+  vector<MappedRead> in = {
+    MappedRead("chr1\t10\t14\tr1\t0\t+\tACGT\t####"),
+    MappedRead("chr1\t10\t14\tr2\t0\t+\tACGT\tIIII"),
+    MappedRead("chr1\t10\t14\tr3\t0\t-\tACGT\t####"),
+    MappedRead("chr1\t12\t16\tr4\t0\t+\tACGT\t####"),
+  };
+  for (auto &mr : in)
+    dedup.add(mr, out);
+  dedup.flush(out);
+  string kept;
+  for (auto &mr : out.out)
+    kept += mr.r.get_name();
+  check(kept == "r2r3r4", "MappedRead: kept " + kept);
+
+  // a key reused from a paired sam_rec has no mate fields left
+  dedup_key k;
+  get_dedup_key(make_sam("p", 99, "chr1", 100, "50M", 0, "=", 300), true, k);
+  get_dedup_key(in[0], true, k);
+  check(k.mate_chrom.empty() && k.mate_start == 0 && k.segment == 0,
+        "MappedRead: mate fields cleared");
+}
+
+static bool
+throws_unsorted(const vector<sam_rec> &in) {
+  StreamingDeduplicator<sam_rec> dedup;
+  collect<sam_rec> out;
+  try {
+    for (auto &sr : in)
+      dedup.add(sr, out);
+  }
+  catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+static void
+test_unsorted() {
+  check(throws_unsorted({make_sam("a", 0, "chr1", 200, "50M", 0),
+                         make_sam("b", 0, "chr1", 100, "50M", 0)}),
+        "unsorted: position");
+  check(throws_unsorted({make_sam("a", 0, "chr1", 200, "50M", 0),
+                         make_sam("b", 0, "chr2", 100, "50M", 0),
+                         make_sam("c", 0, "chr1", 300, "50M", 0)}),
+        "unsorted: chrom");
+  check(!throws_unsorted({make_sam("u", 4, "*", 0, "*", 0),
+                          make_sam("a", 0, "chr1", 200, "50M", 0)}),
+        "unsorted: unmapped first read");
+}
+
+int
+main() {
+  try {
+    test_single();
+    test_paired();
+    test_pass_through();
+    test_mapped_read();
+    test_unsorted();
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
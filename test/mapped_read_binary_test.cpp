@@ -0,0 +1,218 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Writes sorted reads to the binary container over several blocks and
+ * checks that they read back unchanged, that seeking by block and by
+ * position lands on the right reads, and that damaged files are
+ * rejected with an exception.
+ */
+
+#include "MappedReadBinary.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static vector<MappedRead>
+make_reads() {
+  static const char *chroms[] = {"chr1", "chr2", "chrM"};
+  static const char bases[] = "ACGTN";
+  vector<MappedRead> reads;
+  for (size_t c = 0; c < 3; ++c)
+    for (size_t i = 0; i < 350; ++i) {
+      const size_t start = 10*i + (i % 3);
+      const size_t len = 20 + i % 7;
+      string seq, scr;
+      for (size_t j = 0; j < len; ++j) {
+        seq.push_back(bases[(i + j) % 5]);
+        scr.push_back(static_cast<char>('!' + (i + j) % 42));
+      }
+      // a few reads have an end other than start + length
+      const size_t end = start + len + (i % 50 == 0 ? 5 : 0);
+      const string score = (i % 4 == 0) ? "1.5" : std::to_string(i % 9);
+      reads.push_back(MappedRead(string(chroms[c]) + "\t" +
+                                 std::to_string(start) + "\t" +
+                                 std::to_string(end) + "\tr" +
+                                 std::to_string(c*1000 + i) + "\t" + score +
+                                 "\t" + (i % 2 ? "-" : "+") + "\t" + seq +
+                                 "\t" + scr));
+    }
+  return reads;
+}
+
+static void
+write_reads(const string &filename, const vector<MappedRead> &reads,
+            const mr_binary::qual_mode qm) {
+  MappedReadBinaryWriter out(filename, qm, 100);
+  for (auto &mr : reads)
+    out << mr;
+  out.close();
+}
+
+static void
+test_round_trip(const string &filename, const vector<MappedRead> &reads) {
+  write_reads(filename, reads, mr_binary::full_quals);
+  MappedReadBinaryReader in(filename);
+  check(in.get_qual_mode() == mr_binary::full_quals, "qual mode");
+  check(in.get_n_blocks() == (reads.size() + 99)/100, "number of blocks");
+  check(in.get_chroms().size() == 3, "number of chroms");
+  MappedRead mr;
+  size_t n = 0;
+  while (in.read(mr)) {
+    if (n < reads.size())
+      check(mr.tostring() == reads[n].tostring(), "read " +
+            std::to_string(n) + "\n  " + mr.tostring() + "\n  " +
+            reads[n].tostring());
+    ++n;
+  }
+  check(n == reads.size(), "number of reads");
+}
+
+static void
+test_binned(const string &filename, const vector<MappedRead> &reads) {
+  write_reads(filename, reads, mr_binary::binned_quals);
+  MappedReadBinaryReader in(filename);
+  MappedRead mr;
+  check(in.read(mr), "binned: first read");
+  // Illumina bins: 0 and 1 stay, then 6, 15, 22, 27, 33, 37, 40
+  static const string allowed = "!\"'07<BFI";
+  bool ok = mr.scr.size() == reads[0].scr.size();
+  for (auto c : mr.scr)
+    ok = ok && allowed.find(c) != string::npos;
+  check(ok, "binned: quality values " + mr.scr);
+}
+
+static void
+test_seek(const string &filename, const vector<MappedRead> &reads) {
+  write_reads(filename, reads, mr_binary::no_quals);
+  MappedReadBinaryReader in(filename);
+  MappedRead mr;
+
+  in.seek_block(4);
+  MappedRead expected(reads[400]);
+  expected.scr.clear(); // written without qualities
+  check(in.read(mr) && mr.tostring() == expected.tostring(),
+        "seek_block: first read of block 4");
+
+  // the first read on chr2 at or after 1234 is at 1240, read 474
+  check(in.seek("chr2", 1234), "seek: found a block");
+  bool found = false;
+  while (!found && in.read(mr))
+    found = mr.r.get_chrom() == "chr2" && mr.r.get_start() >= 1234;
+  check(found && mr.r.get_name() == "r1124", "seek: first read at position");
+
+  check(!in.seek("chrX", 0), "seek: unknown chrom");
+  check(!in.seek("chrM", 1000000), "seek: past the last read");
+}
+
+static bool
+throws_on_open(const string &filename) {
+  try {
+    MappedReadBinaryReader in(filename);
+    MappedRead mr;
+    while (in.read(mr));
+  }
+  catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+static void
+test_damaged(const string &filename, const vector<MappedRead> &reads) {
+  write_reads(filename, reads, mr_binary::full_quals);
+  string data;
+  {
+    std::ifstream in(filename, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(in),
+                std::istreambuf_iterator<char>());
+  }
+  auto write_file = [&](const string &d) {
+    std::ofstream(filename, std::ios::binary) << d;
+  };
+
+  string d = data;
+  d[8] = 7; // quality mode
+  write_file(d);
+  check(throws_on_open(filename), "damaged: unknown quality mode");
+
+  write_file(data.substr(0, data.size() - 1));
+  check(throws_on_open(filename), "damaged: footer cut short");
+
+  d = data;
+  d[d.size() - 6] = 0x7f; // trailer offset far past the end
+  write_file(d);
+  check(throws_on_open(filename), "damaged: trailer offset");
+
+  // the number of chroms, just after the sorted flag in the trailer
+  size_t trailer = 0;
+  for (size_t i = 0; i < 8; ++i)
+    trailer |= static_cast<size_t>(static_cast<unsigned char>(
+      data[data.size() - 12 + i])) << (8*i);
+  d = data;
+  d[trailer + 4] = 0x7f;
+  write_file(d);
+  check(throws_on_open(filename), "damaged: number of chroms");
+
+  d = data;
+  d[12 + 4 + 3] = 0x7f; // raw size of the first block
+  write_file(d);
+  check(throws_on_open(filename), "damaged: block size");
+}
+
+int
+main() {
+  const string filename = "mapped_read_binary_test.mrb";
+  try {
+    const vector<MappedRead> reads = make_reads();
+    test_round_trip(filename, reads);
+    test_binned(filename, reads);
+    test_seek(filename, reads);
+    test_damaged(filename, reads);
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  std::remove(filename.c_str());
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Reads a few MB of MappedRead lines, plain and gzipped, through the
+ * pipeline with several parsing threads and small batches. The reads
+ * must come back complete and in file order, including lines split
+ * across decompressed blocks, and a bad line must be rethrown to the
+ * caller.
+ */
+
+#include "MappedReadPipeline.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+
+#include <zlib.h>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static const size_t n_lines = 60000;
+
+static string
+make_text() {
+  string text;
+  for (size_t i = 0; i < n_lines; ++i) {
+    text += "chr" + std::to_string(1 + i/20000) + "\t" + std::to_string(i) +
+      "\t" + std::to_string(i + 36) + "\tread" + std::to_string(i) +
+      "\t0\t+\tACGTACGTACGTACGTACGTACGTACGTACGTACGT\n";
+    if (i % 1000 == 0)
+      text += "\n"; // blank lines are skipped
+  }
+  return text;
+}
+
+static void
+check_order(const string &filename, const size_t n_threads) {
+  const string where = filename + " with " + std::to_string(n_threads) +
+    " threads: ";
+  MappedReadPipeline pipeline(filename, n_threads, 97, 4);
+  vector<MappedRead> batch;
+  size_t n = 0;
+  bool in_order = true;
+  while (pipeline.get_batch(batch))
+    for (auto &mr : batch) {
+      in_order = in_order && mr.r.get_name() == "read" + std::to_string(n) &&
+        mr.r.get_start() == n;
+      ++n;
+    }
+  check(in_order, where + "reads in file order");
+  check(n == n_lines, where + "number of reads " + std::to_string(n));
+  check(!pipeline, where + "at the end");
+}
+
+static void
+check_error(const string &filename) {
+  {
+    std::ofstream out(filename);
+    const string text = make_text();
+    // whole lines, so the bad line is not joined to a good one
+    out << text.substr(0, text.find('\n', 100000) + 1)
+        << "chr1\tbad line\n";
+  }
+  bool threw = false;
+  try {
+    MappedReadPipeline pipeline(filename, 3, 50, 4);
+    vector<MappedRead> batch;
+    while (pipeline.get_batch(batch));
+  }
+  catch (const std::runtime_error &) {
+    threw = true;
+  }
+  check(threw, "bad line rethrown to the caller");
+}
+
+int
+main() {
+  const string plain = "mapped_read_pipeline_test.mr";
+  const string gz = plain + ".gz";
+  try {
+    const string text = make_text();
+    std::ofstream(plain) << text;
+    gzFile out = gzopen(gz.c_str(), "wb");
+    if (!out || gzwrite(out, text.data(), text.size()) !=
+        static_cast<int>(text.size()) || gzclose(out) != Z_OK)
+      throw std::runtime_error("failed to write: " + gz);
+
+    check_order(plain, 1);
+    check_order(plain, 4);
+    check_order(gz, 3);
+    check_error(plain);
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  std::remove(plain.c_str());
+  std::remove(gz.c_str());
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,170 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Pairs a sorted stream of reads with MatePairer, with few enough
+ * reads allowed to wait that most are spilled and the spill files are
+ * split again. Every pair must be found once, with mates in position
+ * order, reads without a mate must go to the fragment output, and
+ * spilled reads must keep their reference ids and packed cigars.
+ */
+
+#include "mate_pair_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static sam_rec
+make_sam(const string &qname, const int flags, const int32_t chrom,
+         const int pos, const int32_t mate_chrom, const int pnext) {
+  const string rname = "chr" + std::to_string(chrom);
+  const string rnext = (mate_chrom == chrom) ? "=" :
+    "chr" + std::to_string(mate_chrom);
+  sam_rec sr(qname + "\t" + std::to_string(flags) + "\t" + rname + "\t" +
+             std::to_string(pos) + "\t60\t10M\t" + rnext + "\t" +
+             std::to_string(pnext) + "\t0\tACGTACGTAC\t*");
+  sr.rname_id = chrom;
+  sr.rnext_id = mate_chrom;
+  if (qname.back() % 2 == 0)
+    sr.pack_cigar();
+  return sr;
+}
+
+static bool
+by_position(const sam_rec &a, const sam_rec &b) {
+  return a.rname_id < b.rname_id ||
+    (a.rname_id == b.rname_id && a.pos < b.pos);
+}
+
+struct collect_pairs {
+  vector<std::pair<sam_rec, sam_rec> > out;
+  void operator()(const sam_rec &a, const sam_rec &b) {
+    out.push_back(std::make_pair(a, b));
+  }
+};
+
+struct collect_fragments {
+  vector<sam_rec> out;
+  void operator()(const sam_rec &sr) {out.push_back(sr);}
+};
+
+// the ids and cigar form given by make_sam
+static bool
+as_made(const sam_rec &sr) {
+  return sr.rname_id == sr.rname.back() - '0' &&
+    sr.has_packed_cigar() == (sr.qname.back() % 2 == 0);
+}
+
+static void
+test_pairing() {
+  const size_t n_same = 2000, n_cross = 300, n_orphans = 100;
+  vector<sam_rec> in;
+  // mates 5kb apart with a read every 10bp, so about 500 wait at once
+  for (size_t i = 0; i < n_same; ++i) {
+    const int pos = 100 + 10*i;
+    in.push_back(make_sam("s" + std::to_string(i), 99, 1, pos, 1, pos + 5000));
+    in.push_back(make_sam("s" + std::to_string(i), 147, 1, pos + 5000, 1, pos));
+  }
+  for (size_t i = 0; i < n_cross; ++i) {
+    in.push_back(make_sam("x" + std::to_string(i), 65, 1, 50 + 7*i, 2, 90));
+    in.push_back(make_sam("x" + std::to_string(i), 129, 2, 90, 1, 50 + 7*i));
+  }
+  // a mate that never comes, one that should have come before, and
+  // reads that are not paired at all
+  for (size_t i = 0; i < n_orphans; ++i) {
+    in.push_back(make_sam("o" + std::to_string(i), 99, 2, 1000 + i, 2, 9000));
+    in.push_back(make_sam("e" + std::to_string(i), 147, 2, 1000 + i, 2, 10));
+    in.push_back(make_sam("u" + std::to_string(i), 0, 2, 2000 + i, 2, 0));
+    in.push_back(make_sam("d" + std::to_string(i), 355, 2, 3000 + i, 2, 3500));
+  }
+  std::stable_sort(begin(in), end(in), by_position);
+
+  MatePairer pairer(40);
+  collect_pairs pairs;
+  collect_fragments fragments;
+  for (auto &sr : in)
+    pairer.add(sr, pairs, fragments);
+  pairer.flush(pairs, fragments);
+
+  check(pairer.get_n_spilled() > 1000, "some reads spilled: " +
+        std::to_string(pairer.get_n_spilled()));
+  check(pairs.out.size() == n_same + n_cross &&
+        pairer.get_n_pairs() == pairs.out.size(), "number of pairs " +
+        std::to_string(pairs.out.size()));
+  check(fragments.out.size() == 4*n_orphans &&
+        pairer.get_n_fragments() == fragments.out.size(),
+        "number of fragments " + std::to_string(fragments.out.size()));
+
+  std::map<string, size_t> seen;
+  bool mates_ok = true, order_ok = true, state_ok = true;
+  for (auto &p : pairs.out) {
+    ++seen[p.first.qname];
+    mates_ok = mates_ok && p.first.qname == p.second.qname &&
+      (p.first.flags & 0xC0) != (p.second.flags & 0xC0);
+    order_ok = order_ok && !by_position(p.second, p.first);
+    state_ok = state_ok && as_made(p.first) && as_made(p.second);
+  }
+  for (auto &f : fragments.out) {
+    ++seen[f.qname];
+    state_ok = state_ok && as_made(f) && f.qname[0] != 's' &&
+      f.qname[0] != 'x';
+  }
+  check(mates_ok, "mates have one name and other segments");
+  check(order_ok, "first mate is the earlier one");
+  check(state_ok, "reference ids and packed cigars kept");
+  check(seen.size() == n_same + n_cross + 4*n_orphans, "each name once");
+  bool once = true;
+  for (auto &s : seen)
+    once = once && s.second == 1;
+  check(once, "no name emitted twice");
+}
+
+int
+main() {
+  try {
+    test_pairing();
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,167 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Counts methylation from a few bisulfite reads over a short reference
+ * with one cytosine of each context on each strand. T-rich and A-rich
+ * reads on both strands, a deletion and soft clipping must each count
+ * the right sites, and the sites must come out per chrom in order.
+ */
+
+#include "methylation_utils.hpp"
+#include "bisulfite_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static sam_rec
+make_sam(const string &qname, const int flags, const string &rname,
+         const int pos, const string &cigar, const string &seq) {
+  return sam_rec(qname + "\t" + std::to_string(flags) + "\t" + rname + "\t" +
+                 std::to_string(pos) + "\t60\t" + cigar + "\t*\t0\t0\t" +
+                 seq + "\t*");
+}
+
+struct collect {
+  string out;
+  void operator()(const methylation_site &s) {
+    append_methylation_site(s, out);
+  }
+};
+
+//  position  0123456789012
+//  chr1      ACGACAGTCTTGA   CpG at 1/2, CHG at 4/6, CHH at 8/11
+//  chr2      CCGG            CHG at 0/3, CpG at 1/2
+static const vector<string> names = {"chr1", "chr2"};
+static const vector<string> seqs = {"ACGACAGTCTTGA", "CCGG"};
+
+static vector<sam_rec>
+make_reads() {
+  return {
+    // + strand: C at 1 and 8 kept, C at 4 converted
+    make_sam("t_fwd", 0, "chr1", 1, "13M", "ACGATAGTCTTGA"),
+    // reverse strand T-rich: the - strand, G at 2 and 11 kept
+    make_sam("t_rev", 16, "chr1", 1, "13M", "ACGACAATCTTGA"),
+    // A-rich: also the - strand, G at 6 kept
+    make_sam("a_fwd", bsflags::read_is_a_rich, "chr1", 1, "13M",
+             "ACAACAGTCTTAA"),
+    // not counted: unmapped
+    make_sam("unmapped", 4, "chr1", 1, "13M", "ACGACAGTCTTGA"),
+    // skips the C at 4 by a deletion, with the C at 8 converted
+    make_sam("clipped", 0, "chr1", 3, "2S2M1D5M", "NNGAAGTTT"),
+    make_sam("chr2", 0, "chr2", 1, "4M", "TCGG"),
+  };
+}
+
+static void
+test_counts() {
+  MethylationCounter counter(names, seqs);
+  collect out;
+  for (auto &sr : make_reads())
+    counter.add(sr, out);
+  counter.flush(out);
+  const string expected =
+    "chr1\t1\t+\tCpG\t1\t1\n"
+    "chr1\t2\t-\tCpG\t0.5\t2\n"
+    "chr1\t4\t+\tCHG\t0\t1\n"
+    "chr1\t6\t-\tCHG\t0.5\t2\n"
+    "chr1\t8\t+\tCHH\t0.5\t2\n"
+    "chr1\t11\t-\tCHH\t0.5\t2\n"
+    "chr2\t0\t+\tCHG\t0\t1\n"
+    "chr2\t1\t+\tCpG\t1\t1\n";
+  check(out.out == expected, "counts:\n" + out.out);
+}
+
+static void
+test_all_sites() {
+  MethylationCounter counter(names, seqs, false);
+  collect out;
+  for (auto &sr : make_reads())
+    counter.add(sr, out);
+  counter.flush(out);
+  // every C and G, covered or not
+  check(out.out.find("chr2\t2\t-\tCpG\t0\t0\n") != string::npos &&
+        out.out.find("chr2\t3\t-\tCHG\t0\t0\n") != string::npos,
+        "all sites:\n" + out.out);
+  size_t n_lines = 0;
+  for (auto c : out.out)
+    n_lines += (c == '\n');
+  check(n_lines == 10, "all sites: number " + std::to_string(n_lines));
+}
+
+static bool
+throws_on(const vector<sam_rec> &reads) {
+  MethylationCounter counter(names, seqs);
+  collect out;
+  try {
+    for (auto &sr : reads)
+      counter.add(sr, out);
+  }
+  catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+static void
+test_errors() {
+  check(throws_on({make_sam("a", 0, "chr3", 1, "4M", "ACGT")}),
+        "error: chrom not in reference");
+  check(throws_on({make_sam("a", 0, "chr1", 5, "4M", "ACGT"),
+                   make_sam("b", 0, "chr1", 2, "4M", "ACGT")}),
+        "error: unsorted position");
+  check(throws_on({make_sam("a", 0, "chr1", 1, "4M", "ACGT"),
+                   make_sam("b", 0, "chr2", 1, "4M", "ACGT"),
+                   make_sam("c", 0, "chr1", 5, "4M", "ACGT")}),
+        "error: unsorted chrom");
+}
+
+int
+main() {
+  try {
+    test_counts();
+    test_all_sites();
+    test_errors();
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,206 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Runs reads through PileupEngine and compares each column with counts
+ * made directly from the cigars. Spliced reads longer than the initial
+ * ring make it grow while other reads still have columns in it. Also
+ * checks base quality filtering, including thresholds above 94, and
+ * that unsorted input is rejected.
+ */
+
+#include "pileup_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <iterator>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cctype>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static sam_rec
+make_sam(const string &qname, const int flags, const string &rname,
+         const int pos, const string &cigar, const string &seq,
+         const string &qual) {
+  return sam_rec(qname + "\t" + std::to_string(flags) + "\t" + rname + "\t" +
+                 std::to_string(pos) + "\t60\t" + cigar + "\t*\t0\t0\t" +
+                 seq + "\t" + qual);
+}
+
+struct collect {
+  vector<pileup_column> out;
+  void operator()(const pileup_column &c) {out.push_back(c);}
+};
+
+typedef std::map<std::pair<string, uint32_t>, pileup_counts> count_map;
+
+static size_t
+base_kind(const char c) {
+  const string bases = "ACGT";
+  const size_t i = bases.find(c);
+  return i == string::npos ? pileup_base::N : i;
+}
+
+// the counts of each column, walking the cigar text directly
+static void
+count_directly(const sam_rec &sr, count_map &counts) {
+  uint32_t r = sr.pos - 1;
+  size_t q = 0, len = 0;
+  for (auto c : sr.cigar) {
+    if (std::isdigit(c)) {
+      len = 10*len + (c - '0');
+      continue;
+    }
+    for (size_t j = 0; j < len; ++j) {
+      pileup_counts &pc = counts[std::make_pair(sr.rname, r)];
+      uint32_t *strand = (sr.flags & samflags::read_rc) ? pc.rev : pc.fwd;
+      if (c == 'M') ++strand[base_kind(sr.seq[q])];
+      else if (c == 'D') ++strand[pileup_base::del];
+      if (c == 'M' || c == 'D' || c == 'N') ++r;
+      if (c == 'M' || c == 'I' || c == 'S') ++q;
+    }
+    len = 0;
+  }
+}
+
+static bool
+same_counts(const pileup_counts &a, const pileup_counts &b) {
+  for (size_t i = 0; i < pileup_base::n_kinds; ++i)
+    if (a.fwd[i] != b.fwd[i] || a.rev[i] != b.rev[i])
+      return false;
+  return true;
+}
+
+static void
+test_ring_growth() {
+  static const char *cigars[] = {
+    "30M", "10M2D20M", "5S25M", "10M3I17M", "15M20000N15M", "12M90000N18M"
+  };
+  const string seq = "ACGTNACGTAACCGGTTACGTACGTACGTA";
+  vector<sam_rec> in;
+  for (size_t i = 0; i < 600; ++i)
+    in.push_back(make_sam("r" + std::to_string(i), (i % 3 ? 0 : 16),
+                          i < 400 ? "chr1" : "chr2", 1 + 37*i,
+                          cigars[i % 6], seq, "*"));
+  PileupEngine engine;
+  collect out;
+  for (auto &sr : in)
+    engine.add(sr, out);
+  engine.flush(out);
+
+  count_map expected;
+  for (auto &sr : in)
+    count_directly(sr, expected);
+  // positions only skipped by N have no counts and are not emitted
+  for (auto i = begin(expected); i != end(expected);)
+    i = (i->second.total() == 0) ? expected.erase(i) : std::next(i);
+
+  check(out.out.size() == expected.size(), "ring: number of columns " +
+        std::to_string(out.out.size()) + " " +
+        std::to_string(expected.size()));
+  bool ok = true, in_order = true;
+  auto e = begin(expected);
+  for (size_t i = 0; i < out.out.size() && e != end(expected); ++i, ++e) {
+    ok = ok && out.out[i].chrom == e->first.first &&
+      out.out[i].pos == e->first.second &&
+      same_counts(out.out[i].counts, e->second);
+    in_order = in_order && (i == 0 || out.out[i - 1].chrom !=
+                            out.out[i].chrom ||
+                            out.out[i - 1].pos < out.out[i].pos);
+  }
+  check(ok, "ring: column counts");
+  check(in_order, "ring: columns in order");
+  check(engine.get_n_used() == in.size(), "ring: reads used");
+}
+
+static void
+test_base_quality() {
+  const sam_rec sr = make_sam("q", 0, "chr1", 1, "2M1D2M", "ACGT", "!5?~");
+  pileup_filter f;
+  f.min_base_qual = 20; // skips '!' (0) and '5' (20 is kept)
+  PileupEngine engine(f);
+  collect out;
+  engine.add(sr, out);
+  engine.flush(out);
+  check(out.out.size() == 4 && out.out[0].pos == 1 &&
+        out.out[0].counts.fwd[pileup_base::C] == 1,
+        "base quality: low base skipped");
+
+  for (const uint8_t q : {94, 95, 200, 255}) {
+    pileup_filter high;
+    high.min_base_qual = q;
+    PileupEngine strict(high);
+    collect o;
+    strict.add(sr, o);
+    strict.flush(o);
+    // only '~' (93) is near the top, so no base passes and only the
+    // deletion, which has no quality, is counted
+    check(o.out.size() == 1 && o.out[0].pos == 2 &&
+          o.out[0].counts.fwd[pileup_base::del] == 1,
+          "base quality: threshold " + std::to_string(q));
+  }
+}
+
+static void
+test_unsorted() {
+  PileupEngine engine;
+  collect out;
+  bool threw = false;
+  try {
+    engine.add(make_sam("a", 0, "chr1", 100, "4M", "ACGT", "*"), out);
+    engine.add(make_sam("b", 0, "chr1", 50, "4M", "ACGT", "*"), out);
+  }
+  catch (const std::runtime_error &) {
+    threw = true;
+  }
+  check(threw, "unsorted: position");
+}
+
+int
+main() {
+  try {
+    test_ring_growth();
+    test_base_quality();
+    test_unsorted();
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
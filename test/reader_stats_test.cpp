@@ -0,0 +1,176 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Checks the counts SAMTextReader keeps in reader_stats: every way of
+ * reading a file must count the same records and bytes, times are only
+ * kept with timing on, and the sampling and timer helpers add what
+ * they should.
+ */
+
+#include "reader_stats.hpp"
+#include "sam_text_io.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static const size_t n_records = 3000;
+
+// writes a SAM file and returns the bytes in its records
+static size_t
+write_file(const string &filename) {
+  std::ofstream out(filename);
+  out << "@HD\tVN:1.6\n@SQ\tSN:chr1\tLN:100000\n";
+  size_t n_bytes = 0;
+  for (size_t i = 0; i < n_records; ++i) {
+    const string line = "r" + std::to_string(i) + "\t0\tchr1\t" +
+      std::to_string(1 + i) + "\t60\t4M\t*\t0\t0\tACGT\tIIII\n";
+    out << line;
+    n_bytes += line.size();
+  }
+  return n_bytes;
+}
+
+static bool
+no_times(const reader_stats &s) {
+  return s.read_time == 0.0 && s.decode_time == 0.0 && s.parse_time == 0.0;
+}
+
+static void
+test_counts(const string &filename, const size_t n_bytes) {
+  {
+    SAMTextReader in(filename, 1000);
+    sam_rec sr;
+    while (in.get_sam_record(sr));
+    const reader_stats &s = in.get_stats();
+    check(s.n_records == n_records && s.n_bytes == n_bytes &&
+          s.n_filtered == 0, "one at a time: counts\n" + s.tostring());
+    check(no_times(s), "one at a time: no times without timing");
+    in.clear_stats();
+    check(in.get_stats().n_records == 0 && in.get_stats().n_bytes == 0,
+          "clear_stats");
+  }
+  {
+    SAMTextReader in(filename, 1000);
+    vector<sam_rec_view> views;
+    while (in.get_sam_views(views, 100));
+    const reader_stats &s = in.get_stats();
+    check(s.n_records == n_records && s.n_bytes == n_bytes,
+          "views: counts\n" + s.tostring());
+  }
+  {
+    SAMTextReader in(filename, 1000);
+    vector<sam_rec> batch;
+    while (in.get_sam_records_parallel(batch, 3, 5000));
+    const reader_stats &s = in.get_stats();
+    check(s.n_records == n_records && s.n_bytes == n_bytes,
+          "parallel: counts\n" + s.tostring());
+    check(no_times(s), "parallel: no times without timing");
+  }
+}
+
+static void
+test_timing(const string &filename) {
+  {
+    SAMTextReader in(filename);
+    in.set_timing(true);
+    sam_rec sr;
+    while (in.get_sam_record(sr));
+    const reader_stats &s = in.get_stats();
+    check(s.parse_time > 0.0 && s.decode_time == 0.0,
+          "timing: one at a time\n" + s.tostring());
+  }
+  {
+    SAMTextReader in(filename);
+    in.set_timing(true);
+    vector<sam_rec> batch;
+    while (in.get_sam_records_parallel(batch, 2, 5000));
+    check(in.get_stats().parse_time > 0.0, "timing: parallel");
+  }
+}
+
+static void
+test_helpers() {
+  const size_t k = reader_stats::timing_interval;
+  check(reader_stats::sample(true, 0) && !reader_stats::sample(true, 1) &&
+        reader_stats::sample(true, k) && !reader_stats::sample(true, k + 1) &&
+        !reader_stats::sample(false, 0), "sample");
+
+  const std::chrono::milliseconds nap(5);
+  double t_off = 0.0, t_one = 0.0, t_ten = 0.0;
+  {
+    scoped_stats_timer off(false, t_off);
+    scoped_stats_timer one(true, t_one);
+    scoped_stats_timer ten(true, t_ten, 10.0);
+    std::this_thread::sleep_for(nap);
+  }
+  check(t_off == 0.0, "timer: off adds nothing");
+  check(t_one >= 0.005 && t_ten >= 10*0.005,
+        "timer: weight " + std::to_string(t_one) + " " +
+        std::to_string(t_ten));
+
+  reader_stats s;
+  s.n_records = 3;
+  s.n_filtered = 2;
+  s.n_bytes = 100;
+  check(s.tostring() == "records: 3\nfiltered: 2\nbytes: 100\n"
+        "read_time: 0\ndecode_time: 0\nparse_time: 0", "tostring\n" +
+        s.tostring());
+}
+
+int
+main() {
+  const string filename = "reader_stats_test.sam";
+  try {
+    const size_t n_bytes = write_file(filename);
+    test_counts(filename, n_bytes);
+    test_timing(filename);
+    test_helpers();
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  std::remove(filename.c_str());
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
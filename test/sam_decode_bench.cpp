@@ -0,0 +1,172 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Times getting sam_rec objects from a SAM or BAM file two ways: the
+ * direct decode of each bam1_t in SAMReader, and formatting each
+ * bam1_t as text with sam_format1 and parsing that, as SAMReader did
+ * before. Reading the raw records alone is timed too, so the cost of
+ * each conversion can be seen. Without a file, about 500k records are
+ * generated and written as BAM.
+ *
+ *   usage: sam_decode_bench [file.sam|file.bam] [repeats]
+ */
+
+#include "htslib_wrapper.hpp"
+#include "sam_record.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+#include <htslib/sam.h>
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+}
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::runtime_error;
+
+static double
+seconds_since(const std::chrono::steady_clock::time_point &start) {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// a BAM file of n records with a mix of cigars and tags
+static void
+make_bam(const string &filename, const size_t n) {
+  static const char *cigars[] = {"100M", "40M2I58M", "30S70M", "50M500N50M"};
+  string header = "@HD\tVN:1.6\tSO:coordinate\n";
+  for (size_t c = 1; c <= 4; ++c)
+    header += "@SQ\tSN:chr" + std::to_string(c) + "\tLN:100000000\n";
+  SAMWriter out(filename, header, "wb");
+  const string seq(100, 'A'), qual(100, 'I');
+  for (size_t i = 0; i < n; ++i) {
+    const size_t chrom = 1 + 4*i/n;
+    const size_t pos = 1 + (i % (n/4 + 1))*150;
+    out << sam_rec("read" + std::to_string(i) + "\t" +
+                   std::to_string(i % 2 ? 83 : 99) + "\tchr" +
+                   std::to_string(chrom) + "\t" + std::to_string(pos) +
+                   "\t60\t" + cigars[i % 4] + "\t=\t" +
+                   std::to_string(pos + 200) + "\t300\t" + seq + "\t" +
+                   qual + "\tNM:i:" + std::to_string(i % 5) +
+                   "\tMD:Z:100\tAS:i:" + std::to_string(200 - i % 50) +
+                   "\tRG:Z:group1");
+  }
+  out.close();
+}
+
+static size_t
+read_raw(const string &filename) {
+  htsFile *hts = hts_open(filename.c_str(), "r");
+  if (!hts) throw runtime_error("cannot open file: " + filename);
+  bam_hdr_t *hdr = sam_hdr_read(hts);
+  bam1_t *b = bam_init1();
+  size_t n = 0;
+  while (sam_read1(hts, hdr, b) >= 0)
+    ++n;
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  hts_close(hts);
+  return n;
+}
+
+static size_t
+read_through_text(const string &filename) {
+  htsFile *hts = hts_open(filename.c_str(), "r");
+  if (!hts) throw runtime_error("cannot open file: " + filename);
+  bam_hdr_t *hdr = sam_hdr_read(hts);
+  bam1_t *b = bam_init1();
+  kstring_t ks = {0, 0, nullptr};
+  sam_rec sr;
+  size_t n = 0;
+  while (sam_read1(hts, hdr, b) >= 0) {
+    ks.l = 0;
+    if (sam_format1(hdr, b, &ks) < 0)
+      throw runtime_error("failed to format record from: " + filename);
+    sr.assign(ks.s, ks.l);
+    ++n;
+  }
+  free(ks.s);
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  hts_close(hts);
+  return n;
+}
+
+static size_t
+read_direct(const string &filename) {
+  SAMReader reader(filename);
+  sam_rec sr;
+  size_t n = 0;
+  while (reader.get_sam_record(sr))
+    ++n;
+  return n;
+}
+
+template <class Reader> static void
+time_it(const string &label, Reader read, const string &filename,
+        const size_t n_reps) {
+  double best = 0.0;
+  size_t n = 0;
+  for (size_t i = 0; i < n_reps; ++i) {
+    const auto start = std::chrono::steady_clock::now();
+    n = read(filename);
+    const double t = seconds_since(start);
+    if (i == 0 || t < best) best = t;
+  }
+  cout << std::left << std::setw(28) << label << std::right
+       << std::setw(10) << n << " records" << std::setw(10)
+       << std::fixed << std::setprecision(3) << best << " s"
+       << std::setw(12) << std::setprecision(0)
+       << (best > 0 ? n/best : 0.0) << " records/s" << endl;
+}
+
+int
+main(int argc, const char **argv) {
+  string filename = (argc > 1) ? argv[1] : "";
+  const size_t n_reps = (argc > 2) ? std::atoi(argv[2]) : 3;
+  const bool generated = filename.empty();
+  try {
+    if (generated) {
+      filename = "sam_decode_bench.bam";
+      make_bam(filename, 500000);
+    }
+    // best of n_reps, after the file is in the page cache
+    time_it("sam_read1 only", read_raw, filename, n_reps);
+    time_it("sam_format1 + parse", read_through_text, filename, n_reps);
+    time_it("direct decode (SAMReader)", read_direct, filename, n_reps);
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    if (generated) std::remove(filename.c_str());
+    return EXIT_FAILURE;
+  }
+  if (generated) std::remove(filename.c_str());
+  return EXIT_SUCCESS;
+}
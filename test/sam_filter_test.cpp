@@ -0,0 +1,181 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Checks the sam_filter spec grammar: each kind of clause, number
+ * bases, repeated clauses on one field, the same answers from keep()
+ * and from keep_core() after bind(), and errors for bad specs.
+ */
+
+#include "sam_filter.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static sam_rec
+make_sam(const int flags, const string &rname, const int mapq,
+         const string &tags = "") {
+  return sam_rec("r\t" + std::to_string(flags) + "\t" + rname + "\t100\t" +
+                 std::to_string(mapq) + "\t4M\t*\t0\t0\tACGT\t*" +
+                 (tags.empty() ? "" : "\t" + tags));
+}
+
+static const vector<string> ref_names = {"chr1", "chr2", "chr3"};
+
+// keep() and keep_core() with tags must agree, so check both
+static bool
+kept(const sam_filter &f, const sam_rec &sr) {
+  sam_filter bound(f);
+  bound.bind(ref_names);
+  int32_t id = -1;
+  for (size_t i = 0; i < ref_names.size(); ++i)
+    if (ref_names[i] == sr.rname) id = i;
+  const bool core = bound.keep_core(sr.flags, sr.mapq, id) &&
+    bound.keep_tags(sr);
+  if (core != f.keep(sr))
+    throw std::runtime_error("keep and keep_core differ for: " +
+                             sr.tostring());
+  return core;
+}
+
+static void
+test_clauses() {
+  const sam_filter f("require 0x3, exclude 0x904, mapq>=10, "
+                     "rname in {chr1, chr2}, NM<=5");
+  check(kept(f, make_sam(3, "chr1", 10, "NM:i:5")), "clauses: all hold");
+  check(!kept(f, make_sam(1, "chr1", 60, "NM:i:0")), "clauses: required");
+  check(!kept(f, make_sam(0x103, "chr1", 60, "NM:i:0")), "clauses: excluded");
+  check(!kept(f, make_sam(3, "chr1", 9, "NM:i:0")), "clauses: mapq");
+  check(!kept(f, make_sam(3, "chr3", 60, "NM:i:0")), "clauses: rname");
+  check(!kept(f, make_sam(3, "*", 60, "NM:i:0")), "clauses: unplaced");
+  check(!kept(f, make_sam(3, "chr2", 60, "NM:i:6")), "clauses: tag value");
+  check(!kept(f, make_sam(3, "chr2", 60)), "clauses: tag missing");
+  check(!kept(f, make_sam(3, "chr2", 60, "NM:Z:1")), "clauses: tag type");
+
+  const sam_filter empty("");
+  check(kept(empty, make_sam(0xfff, "chrX", 0)), "empty spec keeps all");
+}
+
+static void
+test_numbers() {
+  // flag masks take any base, other numbers are decimal
+  check(!kept(sam_filter("exclude 010"), make_sam(8, "chr1", 0)),
+        "numbers: octal mask");
+  check(!kept(sam_filter("exclude 16"), make_sam(16, "chr1", 0)),
+        "numbers: decimal mask");
+  check(kept(sam_filter("mapq>=010"), make_sam(0, "chr1", 10)) &&
+        !kept(sam_filter("mapq>=010"), make_sam(0, "chr1", 9)),
+        "numbers: decimal mapq");
+  check(kept(sam_filter("XN>-3"), make_sam(0, "chr1", 0, "XN:i:-2")),
+        "numbers: negative tag value");
+}
+
+static void
+test_mapq() {
+  const sam_filter ne("mapq!=255");
+  check(kept(ne, make_sam(0, "chr1", 254)) &&
+        !kept(ne, make_sam(0, "chr1", 255)), "mapq: != at the top");
+  const sam_filter hole("mapq>0, mapq<60, mapq!=30");
+  check(kept(hole, make_sam(0, "chr1", 29)) &&
+        !kept(hole, make_sam(0, "chr1", 30)) &&
+        kept(hole, make_sam(0, "chr1", 31)) &&
+        !kept(hole, make_sam(0, "chr1", 0)) &&
+        !kept(hole, make_sam(0, "chr1", 60)), "mapq: != inside a range");
+  const sam_filter eq("mapq==7");
+  check(kept(eq, make_sam(0, "chr1", 7)) && !kept(eq, make_sam(0, "chr1", 8)),
+        "mapq: ==");
+}
+
+static void
+test_repeated() {
+  const sam_filter narrowed("rname in {chr1,chr2}, rname in {chr2,chr3}");
+  check(!kept(narrowed, make_sam(0, "chr1", 0)) &&
+        kept(narrowed, make_sam(0, "chr2", 0)) &&
+        !kept(narrowed, make_sam(0, "chr3", 0)), "repeated: rname");
+  const sam_filter disjoint("rname in {chr1}, rname in {chr2}");
+  check(!kept(disjoint, make_sam(0, "chr1", 0)) &&
+        !kept(disjoint, make_sam(0, "chr2", 0)), "repeated: disjoint rname");
+  const sam_filter masks("require 0x1, require 0x2, exclude 0x4, exclude 0x8");
+  check(kept(masks, make_sam(3, "chr1", 0)) &&
+        !kept(masks, make_sam(1, "chr1", 0)) &&
+        !kept(masks, make_sam(11, "chr1", 0)), "repeated: flag masks");
+  const sam_filter tags("NM>=1, NM<=2");
+  check(kept(tags, make_sam(0, "chr1", 0, "NM:i:2")) &&
+        !kept(tags, make_sam(0, "chr1", 0, "NM:i:3")), "repeated: tags");
+}
+
+static bool
+rejected(const string &spec) {
+  try {
+    sam_filter f(spec);
+  }
+  catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+static void
+test_errors() {
+  const vector<string> bad = {
+    "require", "require 0x10000", "exclude -1", "exclude 0x4x",
+    "mapq>=", "mapq=5", "mapq>=1.5", "mapq>255", "mapq<0", "mapq>5,mapq<3",
+    "rname {chr1}", "rname in chr1", "rname in {chr1", "rname in {chr1}}",
+    "foo", "NMX<=3", "1M<=3", "NM<=abc", "NM<>3"
+  };
+  for (auto &spec : bad)
+    check(rejected(spec), "error: not rejected: " + spec);
+  check(!rejected(" mapq >= 5 , NM != 2 "), "error: spaces rejected");
+}
+
+int
+main() {
+  try {
+    test_clauses();
+    test_numbers();
+    test_mapq();
+    test_repeated();
+    test_errors();
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,159 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Checks that sam_header keeps the order of header lines when it
+ * writes them back, skips malformed lines other than @SQ, rejects bad
+ * @SQ lines, and takes its references from a target list when one is
+ * given, as for BAM files.
+ */
+
+#include "sam_header.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static void
+test_order() {
+  const string text =
+    "@HD\tVN:1.6\tSO:coordinate\n"
+    "@SQ\tSN:chr1\tLN:1000\tM5:abc\n"
+    "@SQ\tSN:chr2\tLN:2000\n"
+    "@PG\tID:aligner\tPN:abismal\n"
+    "@CO\tfirst comment\n"
+    "@RG\tID:g1\tSM:s1\n"
+    "@XY\tAB:cd\n"
+    "@PG\tID:sorter\tPP:aligner\n"
+    "@CO\tlast comment\n";
+  sam_header hdr(text);
+  check(hdr.tostring() == text, "order: written as read\n" + hdr.tostring());
+  check(hdr.n_refs() == 2 && hdr.ref_id("chr2") == 1 &&
+        hdr.ref_length(1) == 2000 && hdr.ref_id("chr3") == -1,
+        "order: references");
+  check(hdr.get_programs().size() == 2 &&
+        hdr.get_programs()[1].get("PP") == "aligner", "order: programs");
+
+  // @HD is always first, and lines added later go at the end
+  sam_header built;
+  built.add_ref("chrA", 10);
+  sam_header_line rg("RG");
+  rg.set("ID", "g2");
+  built.add_line(rg);
+  built.add_comment("note");
+  sam_header_line hd("HD");
+  hd.set("VN", "1.6");
+  built.add_line(hd);
+  built.add_ref("chrB", 20);
+  check(built.tostring() == "@HD\tVN:1.6\n@SQ\tSN:chrA\tLN:10\n"
+        "@SQ\tSN:chrB\tLN:20\n@RG\tID:g2\n@CO\tnote\n",
+        "order: built header\n" + built.tostring());
+}
+
+static void
+test_tolerant() {
+  sam_header hdr("@HD\tVN:1.6\t\n"        // trailing tab
+                 "not a header line\n"
+                 "@RG\tID:g1\tjunk\tSM:s1\n" // a field without a tag
+                 "@P\n"
+                 "\n"
+                 "@SQ\tSN:chr1\tLN:100\t\r\n");
+  check(hdr.get_hd().get("VN") == "1.6", "tolerant: @HD");
+  check(hdr.get_read_groups().size() == 1 &&
+        hdr.get_read_groups()[0].fields.size() == 2, "tolerant: @RG");
+  check(hdr.n_refs() == 1 && hdr.ref_length(0) == 100, "tolerant: @SQ");
+  check(hdr.tostring() ==
+        "@HD\tVN:1.6\n@RG\tID:g1\tSM:s1\n@SQ\tSN:chr1\tLN:100\n",
+        "tolerant: written\n" + hdr.tostring());
+}
+
+static bool
+throws_parse(const string &text) {
+  try {
+    sam_header hdr(text);
+  }
+  catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+static void
+test_bad_sq() {
+  check(throws_parse("@SQ\tLN:100\n"), "bad @SQ: no name");
+  check(throws_parse("@SQ\tSN:chr1\n"), "bad @SQ: no length");
+  check(throws_parse("@SQ\tSN:chr1\tLN:12x\n"), "bad @SQ: length");
+  check(throws_parse("@SQ\tSN:chr1\tLN:1\n@SQ\tSN:chr1\tLN:1\n"),
+        "bad @SQ: repeated name");
+}
+
+static void
+test_given_refs() {
+  const vector<string> names = {"chr1", "chr2"};
+  const vector<size_t> lengths = {100, 200};
+  sam_header hdr;
+  // the text disagrees with the target list, as it may in BAM files
+  hdr.parse("@HD\tVN:1.6\n@CO\tc\n@SQ\tSN:chr2\tLN:bad\tAS:x\n"
+            "@SQ\tSN:chr2\tLN:5\n@SQ\tSN:chr9\n@PG\tID:p\n",
+            names, lengths);
+  check(hdr.n_refs() == 2 && hdr.ref_id("chr2") == 1 &&
+        hdr.ref_length(1) == 200, "given refs: references");
+  check(hdr.tostring() == "@HD\tVN:1.6\n@CO\tc\n@SQ\tSN:chr1\tLN:100\n"
+        "@SQ\tSN:chr2\tLN:200\tAS:x\n@PG\tID:p\n",
+        "given refs: written\n" + hdr.tostring());
+
+  hdr.parse("@HD\tVN:1.6\n@PG\tID:p\n", names, lengths);
+  check(hdr.tostring() == "@HD\tVN:1.6\n@SQ\tSN:chr1\tLN:100\n"
+        "@SQ\tSN:chr2\tLN:200\n@PG\tID:p\n",
+        "given refs: no @SQ lines\n" + hdr.tostring());
+}
+
+int
+main() {
+  try {
+    test_order();
+    test_tolerant();
+    test_bad_sq();
+    test_given_refs();
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
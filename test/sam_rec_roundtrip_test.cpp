@@ -0,0 +1,174 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* SAMReader decodes each bam1_t straight into a sam_rec. This checks
+ * that the result matches formatting the same bam1_t with htslib's
+ * sam_format1 and parsing the text, for SAM and for BAM input. The
+ * records cover reverse strand, unmapped and unplaced reads, "*" for
+ * the sequence or qualities, and tags of every type.
+ */
+
+#include "htslib_wrapper.hpp"
+#include "sam_record.hpp"
+#include "cigar_utils.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" {
+#include <htslib/sam.h>
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+}
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+using std::runtime_error;
+
+static const char *sam_text =
+  "@HD\tVN:1.6\tSO:coordinate\n"
+  "@SQ\tSN:chr1\tLN:1000\n"
+  "@SQ\tSN:chr2\tLN:2000\n"
+  "r1\t99\tchr1\t10\t60\t5M1I2M2D3M\t=\t40\t41\tACGTACGTACG\t"
+  "IIIIIHHHHH#\tNM:i:3\tXi:i:-5\tXs:i:300\tXl:i:70000\tXu:i:-70000\n"
+  "r2\t16\tchr1\t20\t0\t3S8M\t*\t0\t0\tNNACGTTGCAA\t*\t"
+  "XA:A:x\tXZ:Z:some text\tXH:H:1AE301\n"
+  "r3\t0\tchr1\t30\t37\t4M\tchr2\t100\t0\t*\t*\t"
+  "Xf:f:0.5\tXg:f:-2.25\tXB:B:f,1.5,-3,0.25\n"
+  "r4\t83\tchr2\t50\t255\t2M1000N2M\t=\t10\t-44\tACGT\t!!~~\t"
+  "Xc:B:c,-1,2,-128\tXC:B:C,0,255\tXS:B:s,-300,300\tXI:B:I,0,4000000000\n"
+  "r5\t4\t*\t0\t0\t*\t*\t0\t0\tACGTN\t#####\n"
+  "r6\t69\tchr2\t60\t0\t*\t=\t60\t0\t*\t*\tRG:Z:grp\n";
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+// the records of a file as htslib formats them, parsed by sam_rec
+static vector<sam_rec>
+read_through_text(const string &filename) {
+  htsFile *hts = hts_open(filename.c_str(), "r");
+  if (!hts) throw runtime_error("cannot open file: " + filename);
+  bam_hdr_t *hdr = sam_hdr_read(hts);
+  bam1_t *b = bam_init1();
+  kstring_t ks = {0, 0, nullptr};
+  vector<sam_rec> records;
+  while (sam_read1(hts, hdr, b) >= 0) {
+    ks.l = 0;
+    if (sam_format1(hdr, b, &ks) < 0)
+      throw runtime_error("failed to format record from: " + filename);
+    records.push_back(sam_rec(string(ks.s, ks.l)));
+  }
+  free(ks.s);
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  hts_close(hts);
+  return records;
+}
+
+static vector<sam_rec>
+read_direct(const string &filename, const bool packed_cigar) {
+  SAMReader reader(filename);
+  reader.set_packed_cigar(packed_cigar);
+  vector<sam_rec> records;
+  sam_rec sr;
+  while (reader.get_sam_record(sr))
+    records.push_back(sr);
+  return records;
+}
+
+// copies the SAM file to BAM with htslib alone
+static void
+convert_to_bam(const string &sam_file, const string &bam_file) {
+  htsFile *in = hts_open(sam_file.c_str(), "r");
+  htsFile *out = hts_open(bam_file.c_str(), "wb");
+  if (!in || !out) throw runtime_error("cannot open test files");
+  bam_hdr_t *hdr = sam_hdr_read(in);
+  if (!hdr || sam_hdr_write(out, hdr) < 0)
+    throw runtime_error("failed to copy header to: " + bam_file);
+  bam1_t *b = bam_init1();
+  while (sam_read1(in, hdr, b) >= 0)
+    if (sam_write1(out, hdr, b) < 0)
+      throw runtime_error("failed to write record to: " + bam_file);
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  hts_close(in);
+  if (hts_close(out) < 0)
+    throw runtime_error("failed to close: " + bam_file);
+}
+
+static void
+compare(const string &filename) {
+  const vector<sam_rec> expected = read_through_text(filename);
+  const vector<sam_rec> direct = read_direct(filename, false);
+  const vector<sam_rec> packed = read_direct(filename, true);
+  check(expected.size() == 6, filename + ": record count");
+  check(direct.size() == expected.size(), filename + ": decoded count");
+  check(packed.size() == expected.size(), filename + ": packed count");
+  for (size_t i = 0; i < expected.size() && i < direct.size(); ++i) {
+    const sam_rec &e = expected[i], &d = direct[i];
+    const string where = filename + ": " + e.qname;
+    check(d.tostring() == e.tostring(), where + ": line\n  " +
+          d.tostring() + "\n  " + e.tostring());
+    check(d.flags == e.flags && d.pos == e.pos && d.pnext == e.pnext &&
+          d.tlen == e.tlen && d.mapq == e.mapq, where + ": numbers");
+    check(d.tags.size() == e.tags.size(), where + ": number of tags");
+    if (i < packed.size()) {
+      packed_cigar ops;
+      pack_cigar(e.cigar, ops);
+      check(packed[i].cigar_ops == ops, where + ": packed cigar");
+      check(packed[i].tostring() == e.tostring(), where + ": packed line");
+    }
+  }
+}
+
+int
+main() {
+  const string base = "sam_rec_roundtrip_test";
+  const string sam_file = base + ".sam", bam_file = base + ".bam";
+  try {
+    std::ofstream(sam_file) << sam_text;
+    convert_to_bam(sam_file, bam_file);
+    compare(sam_file);
+    compare(bam_file);
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  std::remove(sam_file.c_str());
+  std::remove(bam_file.c_str());
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Checks the typed accessors of sam_tags: values read back as set,
+ * setting a tag that exists changes it where it is, a tag of another
+ * type is not read as the type asked for, and erasing and copying the
+ * tags keeps the others intact.
+ */
+
+#include "sam_record.hpp"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdint>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static void
+test_get() {
+  const string text = "NM:i:3\tMD:Z:10A5\tXF:f:0.25\tXA:A:c\tXN:i:-12";
+  sam_tags tags;
+  tags.assign(text.data(), text.size());
+  check(tags.size() == 5 && tags.get_text() == text, "get: assigned");
+  int64_t i = 0;
+  double f = 0.0;
+  string s;
+  check(tags.get_int("NM", i) && i == 3, "get: int");
+  check(tags.get_int("XN", i) && i == -12, "get: negative int");
+  check(tags.get_float("XF", f) && f == 0.25, "get: float");
+  check(tags.get_string("MD", s) && s == "10A5", "get: string");
+  check(tags.get_string("XA", s) && s == "c", "get: char");
+  check(!tags.get_int("MD", i) && !tags.get_string("NM", s),
+        "get: other type");
+  check(!tags.get_int("AS", i) && tags.find("AS") == tags.size(),
+        "get: absent");
+  check(tags[1] == "MD:Z:10A5" && tags[1].type() == 'Z' &&
+        tags[1].name() == "MD", "get: view");
+
+  const string with_blanks = "\tNM:i:1\t\tAS:i:2\t";
+  tags.assign(with_blanks.data(), with_blanks.size());
+  check(tags.size() == 2 && tags.get_text() == "NM:i:1\tAS:i:2",
+        "get: empty fields skipped");
+}
+
+static void
+test_set() {
+  sam_tags tags;
+  tags.set_int("NM", 7);
+  tags.set_string("MD", "20");
+  tags.set_float("XF", 1.5);
+  check(tags.get_text() == "NM:i:7\tMD:Z:20\tXF:f:1.5", "set: appended " +
+        tags.get_text());
+
+  // longer, shorter and another type, each where the tag was
+  tags.set_int("NM", -1234567890123LL);
+  tags.set_string("MD", "");
+  tags.set_int("XF", 0);
+  check(tags.get_text() == "NM:i:-1234567890123\tMD:Z:\tXF:i:0",
+        "set: in place " + tags.get_text());
+  int64_t i = 0;
+  string s = "x";
+  check(tags.get_int("NM", i) && i == -1234567890123LL, "set: int value");
+  check(tags.get_string("MD", s) && s.empty(), "set: empty string");
+  check(tags.get_int("XF", i) && i == 0, "set: changed type");
+
+  tags.set_string("MD", "3C16");
+  check(tags.tag_begin(2) - tags.tag_begin(0) == 30 &&
+        tags[2] == "XF:i:0", "set: offsets after a change");
+}
+
+static void
+test_erase() {
+  const string text = "AA:i:1\tBB:i:2\tCC:i:3";
+  sam_tags tags;
+  tags.assign(text.data(), text.size());
+  tags.erase(1);
+  check(tags.get_text() == "AA:i:1\tCC:i:3" && tags[1] == "CC:i:3",
+        "erase: middle");
+  tags.erase(1);
+  check(tags.get_text() == "AA:i:1", "erase: last");
+  tags.erase(0);
+  check(tags.empty() && tags.get_text().empty(), "erase: only");
+
+  tags.assign(text.data(), text.size());
+  tags.set_int("BB", 20);
+  const vector<string> v = tags.to_vector();
+  check(v.size() == 3 && v[0] == "AA:i:1" && v[1] == "BB:i:20" &&
+        v[2] == "CC:i:3", "to_vector");
+}
+
+int
+main() {
+  try {
+    test_get();
+    test_set();
+    test_erase();
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+/* Part of Smith Lab software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* Writes SAM text, plain and gzipped, with SAMTextWriter and reads it
+ * back with SAMTextReader in every way it offers. Small blocks and
+ * chunk sizes make lines cross the ends of blocks and of the chunks
+ * given to each thread; the records must come back complete and in
+ * file order whatever the number of threads.
+ */
+
+#include "sam_text_io.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+static size_t n_failed = 0;
+
+static void
+check(const bool ok, const string &what) {
+  if (!ok) {
+    cerr << "FAILED: " << what << endl;
+    ++n_failed;
+  }
+}
+
+static const size_t n_records = 5000;
+static const string header_text =
+  "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:chr1\tLN:100000\n"
+  "@SQ\tSN:chr2\tLN:100000\n";
+
+static sam_rec
+make_record(const size_t i) {
+  // lengths vary so that lines end all over the blocks
+  const string seq(1 + (i*37) % 150, 'A');
+  const string chrom = i < n_records/2 ? "chr1" : "chr2";
+  return sam_rec("r" + std::to_string(i) + "\t0\t" + chrom + "\t" +
+                 std::to_string(1 + i) + "\t60\t" +
+                 std::to_string(seq.size()) + "M\t*\t0\t0\t" + seq + "\t*" +
+                 (i % 3 ? "\tNM:i:" + std::to_string(i % 4) : string()));
+}
+
+static void
+write_file(const string &filename) {
+  SAMTextWriter out(filename, 4096);
+  out.write_header(header_text);
+  for (size_t i = 0; i < n_records; ++i)
+    out << make_record(i);
+  out.close();
+}
+
+// the records of one read through the file, in order; records made
+// from views have no reference ids
+static bool
+same_records(const vector<sam_rec> &records, const bool with_ids = true) {
+  if (records.size() != n_records)
+    return false;
+  for (size_t i = 0; i < records.size(); ++i)
+    if (records[i].tostring() != make_record(i).tostring() ||
+        (with_ids && records[i].rname_id != (i < n_records/2 ? 0 : 1)))
+      return false;
+  return true;
+}
+
+static void
+test_single(const string &filename) {
+  SAMTextReader in(filename, 100);
+  check(in.get_header_text() == header_text, filename + ": header");
+  check(in.get_header().n_refs() == 2, filename + ": references");
+  vector<sam_rec> records;
+  sam_rec sr;
+  while (in.get_sam_record(sr))
+    records.push_back(sr);
+  check(same_records(records), filename + ": one at a time");
+  check(!in, filename + ": at the end");
+}
+
+static void
+test_parallel(const string &filename, const size_t n_threads,
+              const size_t max_bytes) {
+  const string where = filename + " with " + std::to_string(n_threads) +
+    " threads and " + std::to_string(max_bytes) + " bytes: ";
+  SAMTextReader in(filename, 1000);
+  vector<sam_rec> records, batch;
+  size_t n = 0, n_calls = 0;
+  while ((n = in.get_sam_records_parallel(batch, n_threads, max_bytes))) {
+    records.insert(end(records), begin(batch), begin(batch) + n);
+    ++n_calls;
+  }
+  check(same_records(records), where + "records in order");
+  check(max_bytes > 100000 || n_calls > 1, where + "several blocks");
+}
+
+static void
+test_views(const string &filename) {
+  SAMTextReader in(filename, 100);
+  vector<sam_rec_view> views;
+  vector<sam_rec> records;
+  while (in.get_sam_views(views, 13))
+    for (auto &v : views)
+      records.push_back(sam_rec(string(v.field_begin(0), v.tags_end())));
+  check(same_records(records, false), filename + ": views");
+}
+
+static void
+test_stdin(const string &filename) {
+  if (!std::freopen(filename.c_str(), "r", stdin))
+    throw std::runtime_error("cannot reopen stdin: " + filename);
+  {
+    SAMTextReader in("-", 512);
+    vector<sam_rec> records, batch;
+    size_t n = 0;
+    while ((n = in.get_sam_records_parallel(batch, 2, 2000)))
+      records.insert(end(records), begin(batch), begin(batch) + n);
+    check(same_records(records), "stdin: records");
+  }
+  check(fcntl(fileno(stdin), F_GETFD) != -1, "stdin: open after the reader");
+}
+
+static void
+test_bad_record(const string &filename) {
+  {
+    std::ofstream out(filename);
+    out << header_text;
+    for (size_t i = 0; i < 1000; ++i)
+      out << (i == 700 ? "bad\tline" : make_record(i).tostring()) << '\n';
+  }
+  bool threw = false;
+  try {
+    SAMTextReader in(filename);
+    vector<sam_rec> batch;
+    while (in.get_sam_records_parallel(batch, 4));
+  }
+  catch (const std::runtime_error &) {
+    threw = true;
+  }
+  check(threw, "bad record rethrown to the caller");
+}
+
+int
+main() {
+  const string plain = "sam_text_reader_test.sam";
+  const string gz = plain + ".gz";
+  try {
+    write_file(plain);
+    write_file(gz);
+    for (auto &f : {plain, gz}) {
+      test_single(f);
+      test_views(f);
+      for (size_t n_threads : {1, 3, 8})
+        for (size_t max_bytes : {50, 5000, 1 << 20})
+          test_parallel(f, n_threads, max_bytes);
+    }
+    test_stdin(gz);
+    test_bad_record(plain);
+  }
+  catch (const std::exception &e) {
+    cerr << "ERROR: " << e.what() << endl;
+    ++n_failed;
+  }
+  std::remove(plain.c_str());
+  std::remove(gz.c_str());
+  if (n_failed > 0) {
+    cerr << n_failed << " checks failed" << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
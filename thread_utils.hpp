@@ -0,0 +1,82 @@
+/* Part of SMITHLAB_CPP software
+ *
+ * Copyright (C) 2021 University of Southern California and
+ *                    Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef THREAD_UTILS_HPP
+#define THREAD_UTILS_HPP
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+/* BoundedQueue: a blocking FIFO with a fixed capacity, used to pass
+ * work between pipeline stages. push blocks while the queue is full
+ * and pop blocks while it is empty. After close(), push fails and pop
+ * drains what remains; abort() also discards what remains, so every
+ * waiting thread returns immediately.
+ */
+template <class T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(const size_t cap) :
+    capacity(std::max(cap, static_cast<size_t>(1))), closed(false) {}
+
+  bool push(T x) {
+    std::unique_lock<std::mutex> lock(mtx);
+    not_full.wait(lock, [this] {return closed || q.size() < capacity;});
+    if (closed) return false;
+    q.push_back(std::move(x));
+    not_empty.notify_one();
+    return true;
+  }
+
+  bool pop(T &x) {
+    std::unique_lock<std::mutex> lock(mtx);
+    not_empty.wait(lock, [this] {return closed || !q.empty();});
+    if (q.empty()) return false;
+    x = std::move(q.front());
+    q.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mtx);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+  void abort() {
+    std::lock_guard<std::mutex> lock(mtx);
+    closed = true;
+    q.clear();
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+private:
+  std::deque<T> q;
+  size_t capacity;
+  bool closed;
+  std::mutex mtx;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+};
+
+#endif